@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2006, Greg McIntyre
+ * All rights reserved. See the file named COPYING in the distribution
+ * for more details.
+ */
+
+/*
+ * Convert a text map to an opacity grid for fov_grid_open(), or check
+ * one.
+ *
+ *   fovgrid MAP GRID   Write the grid for the text map MAP to GRID.
+ *                      Each line of MAP is a row, in increasing y, and
+ *                      '#' is opaque; anything else is clear. Short
+ *                      lines are clear to the right.
+ *   fovgrid -c GRID    Check GRID's header and rows against their
+ *                      checksums.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fov/fov.h>
+
+/* Reading -------------------------------------------------------- */
+
+/* Read the whole of a file into a new buffer, setting *size to its
+ * length. */
+static char *read_file(const char *path, size_t *size) {
+    FILE *in = fopen(path, "rb");
+    char *buffer = NULL, *bigger;
+    size_t capacity = 0, n;
+
+    if (in == NULL) {
+        return NULL;
+    }
+    *size = 0;
+    do {
+        if (*size == capacity) {
+            capacity = capacity ? 2*capacity : 65536;
+            bigger = (char *)realloc(buffer, capacity);
+            if (bigger == NULL) {
+                free(buffer);
+                (void)fclose(in);
+                return NULL;
+            }
+            buffer = bigger;
+        }
+        n = fread(buffer + *size, 1, capacity - *size, in);
+        *size += n;
+    } while (n > 0);
+    if (ferror(in)) {
+        free(buffer);
+        buffer = NULL;
+    }
+    (void)fclose(in);
+    return buffer;
+}
+
+/* Commands ------------------------------------------------------- */
+
+static int convert(const char *map_path, const char *grid_path) {
+    fov_bitmap_type bitmap;
+    uint64_t *bits;
+    size_t size, i, x = 0, y = 0, width = 0, height = 0;
+    char *text = read_file(map_path, &size);
+    FILE *out;
+    bool ok;
+
+    if (text == NULL) {
+        fprintf(stderr, "fovgrid: cannot read %s\n", map_path);
+        return EXIT_FAILURE;
+    }
+
+    /* Measure the map, then fill it in. */
+    for (i = 0; i < size; ++i) {
+        if (text[i] == '\n') {
+            ++height;
+            x = 0;
+        } else if (text[i] != '\r' && ++x > width) {
+            width = x;
+        }
+    }
+    if (x > 0) {
+        ++height;
+    }
+    bitmap.width = (unsigned)width;
+    bitmap.height = (unsigned)height;
+    bitmap.stride = (width + 63)/64;
+    bits = (uint64_t *)calloc(bitmap.stride*height + 1, sizeof(uint64_t));
+    if (bits == NULL) {
+        fprintf(stderr, "fovgrid: out of memory\n");
+        free(text);
+        return EXIT_FAILURE;
+    }
+    for (i = 0, x = 0; i < size; ++i) {
+        if (text[i] == '\n') {
+            ++y;
+            x = 0;
+        } else if (text[i] != '\r') {
+            if (text[i] == '#') {
+                bits[y*bitmap.stride + x/64] |= (uint64_t)1 << (x%64);
+            }
+            ++x;
+        }
+    }
+    bitmap.bits = bits;
+    free(text);
+
+    out = fopen(grid_path, "wb");
+    ok = out != NULL && fov_grid_write(&bitmap, out);
+    if (out != NULL && fclose(out) != 0) {
+        ok = false;
+    }
+    free(bits);
+    if (!ok) {
+        fprintf(stderr, "fovgrid: cannot write %s\n", grid_path);
+        return EXIT_FAILURE;
+    }
+    printf("%s: %u x %u\n", grid_path, bitmap.width, bitmap.height);
+    return EXIT_SUCCESS;
+}
+
+static int check(const char *grid_path) {
+    fov_grid_type *grid = fov_grid_open(grid_path);
+    const fov_bitmap_type *bitmap;
+    bool ok;
+
+    if (grid == NULL) {
+        fprintf(stderr, "fovgrid: %s is not a version %d grid, or is damaged\n",
+                grid_path, FOV_GRID_VERSION);
+        return EXIT_FAILURE;
+    }
+    bitmap = fov_grid_bitmap(grid);
+    ok = fov_grid_verify(grid);
+    printf("%s: %u x %u, %s\n", grid_path, bitmap->width, bitmap->height,
+           ok ? "checksum ok" : "checksum FAILED");
+    fov_grid_close(grid);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 3 && strcmp(argv[1], "-c") == 0) {
+        return check(argv[2]);
+    } else if (argc == 3) {
+        return convert(argv[1], argv[2]);
+    }
+    fprintf(stderr, "usage: fovgrid MAP GRID\n       fovgrid -c GRID\n");
+    return EXIT_FAILURE;
+}
@@ -4,14 +4,20 @@
  * for more details.
  */
 
+#define _POSIX_C_SOURCE 200112L
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #define __USE_ISOC99 1
 #include <math.h>
-#include <float.h>
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "fov.h"
+#include "fov_octant.h"
 
 /*
 +---++---++---++---+
@@ -65,16 +71,174 @@ Slope from @ to X
 /* Types ---------------------------------------------------------- */
 
 /** \cond INTERNAL */
+
+/* A slope dy/dx held as an exact fraction n/d, d > 0. */
+typedef struct {
+    int n;
+    int d;
+} fov_slope_type;
+
+typedef struct fov_frame fov_frame_type;
+
+/* A column of an octant waiting to be scanned. The scanner keeps these
+ * on an explicit stack rather than recursing. */
+struct fov_frame {
+    int dx;
+    /* Row to resume scanning at, just after a blocked tile, or 0 to
+     * scan the column from the start. */
+    int dy;
+    /* First row of a run of lit tiles not yet passed to apply_span,
+     * or -1. */
+    int run;
+    fov_slope_type start_slope;
+    fov_slope_type end_slope;
+};
+
+/* Scratch space reused between scans, held in one block after this
+ * header: the scan stack, then the opacity of the column being
+ * scanned, each of size entries. */
+struct fov_scratch {
+    fov_frame_type *stack;
+    bool *opacity;
+    unsigned size;
+};
+
+/* Heights of each radius from 1 to max_radius in turn; those of radius
+ * r are the r+1 values from (r-1)*(r+2)/2. */
+struct fov_heights {
+    unsigned max_radius;
+    unsigned *values;
+};
+
+typedef struct fov_private_data fov_private_data_type;
+
+typedef void (*fov_octant_function)(fov_private_data_type *data, int dx,
+                                    fov_slope_type start_slope,
+                                    fov_slope_type end_slope);
+
+/* The octant functions for one combination of settings. */
 typedef struct {
+    fov_octant_function ppn, ppy, pmn, pmy, mpn, mpy, mmn, mmy;
+} fov_octants_type;
+
+struct fov_private_data {
     /*@observer@*/ fov_settings_type *settings;
+    /*@observer@*/ const fov_octants_type *octants;
     /*@observer@*/ void *map;
     /*@observer@*/ void *source;
+    /*@observer@*/ /*@null@*/ const fov_bitmap_type *bitmap;
+    /*@observer@*/ /*@null@*/ const fov_chunks_type *chunks;
+    /* The chunk last read from chunks, or NULL, and its position. */
+    /*@observer@*/ /*@null@*/ const uint64_t *chunk;
+    int chunk_x;
+    int chunk_y;
+    /*@observer@*/ /*@null@*/ uint64_t *visible;
+    /* Totals of lit tiles, kept instead of reporting them. */
+    /*@observer@*/ /*@null@*/ fov_stats_type *stats;
+    /*@observer@*/ /*@null@*/ unsigned long *bands;
+    /* Tiles whose opacity was tested, in the same window as visible. */
+    /*@observer@*/ /*@null@*/ uint64_t *probed;
+    size_t visible_stride;
+    /* Whether lit tiles are reported in runs, through fov_apply_span(). */
+    bool span;
+    /*@observer@*/ fov_frame_type *stack;
+    /* Opacity of the column being scanned, when filled in by opaque_span. */
+    /*@observer@*/ /*@null@*/ bool *opacity;
     int source_x;
     int source_y;
     unsigned radius;
-} fov_private_data_type;
+};
+
+/* The strictest alignment of anything kept in an arena. */
+typedef union {
+    uint64_t u;
+    double d;
+    void *p;
+} fov_align_type;
 /** \endcond */
 
+/* Memory --------------------------------------------------------- */
+
+static void *(*fov_alloc_function)(size_t size) = malloc;
+static void *(*fov_resize_function)(void *p, size_t size) = realloc;
+static void (*fov_release_function)(void *p) = free;
+
+void fov_set_allocator(void *(*alloc)(size_t size),
+                       void *(*resize)(void *p, size_t size),
+                       void (*release)(void *p)) {
+    if (alloc == NULL || resize == NULL || release == NULL) {
+        alloc = malloc;
+        resize = realloc;
+        release = free;
+    }
+    fov_alloc_function = alloc;
+    fov_resize_function = resize;
+    fov_release_function = release;
+}
+
+/*@null@*/ static void *fov_malloc(size_t size) {
+    return fov_alloc_function(size);
+}
+
+/*@null@*/ static void *fov_calloc(size_t n, size_t size) {
+    void *p;
+    if (size != 0 && n > (size_t)-1/size) {
+        return NULL;
+    }
+    p = fov_alloc_function(n*size);
+    if (p != NULL) {
+        memset(p, 0, n*size);
+    }
+    return p;
+}
+
+/*@null@*/ static void *fov_realloc(/*@null@*/ void *p, size_t size) {
+    return p != NULL ? fov_resize_function(p, size) : fov_alloc_function(size);
+}
+
+static void fov_free(/*@null@*/ void *p) {
+    if (p != NULL) {
+        fov_release_function(p);
+    }
+}
+
+void fov_arena_init(fov_arena_type *arena, void *buf, size_t size) {
+    arena->base = (unsigned char *)buf;
+    arena->size = buf != NULL ? size : 0;
+    arena->used = 0;
+}
+
+/* Take size bytes from the arena, or NULL if it has too few left. */
+/*@null@*/ static void *fov_arena_take(fov_arena_type *arena, size_t size) {
+    size_t start = arena->used;
+    size_t misalign = (size_t)((uintptr_t)(arena->base + start) % sizeof(fov_align_type));
+
+    if (misalign != 0) {
+        start += sizeof(fov_align_type) - misalign;
+    }
+    if (start > arena->size || size > arena->size - start) {
+        return NULL;
+    }
+    arena->used = start + size;
+    return arena->base + start;
+}
+
+/* Scratch space for the settings, from their arena if they have one. */
+/*@null@*/ static void *fov_settings_alloc(fov_settings_type *settings, size_t size) {
+    if (settings->arena != NULL) {
+        return fov_arena_take(settings->arena, size);
+    }
+    return fov_malloc(size);
+}
+
+/* Give back scratch space; that in an arena stays taken until the
+ * arena is set up again. */
+static void fov_settings_release(fov_settings_type *settings, /*@null@*/ void *p) {
+    if (settings->arena == NULL) {
+        fov_free(p);
+    }
+}
+
 /* Options -------------------------------------------------------- */
 
 void fov_settings_init(fov_settings_type *settings) { 
@@ -83,8 +247,14 @@ void fov_settings_init(fov_settings_type *settings) {
     settings->opaque_apply = FOV_OPAQUE_APPLY;
     settings->opaque = NULL;
     settings->apply = NULL;
+    settings->apply_span = NULL;
     settings->heights = NULL;
     settings->numheights = 0;
+    settings->opaque_span = NULL;
+    settings->shared_heights = NULL;
+    settings->chunks = NULL;
+    settings->arena = NULL;
+    settings->scratch = NULL;
 }
 
 void fov_settings_set_shape(fov_settings_type *settings,
@@ -108,6 +278,14 @@ void fov_settings_set_opacity_test_function(fov_settings_type *settings,
     settings->opaque = f;
 }
 
+void fov_settings_set_opacity_span_function(fov_settings_type *settings,
+                                            void (*f)(void *map,
+                                                      int x0, int y0,
+                                                      int x1, int y1,
+                                                      bool *opaque)) {
+    settings->opaque_span = f;
+}
+
 void fov_settings_set_apply_lighting_function(fov_settings_type *settings,
                                               void (*f)(void *map,
                                                         int x, int y,
@@ -116,48 +294,116 @@ void fov_settings_set_apply_lighting_function(fov_settings_type *settings,
     settings->apply = f;
 }
 
+void fov_settings_set_apply_span_function(fov_settings_type *settings,
+                                          void (*f)(void *map,
+                                                    int x0, int y0,
+                                                    int x1, int y1,
+                                                    void *src)) {
+    settings->apply_span = f;
+}
+
 /* Circular FOV --------------------------------------------------- */
 
-/*@null@*/ static unsigned *precalculate_heights(unsigned maxdist) {
+/* floor(sqrt(n)), exactly. */
+static unsigned fov_isqrt(uint64_t n) {
+    uint64_t r = (uint64_t)sqrt((double)n);
+    while (r*r > n) {
+        --r;
+    }
+    while ((r + 1)*(r + 1) <= n) {
+        ++r;
+    }
+    return (unsigned)r;
+}
+
+/*@null@*/ static unsigned *precalculate_heights(fov_settings_type *settings,
+                                                unsigned maxdist) {
     unsigned i;
-    unsigned *result = (unsigned *)malloc((maxdist+2)*sizeof(unsigned));
+    unsigned *result = (unsigned *)fov_settings_alloc(settings, (maxdist+2)*sizeof(unsigned));
     if (result) {
         for (i = 0; i <= maxdist; ++i) {
-            result[i] = (unsigned)sqrtf((float)(maxdist*maxdist - i*i));
+            result[i] = fov_isqrt((uint64_t)maxdist*maxdist - (uint64_t)i*i);
         }
         result[maxdist+1] = 0;
     }
     return result;
 }
 
-static unsigned height(fov_settings_type *settings, int x,
-                unsigned maxdist) {
+fov_heights_type *fov_heights_create(unsigned max_radius) {
+    size_t n = ((size_t)max_radius*(max_radius + 3))/2;
+    fov_heights_type *heights;
+    unsigned *values;
+    unsigned r, i;
+
+    heights = (fov_heights_type *)fov_malloc(sizeof(fov_heights_type) + n*sizeof(unsigned));
+    if (heights == NULL) {
+        return NULL;
+    }
+    heights->max_radius = max_radius;
+    heights->values = values = (unsigned *)(heights + 1);
+    for (r = 1; r <= max_radius; ++r) {
+        for (i = 0; i <= r; ++i) {
+            *values++ = fov_isqrt((uint64_t)r*r - (uint64_t)i*i);
+        }
+    }
+    return heights;
+}
+
+void fov_heights_free(fov_heights_type *heights) {
+    fov_free(heights);
+}
+
+void fov_settings_set_heights(fov_settings_type *settings,
+                              const fov_heights_type *heights) {
+    settings->shared_heights = heights;
+}
+
+void fov_settings_set_opacity_chunks(fov_settings_type *settings,
+                                     const fov_chunks_type *chunks) {
+    settings->chunks = chunks;
+}
+
+/* The settings' own heights of radius maxdist, calculated the first
+ * time they are needed, or NULL if out of memory. */
+/*@null@*/ static const unsigned *fov_settings_heights(fov_settings_type *settings,
+                                                       unsigned maxdist) {
     unsigned **newheights;
 
     if (maxdist > settings->numheights) {
-        newheights = (unsigned **)calloc((size_t)maxdist, sizeof(unsigned*));
+        newheights = (unsigned **)fov_settings_alloc(settings, (size_t)maxdist*sizeof(unsigned*));
         if (newheights != NULL) {
+            memset(newheights, 0, (size_t)maxdist*sizeof(unsigned*));
             if (settings->heights != NULL && settings->numheights > 0) {
                 /* Copy the pointers to the heights arrays we've already
                  * calculated. Once copied out, we can free the old
                  * array of pointers. */
                 memcpy(newheights, settings->heights,
                        settings->numheights*sizeof(unsigned*));
-                free(settings->heights);
+                fov_settings_release(settings, settings->heights);
             }
             settings->heights = newheights;
             settings->numheights = maxdist;
         }
     }
-    if (settings->heights) {
+    if (settings->heights && maxdist <= settings->numheights) {
         if (settings->heights[maxdist-1] == NULL) {
-            settings->heights[maxdist-1] = precalculate_heights(maxdist);
-        }
-        if (settings->heights[maxdist-1] != NULL) {
-            return settings->heights[maxdist-1][abs(x)];
+            settings->heights[maxdist-1] = precalculate_heights(settings, maxdist);
         }
+        return settings->heights[maxdist-1];
+    }
+    return NULL;
+}
+
+static unsigned height(fov_settings_type *settings, int x,
+                unsigned maxdist) {
+    const fov_heights_type *shared = settings->shared_heights;
+    const unsigned *heights;
+
+    if (shared != NULL && maxdist <= shared->max_radius) {
+        return shared->values[((size_t)maxdist - 1)*(maxdist + 2)/2 + (size_t)abs(x)];
     }
-    return 0;
+    heights = fov_settings_heights(settings, maxdist);
+    return heights != NULL ? heights[abs(x)] : 0;
 }
 
 void fov_settings_free(fov_settings_type *settings) {
@@ -166,262 +412,3622 @@ void fov_settings_free(fov_settings_type *settings) {
         if (settings->heights != NULL && settings->numheights > 0) {
             /*@+forloopexec@*/
             for (i = 0; i < settings->numheights; ++i) {
-                unsigned *h = settings->heights[i];
-                if (h != NULL) {
-                    free(h);
-                }
+                fov_settings_release(settings, settings->heights[i]);
                 settings->heights[i] = NULL;
             }
             /*@=forloopexec@*/
-            free(settings->heights);
+            fov_settings_release(settings, settings->heights);
             settings->heights = NULL;
             settings->numheights = 0;
         }
+        fov_settings_release(settings, settings->scratch);
+        settings->scratch = NULL;
     }
 }
 
-/* Slope ---------------------------------------------------------- */
+void fov_settings_set_arena(fov_settings_type *settings, fov_arena_type *arena) {
+    fov_settings_free(settings);
+    settings->arena = arena;
+}
 
-static float fov_slope(float dx, float dy) {
-    if (dx <= -FLT_EPSILON || dx >= FLT_EPSILON) {
-        return dy/dx;
-    } else {
-        return 0.0;
+/* Stack ---------------------------------------------------------- */
+
+/* Make sure the settings have a scan stack deep enough for radius. At
+ * most one column per distance from the source is waiting to be
+ * resumed at any time, plus the column being scanned. The opacity
+ * buffer filled in by opaque_span holds one column. */
+static bool fov_reserve_stack(fov_settings_type *settings, unsigned radius) {
+    size_t size = (size_t)radius + 2;
+    fov_scratch_type *scratch = settings->scratch;
+
+    if (scratch == NULL || size > scratch->size) {
+        scratch = (fov_scratch_type *)fov_settings_alloc(settings,
+            sizeof(fov_scratch_type) + size*(sizeof(fov_frame_type) + sizeof(bool)));
+        if (scratch == NULL) {
+            return false;
+        }
+        scratch->stack = (fov_frame_type *)(scratch + 1);
+        scratch->opacity = (bool *)(scratch->stack + size);
+        scratch->size = (unsigned)size;
+        fov_settings_release(settings, settings->scratch);
+        settings->scratch = scratch;
     }
+    return true;
 }
 
-/* Octants -------------------------------------------------------- */
+/* fov_circle_search() needs the deepest stack, of two columns of
+ * radius + 2 frames for each octant. */
+#define FOV_RESERVE_STACK(radius) (16*((radius) + 2) - 2)
+
+size_t fov_arena_size(unsigned max_radius) {
+    size_t frames = (size_t)FOV_RESERVE_STACK(max_radius) + 2;
+    size_t r = max_radius;
+
+    /* The stack and opacity buffer, the array of heights arrays and
+     * the heights themselves, each of which may need aligning. */
+    return sizeof(fov_scratch_type) + frames*(sizeof(fov_frame_type) + sizeof(bool))
+        + r*sizeof(unsigned *)
+        + r*(r + 5)/2*sizeof(unsigned)
+        + (r + 2)*(sizeof(fov_align_type) - 1);
+}
 
-#define FOV_DEFINE_OCTANT(signx, signy, rx, ry, nx, ny, nf, apply_edge, apply_diag)             \
-    static void fov_octant_##nx##ny##nf(                                                        \
-                                        fov_private_data_type *data,                            \
-                                        int dx,                                                 \
-                                        float start_slope,                                      \
-                                        float end_slope) {                                      \
-        int x, y, dy, dy0, dy1;                                                                 \
-        unsigned h;                                                                             \
-        int prev_blocked = -1;                                                                  \
-        float end_slope_next;                                                                   \
-        fov_settings_type *settings = data->settings;                                           \
-                                                                                                \
-        if (dx == 0) {                                                                          \
-            fov_octant_##nx##ny##nf(data, dx+1, start_slope, end_slope);                        \
-            return;                                                                             \
-        } else if ((unsigned)dx > data->radius) {                                               \
-            return;                                                                             \
-        }                                                                                       \
-                                                                                                \
-        dy0 = (int)(0.5f + ((float)dx)*start_slope);                                            \
-        dy1 = (int)(0.5f + ((float)dx)*end_slope);                                              \
-                                                                                                \
-        rx = data->source_##rx signx dx;                                                        \
-        ry = data->source_##ry signy dy0;                                                       \
-                                                                                                \
-        if (!apply_diag && dy1 == dx) {                                                         \
-            /* We do diagonal lines on every second octant, so they don't get done twice. */    \
-            --dy1;                                                                              \
-        }                                                                                       \
-                                                                                                \
-        switch (settings->shape) {                                                              \
-        case FOV_SHAPE_CIRCLE_PRECALCULATE:                                                     \
-            h = height(settings, dx, data->radius);                                             \
-            break;                                                                              \
-        case FOV_SHAPE_CIRCLE:                                                                  \
-            h = (unsigned)sqrtf((float)(data->radius*data->radius - dx*dx));                    \
-            break;                                                                              \
-        case FOV_SHAPE_OCTAGON:                                                                 \
-            h = (data->radius - dx)<<1;                                                         \
-            break;                                                                              \
-        default:                                                                                \
-            h = data->radius;                                                                   \
-            break;                                                                              \
-        };                                                                                      \
-        if ((unsigned)dy1 > h) {                                                                \
-            if (h == 0) {                                                                       \
-                return;                                                                         \
-            }                                                                                   \
-            dy1 = (int)h;                                                                       \
-        }                                                                                       \
-                                                                                                \
-        /*fprintf(stderr, "(%2d) = [%2d .. %2d] (%f .. %f), h=%d,edge=%d\n",                    \
-                dx, dy0, dy1, ((float)dx)*start_slope,                                          \
-                0.5f + ((float)dx)*end_slope, h, apply_edge);*/                                 \
-                                                                                                \
-        for (dy = dy0; dy <= dy1; ++dy) {                                                       \
-            ry = data->source_##ry signy dy;                                                    \
-                                                                                                \
-            if (settings->opaque(data->map, x, y)) {                                            \
-                if (settings->opaque_apply == FOV_OPAQUE_APPLY && (apply_edge || dy > 0)) {     \
-                    settings->apply(data->map, x, y, x - data->source_x, y - data->source_y, data->source);         \
-                }                                                                               \
-                if (prev_blocked == 0) {                                                        \
-                    end_slope_next = fov_slope((float)dx + 0.5f, (float)dy - 0.5f);             \
-                    fov_octant_##nx##ny##nf(data, dx+1, start_slope, end_slope_next);           \
-                }                                                                               \
-                prev_blocked = 1;                                                               \
-            } else {                                                                            \
-                if (apply_edge || dy > 0) {                                                     \
-                    settings->apply(data->map, x, y, x - data->source_x, y - data->source_y, data->source);         \
-                }                                                                               \
-                if (prev_blocked == 1) {                                                        \
-                    start_slope = fov_slope((float)dx - 0.5f, (float)dy - 0.5f);                \
-                }                                                                               \
-                prev_blocked = 0;                                                               \
-            }                                                                                   \
-        }                                                                                       \
-                                                                                                \
-        if (prev_blocked == 0) {                                                                \
-            fov_octant_##nx##ny##nf(data, dx+1, start_slope, end_slope);                        \
-        }                                                                                       \
+bool fov_settings_reserve(fov_settings_type *settings, unsigned max_radius) {
+    const fov_heights_type *shared = settings->shared_heights;
+    unsigned r;
+
+    if (!fov_reserve_stack(settings, FOV_RESERVE_STACK(max_radius))) {
+        return false;
+    }
+    if (settings->shape == FOV_SHAPE_CIRCLE_PRECALCULATE) {
+        /* Largest first, so the array of heights arrays is only
+         * allocated once. */
+        for (r = max_radius; r > 0 && (shared == NULL || r > shared->max_radius); --r) {
+            if (fov_settings_heights(settings, r) == NULL) {
+                return false;
+            }
+        }
     }
+    return true;
+}
 
-FOV_DEFINE_OCTANT(+,+,x,y,p,p,n,true,true)
-FOV_DEFINE_OCTANT(+,+,y,x,p,p,y,true,false)
-FOV_DEFINE_OCTANT(+,-,x,y,p,m,n,false,true)
-FOV_DEFINE_OCTANT(+,-,y,x,p,m,y,false,false)
-FOV_DEFINE_OCTANT(-,+,x,y,m,p,n,true,true)
-FOV_DEFINE_OCTANT(-,+,y,x,m,p,y,true,false)
-FOV_DEFINE_OCTANT(-,-,x,y,m,m,n,false,true)
-FOV_DEFINE_OCTANT(-,-,y,x,m,m,y,false,false)
+static void fov_push(fov_frame_type *stack, unsigned *sp, int dx, int dy, int run,
+                     fov_slope_type start_slope, fov_slope_type end_slope) {
+    stack[*sp].dx = dx;
+    stack[*sp].dy = dy;
+    stack[*sp].run = run;
+    stack[*sp].start_slope = start_slope;
+    stack[*sp].end_slope = end_slope;
+    ++*sp;
+}
 
+/* Visibility ----------------------------------------------------- */
 
-/* Circle --------------------------------------------------------- */
+size_t fov_visibility_stride(unsigned radius) {
+    return ((size_t)radius*2 + 1 + 63)/64;
+}
 
-static void _fov_circle(fov_private_data_type *data) {
-    /*
-     * Octants are defined by (x,y,r) where:
-     *  x = [p]ositive or [n]egative x increment
-     *  y = [p]ositive or [n]egative y increment
-     *  r = [y]es or [n]o for reflecting on axis x = y
-     *
-     *   \pmy|ppy/
-     *    \  |  /
-     *     \ | /
-     *   mpn\|/ppn
-     *   ----@----
-     *   mmn/|\pmn
-     *     / | \
-     *    /  |  \
-     *   /mmy|mpy\
-     */
-    fov_octant_ppn(data, 1, (float)0.0f, (float)1.0f);
-    fov_octant_ppy(data, 1, (float)0.0f, (float)1.0f);
-    fov_octant_pmn(data, 1, (float)0.0f, (float)1.0f);
-    fov_octant_pmy(data, 1, (float)0.0f, (float)1.0f);
-    fov_octant_mpn(data, 1, (float)0.0f, (float)1.0f);
-    fov_octant_mpy(data, 1, (float)0.0f, (float)1.0f);
-    fov_octant_mmn(data, 1, (float)0.0f, (float)1.0f);
-    fov_octant_mmy(data, 1, (float)0.0f, (float)1.0f);
+size_t fov_visibility_size(unsigned radius) {
+    return fov_visibility_stride(radius)*((size_t)radius*2 + 1);
 }
 
-void fov_circle(fov_settings_type *settings,
-                void *map,
-                void *source,
-                int source_x,
-                int source_y,
-                unsigned radius) {
-    fov_private_data_type data;
+bool fov_visibility_test(const uint64_t *visible, unsigned radius, int dx, int dy) {
+    unsigned vx, vy;
+    if (dx < -(int)radius || dx > (int)radius || dy < -(int)radius || dy > (int)radius) {
+        return false;
+    }
+    vx = (unsigned)(dx + (int)radius);
+    vy = (unsigned)(dy + (int)radius);
+    return ((visible[vy*fov_visibility_stride(radius) + (vx >> 6)] >> (vx & 63u)) & 1u) != 0;
+}
 
-    data.settings = settings;
-    data.map = map;
-    data.source = source;
-    data.source_x = source_x;
-    data.source_y = source_y;
-    data.radius = radius;
+/* Slope ---------------------------------------------------------- */
 
-    _fov_circle(&data);
+static fov_slope_type fov_slope(int n, int d) {
+    fov_slope_type slope;
+    slope.n = n;
+    slope.d = d;
+    return slope;
 }
 
-/**
- * Limit x to the range [a, b].
- */
-static float betweenf(float x, float a, float b) {
-    if (x - a < FLT_EPSILON) { /* x < a */
-        return a;
-    } else if (x - b > FLT_EPSILON) { /* x > b */
-        return b;
-    } else {
-        return x;
-    }
-}
-
-#define BEAM_DIRECTION(d, p1, p2, p3, p4, p5, p6, p7, p8)   \
-    if (direction == d) {                                   \
-        end_slope = betweenf(a, 0.0f, 1.0f);                \
-        fov_octant_##p1(&data, 1, 0.0f, end_slope);         \
-        fov_octant_##p2(&data, 1, 0.0f, end_slope);         \
-        if (a - 1.0f > FLT_EPSILON) { /* a > 1.0f */        \
-            start_slope = betweenf(2.0f - a, 0.0f, 1.0f);   \
-            fov_octant_##p3(&data, 1, start_slope, 1.0f);   \
-            fov_octant_##p4(&data, 1, start_slope, 1.0f);   \
-        }                                                   \
-        if (a - 2.0f > FLT_EPSILON) { /* a > 2.0f */        \
-            end_slope = betweenf(a - 2.0f, 0.0f, 1.0f);     \
-            fov_octant_##p5(&data, 1, 0.0f, end_slope);     \
-            fov_octant_##p6(&data, 1, 0.0f, end_slope);     \
-        }                                                   \
-        if (a - 3.0f > FLT_EPSILON) { /* a > 3.0f */        \
-            start_slope = betweenf(4.0f - a, 0.0f, 1.0f);   \
-            fov_octant_##p7(&data, 1, start_slope, 1.0f);   \
-            fov_octant_##p8(&data, 1, start_slope, 1.0f);   \
-        }                                                   \
-    }
-
-#define BEAM_DIRECTION_DIAG(d, p1, p2, p3, p4, p5, p6, p7, p8)  \
-    if (direction == d) {                                       \
-        start_slope = betweenf(1.0f - a, 0.0f, 1.0f);           \
-        fov_octant_##p1(&data, 1, start_slope, 1.0f);           \
-        fov_octant_##p2(&data, 1, start_slope, 1.0f);           \
-        if (a - 1.0f > FLT_EPSILON) { /* a > 1.0f */            \
-            end_slope = betweenf(a - 1.0f, 0.0f, 1.0f);         \
-            fov_octant_##p3(&data, 1, 0.0f, end_slope);         \
-            fov_octant_##p4(&data, 1, 0.0f, end_slope);         \
-        }                                                       \
-        if (a - 2.0f > FLT_EPSILON) { /* a > 2.0f */            \
-            start_slope = betweenf(3.0f - a, 0.0f, 1.0f);       \
-            fov_octant_##p5(&data, 1, start_slope, 1.0f);       \
-            fov_octant_##p6(&data, 1, start_slope, 1.0f);       \
-        }                                                       \
-        if (a - 3.0f > FLT_EPSILON) { /* a > 3.0f */            \
-            end_slope = betweenf(a - 3.0f, 0.0f, 1.0f);         \
-            fov_octant_##p7(&data, 1, 0.0f, end_slope);         \
-            fov_octant_##p8(&data, 1, 0.0f, end_slope);         \
-        }                                                       \
+/* Offset of the tile whose centre row the line at the given slope
+ * crosses at distance dx, i.e. (int)(0.5 + dx*slope). */
+static int fov_slope_row(int dx, fov_slope_type slope) {
+    return (int)(((int64_t)2*dx*slope.n + slope.d)/((int64_t)2*slope.d));
+}
+
+/* Chunked maps --------------------------------------------------- */
+
+/* Chunks are FOV_CHUNK_SIZE rows of FOV_CHUNK_SIZE tiles, one word per
+ * row, laid out as in fov_bitmap_type. */
+#define FOV_CHUNK_SIZE 64
+
+/** \cond INTERNAL */
+typedef struct {
+    /* Chunk coordinates, tile coordinates over FOV_CHUNK_SIZE. */
+    int x;
+    int y;
+    /* The chunk's rows, one of the shared chunks, or NULL for an empty
+     * slot. */
+    /*@null@*/ uint64_t *bits;
+} fov_chunk_slot_type;
+
+struct fov_chunks {
+    /* Open addressed hash table of chunks, probed linearly. */
+    fov_chunk_slot_type *slots;
+    /* Number of slots, a power of two. */
+    size_t capacity;
+    /* Number of slots in use. */
+    size_t count;
+    /* Number of chunks with rows of their own. */
+    size_t stored;
+};
+/** \endcond */
+
+#define FOV_ONES4 ~(uint64_t)0, ~(uint64_t)0, ~(uint64_t)0, ~(uint64_t)0
+#define FOV_ONES16 FOV_ONES4, FOV_ONES4, FOV_ONES4, FOV_ONES4
+
+/* The chunks shared by every wholly clear and wholly opaque chunk. They
+ * are never written to. */
+static const uint64_t fov_chunk_clear[FOV_CHUNK_SIZE] = { 0 };
+static const uint64_t fov_chunk_solid[FOV_CHUNK_SIZE] = { FOV_ONES16, FOV_ONES16, FOV_ONES16, FOV_ONES16 };
+
+/* floor(v/FOV_CHUNK_SIZE), without overflow. */
+static int fov_chunk_coord(int v) {
+    return v >= 0 ? v/FOV_CHUNK_SIZE : -1 - (-1 - v)/FOV_CHUNK_SIZE;
+}
+
+
+static bool fov_chunk_shared(const uint64_t *bits) {
+    return bits == fov_chunk_clear || bits == fov_chunk_solid;
+}
+
+/* The slot holding chunk (cx,cy), or the empty slot where it would
+ * go. */
+static fov_chunk_slot_type *fov_chunks_slot(const fov_chunks_type *chunks, int cx, int cy) {
+    size_t mask = chunks->capacity - 1;
+    /* Fibonacci hashing of both 32-bit coordinates at once; the high
+     * bits mix in all of them. */
+    uint64_t h = (((uint64_t)(uint32_t)cx << 32) | (uint32_t)cy)
+        *(((uint64_t)0x9E3779B9u << 32) | 0x7F4A7C15u);
+    size_t i = (size_t)(h >> 32) & mask;
+
+    while (chunks->slots[i].bits != NULL && (chunks->slots[i].x != cx || chunks->slots[i].y != cy)) {
+        i = (i + 1) & mask;
     }
+    return &chunks->slots[i];
+}
 
-void fov_beam(fov_settings_type *settings, void *map, void *source,
-              int source_x, int source_y, unsigned radius,
-              fov_direction_type direction, float angle) {
+/* The rows of chunk (cx,cy), which may be shared. */
+static const uint64_t *fov_chunks_find(const fov_chunks_type *chunks, int cx, int cy) {
+    const fov_chunk_slot_type *slot = fov_chunks_slot(chunks, cx, cy);
 
-    fov_private_data_type data;
-    float start_slope, end_slope, a;
+    return slot->bits != NULL ? slot->bits : fov_chunk_clear;
+}
 
-    data.settings = settings;
-    data.map = map;
-    data.source = source;
-    data.source_x = source_x;
-    data.source_y = source_y;
-    data.radius = radius;
+static bool fov_chunks_grow(fov_chunks_type *chunks) {
+    fov_chunk_slot_type *old = chunks->slots;
+    size_t i, capacity = chunks->capacity;
+    fov_chunk_slot_type *slots = (fov_chunk_slot_type *)fov_calloc(2*capacity, sizeof(fov_chunk_slot_type));
 
-    if (angle <= 0.0f) {
-        return;
-    } else if (angle >= 360.0f) {
-        _fov_circle(&data);
+    if (slots == NULL) {
+        return false;
+    }
+    chunks->slots = slots;
+    chunks->capacity = 2*capacity;
+    for (i = 0; i < capacity; ++i) {
+        if (old[i].bits != NULL) {
+            *fov_chunks_slot(chunks, old[i].x, old[i].y) = old[i];
+        }
+    }
+    fov_free(old);
+    return true;
+}
+
+/* The slot for chunk (cx,cy), added as a wholly clear chunk if it was
+ * not there, or NULL if out of memory. */
+static fov_chunk_slot_type *fov_chunks_insert(fov_chunks_type *chunks, int cx, int cy) {
+    fov_chunk_slot_type *slot = fov_chunks_slot(chunks, cx, cy);
+
+    if (slot->bits == NULL) {
+        /* Keep the table at most half full. */
+        if (2*(chunks->count + 1) > chunks->capacity) {
+            if (!fov_chunks_grow(chunks)) {
+                return NULL;
+            }
+            slot = fov_chunks_slot(chunks, cx, cy);
+        }
+        slot->x = cx;
+        slot->y = cy;
+        slot->bits = (uint64_t *)fov_chunk_clear;
+        ++chunks->count;
+    }
+    return slot;
+}
+
+/* Give the chunk in slot rows of its own, if it shares one of the
+ * shared chunks. */
+static bool fov_chunk_own(fov_chunks_type *chunks, fov_chunk_slot_type *slot) {
+    uint64_t *bits;
+
+    if (!fov_chunk_shared(slot->bits)) {
+        return true;
+    }
+    bits = (uint64_t *)fov_malloc(FOV_CHUNK_SIZE*sizeof(uint64_t));
+    if (bits == NULL) {
+        return false;
+    }
+    memcpy(bits, slot->bits, FOV_CHUNK_SIZE*sizeof(uint64_t));
+    slot->bits = bits;
+    ++chunks->stored;
+    return true;
+}
+
+/* Let the chunk in slot share the clear or opaque chunk. */
+static void fov_chunk_share(fov_chunks_type *chunks, fov_chunk_slot_type *slot, bool opaque) {
+    if (!fov_chunk_shared(slot->bits)) {
+        fov_free(slot->bits);
+        --chunks->stored;
+    }
+    slot->bits = (uint64_t *)(opaque ? fov_chunk_solid : fov_chunk_clear);
+}
+
+fov_chunks_type *fov_chunks_create(void) {
+    fov_chunks_type *chunks = (fov_chunks_type *)fov_malloc(sizeof(fov_chunks_type));
+
+    if (chunks == NULL) {
+        return NULL;
+    }
+    chunks->capacity = 64;
+    chunks->count = 0;
+    chunks->stored = 0;
+    chunks->slots = (fov_chunk_slot_type *)fov_calloc(chunks->capacity, sizeof(fov_chunk_slot_type));
+    if (chunks->slots == NULL) {
+        fov_free(chunks);
+        return NULL;
+    }
+    return chunks;
+}
+
+void fov_chunks_free(fov_chunks_type *chunks) {
+    size_t i;
+
+    if (chunks == NULL) {
         return;
     }
+    for (i = 0; i < chunks->capacity; ++i) {
+        if (chunks->slots[i].bits != NULL && !fov_chunk_shared(chunks->slots[i].bits)) {
+            fov_free(chunks->slots[i].bits);
+        }
+    }
+    fov_free(chunks->slots);
+    fov_free(chunks);
+}
 
-    /* Calculate the angle as a percentage of 45 degrees, halved (for
-     * each side of the centre of the beam). e.g. angle = 180.0f means
-     * half the beam is 90.0 which is 2x45, so the result is 2.0.
-     */
-    a = angle/90.0f;
+bool fov_chunks_set(fov_chunks_type *chunks, int x, int y, bool opaque) {
+    return fov_chunks_fill(chunks, x, y, x, y, opaque);
+}
 
-    BEAM_DIRECTION(FOV_EAST, ppn, pmn, ppy, mpy, pmy, mmy, mpn, mmn);
-    BEAM_DIRECTION(FOV_WEST, mpn, mmn, pmy, mmy, ppy, mpy, ppn, pmn);
-    BEAM_DIRECTION(FOV_NORTH, mpy, mmy, mmn, pmn, mpn, ppn, pmy, ppy);
-    BEAM_DIRECTION(FOV_SOUTH, pmy, ppy, mpn, ppn, mmn, pmn, mmy, mpy);
-    BEAM_DIRECTION_DIAG(FOV_NORTHEAST, pmn, mpy, mmy, ppn, mmn, ppy, mpn, pmy);
-    BEAM_DIRECTION_DIAG(FOV_NORTHWEST, mmn, mmy, mpn, mpy, pmy, pmn, ppy, ppn);
-    BEAM_DIRECTION_DIAG(FOV_SOUTHEAST, ppn, ppy, pmy, pmn, mpn, mpy, mmn, mmy);
-    BEAM_DIRECTION_DIAG(FOV_SOUTHWEST, pmy, mpn, ppy, mmn, ppn, mmy, pmn, mpy);
+/* Set the opacity of the tiles of chunk (cx,cy) from (x0,y0) to
+ * (x1,y1). */
+static bool fov_chunk_fill(fov_chunks_type *chunks, int cx, int cy,
+                           int x0, int y0, int x1, int y1, bool opaque) {
+    int64_t left = (int64_t)x0 - (int64_t)cx*FOV_CHUNK_SIZE;
+    int64_t right = (int64_t)x1 - (int64_t)cx*FOV_CHUNK_SIZE;
+    int64_t top = (int64_t)y0 - (int64_t)cy*FOV_CHUNK_SIZE;
+    int64_t bottom = (int64_t)y1 - (int64_t)cy*FOV_CHUNK_SIZE;
+    fov_chunk_slot_type *slot = fov_chunks_slot(chunks, cx, cy);
+    uint64_t mask;
+    int64_t row;
+
+    if (slot->bits == NULL ? !opaque : slot->bits == (opaque ? fov_chunk_solid : fov_chunk_clear)) {
+        /* Already as wanted. */
+        return true;
+    }
+    slot = fov_chunks_insert(chunks, cx, cy);
+    if (slot == NULL) {
+        return false;
+    }
+    left = left < 0 ? 0 : left;
+    right = right >= FOV_CHUNK_SIZE ? FOV_CHUNK_SIZE - 1 : right;
+    top = top < 0 ? 0 : top;
+    bottom = bottom >= FOV_CHUNK_SIZE ? FOV_CHUNK_SIZE - 1 : bottom;
+    if (left == 0 && right == FOV_CHUNK_SIZE - 1 && top == 0 && bottom == FOV_CHUNK_SIZE - 1) {
+        fov_chunk_share(chunks, slot, opaque);
+        return true;
+    }
+    if (!fov_chunk_own(chunks, slot)) {
+        return false;
+    }
+    mask = (~(uint64_t)0 >> (FOV_CHUNK_SIZE - 1 - right)) & (~(uint64_t)0 << left);
+    for (row = top; row <= bottom; ++row) {
+        if (opaque) {
+            slot->bits[row] |= mask;
+        } else {
+            slot->bits[row] &= ~mask;
+        }
+    }
+    return true;
+}
+
+bool fov_chunks_fill(fov_chunks_type *chunks, int x0, int y0, int x1, int y1, bool opaque) {
+    int cx, cy, cx0 = fov_chunk_coord(x0), cy0 = fov_chunk_coord(y0);
+    int cx1 = fov_chunk_coord(x1), cy1 = fov_chunk_coord(y1);
+    fov_chunk_slot_type *slot;
+    size_t i;
+
+    if (!opaque && (uint64_t)(cx1 - cx0 + 1)*(uint64_t)(cy1 - cy0 + 1) > chunks->capacity) {
+        /* Chunks not in the table are clear already, so only those in
+         * it need visiting. Clearing never adds to the table, whose
+         * slots stay where they are. */
+        for (i = 0; i < chunks->capacity; ++i) {
+            slot = &chunks->slots[i];
+            if (slot->bits != NULL && cx0 <= slot->x && slot->x <= cx1 && cy0 <= slot->y && slot->y <= cy1
+                && !fov_chunk_fill(chunks, slot->x, slot->y, x0, y0, x1, y1, false)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    for (cy = cy0; cy <= cy1; ++cy) {
+        for (cx = cx0; cx <= cx1; ++cx) {
+            if (!fov_chunk_fill(chunks, cx, cy, x0, y0, x1, y1, opaque)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool fov_chunks_opaque(const fov_chunks_type *chunks, int x, int y) {
+    const uint64_t *bits = fov_chunks_find(chunks, fov_chunk_coord(x), fov_chunk_coord(y));
+
+    return ((bits[(unsigned)y & (FOV_CHUNK_SIZE - 1)] >> ((unsigned)x & (FOV_CHUNK_SIZE - 1))) & 1u) != 0;
+}
+
+size_t fov_chunks_stored(const fov_chunks_type *chunks) {
+    return chunks->stored;
+}
+
+/* Read the opacity of (x,y) from the scan's chunked store, looking the
+ * chunk up only when it differs from the last one read. */
+static bool fov_chunks_read(fov_private_data_type *data, int x, int y) {
+    int cx = fov_chunk_coord(x), cy = fov_chunk_coord(y);
+
+    if (data->chunk == NULL || cx != data->chunk_x || cy != data->chunk_y) {
+        data->chunk = fov_chunks_find(data->chunks, cx, cy);
+        data->chunk_x = cx;
+        data->chunk_y = cy;
+    }
+    return ((data->chunk[(unsigned)y & (FOV_CHUNK_SIZE - 1)] >> ((unsigned)x & (FOV_CHUNK_SIZE - 1))) & 1u) != 0;
+}
+
+/* Opacity ------------------------------------------------------- */
+
+static bool fov_bitmap_opaque(const fov_bitmap_type *bitmap, int x, int y) {
+    if (x < 0 || y < 0 || (unsigned)x >= bitmap->width || (unsigned)y >= bitmap->height) {
+        return true;
+    }
+    return ((bitmap->bits[(size_t)y*bitmap->stride + ((unsigned)x >> 6)] >> ((unsigned)x & 63u)) & 1u) != 0;
+}
+
+/* Index of the lowest and highest set bits of a non-zero word. */
+static int fov_lowest_bit(uint64_t w) {
+#ifdef __GNUC__
+    return __builtin_ctzll(w);
+#else
+    int b = 0;
+    while (!(w & 1u)) {
+        w >>= 1;
+        ++b;
+    }
+    return b;
+#endif
+}
+
+static int fov_highest_bit(uint64_t w) {
+#ifdef __GNUC__
+    return 63 - __builtin_clzll(w);
+#else
+    int b = 63;
+    while (!(w >> 63)) {
+        w <<= 1;
+        --b;
+    }
+    return b;
+#endif
+}
+
+/* Find the run of tiles starting at (x,y) and stepping by step along the
+ * row which are all as opaque as (x,y), which is stored in *blocked.
+ * Returns the length of the run, at most n. Whole words of the row are
+ * skipped at a time. */
+static int fov_bitmap_run_x(const fov_bitmap_type *bitmap, int x, int y, int step, int n, bool *blocked) {
+    const uint64_t *row;
+    uint64_t flip, w;
+    int i, cx, avail;
+
+    *blocked = fov_bitmap_opaque(bitmap, x, y);
+    if (y < 0 || (unsigned)y >= bitmap->height) {
+        return n;
+    }
+    row = bitmap->bits + (size_t)y*bitmap->stride;
+    flip = *blocked ? ~(uint64_t)0 : 0;
+    i = 0;
+    while (i < n) {
+        cx = x + step*i;
+        if (cx < 0 || (unsigned)cx >= bitmap->width) {
+            /* Off the edge, where every tile is opaque. */
+            if (!*blocked) {
+                return i;
+            } else if ((cx < 0) == (step < 0)) {
+                return n;
+            }
+            i += cx < 0 ? -cx : cx - (int)bitmap->width + 1;
+            continue;
+        }
+        w = row[(unsigned)cx >> 6] ^ flip;
+        if (step > 0) {
+            w >>= (unsigned)cx & 63u;
+            avail = 64 - (cx & 63);
+            if (avail > (int)bitmap->width - cx) {
+                avail = (int)bitmap->width - cx;
+            }
+            if (w != 0 && fov_lowest_bit(w) < avail) {
+                i += fov_lowest_bit(w);
+                return i < n ? i : n;
+            }
+        } else {
+            w <<= 63u - ((unsigned)cx & 63u);
+            avail = (cx & 63) + 1;
+            if (w != 0) {
+                i += 63 - fov_highest_bit(w);
+                return i < n ? i : n;
+            }
+        }
+        i += avail;
+    }
+    return n;
+}
+
+/* As fov_bitmap_run_x, stepping along a column. The column's bits lie
+ * in different words, so each tile is tested on its own. */
+static int fov_bitmap_run_y(const fov_bitmap_type *bitmap, int x, int y, int step, int n, bool *blocked) {
+    int i;
+
+    *blocked = fov_bitmap_opaque(bitmap, x, y);
+    for (i = 1; i < n && fov_bitmap_opaque(bitmap, x, y + step*i) == *blocked; ++i) {
+    }
+    return i;
+}
+
+static bool fov_opaque(fov_private_data_type *data, int x, int y) {
+    if (data->chunks != NULL) {
+        return fov_chunks_read(data, x, y);
+    }
+    return data->settings->opaque(data->map, x, y);
+}
+
+/* Ask opaque_span for the opacity of the run of tiles from (x0,y0) to
+ * (x1,y1), which share a row or a column. */
+static void fov_opaque_span(fov_private_data_type *data, int x0, int y0, int x1, int y1) {
+    int t;
+
+    if (x0 > x1) {
+        t = x0; x0 = x1; x1 = t;
+    }
+    if (y0 > y1) {
+        t = y0; y0 = y1; y1 = t;
+    }
+    data->settings->opaque_span(data->map, x0, y0, x1, y1, data->opacity);
+}
+
+/* Lighting ------------------------------------------------------ */
+
+static void fov_apply(fov_private_data_type *data, int x, int y) {
+    data->settings->apply(data->map, x, y, x - data->source_x, y - data->source_y, data->source);
+}
+
+/* Mark tiles [vx0, vx1] of row vy of a bitset covering the window
+ * around the source. */
+static void fov_visible_row(fov_private_data_type *data, uint64_t *bits,
+                            unsigned vy, unsigned vx0, unsigned vx1) {
+    uint64_t *row = bits + vy*data->visible_stride;
+    unsigned w0 = vx0 >> 6, w1 = vx1 >> 6;
+    uint64_t first = ~(uint64_t)0 << (vx0 & 63u);
+    uint64_t last = ~(uint64_t)0 >> (63u - (vx1 & 63u));
+    unsigned w;
+
+    if (w0 == w1) {
+        row[w0] |= first & last;
+    } else {
+        row[w0] |= first;
+        for (w = w0 + 1; w < w1; ++w) {
+            row[w] = ~(uint64_t)0;
+        }
+        row[w1] |= last;
+    }
+}
+
+/* Mark the tiles from (x0,y0) to (x1,y1), x0 <= x1 and y0 <= y1, in a
+ * bitset covering the window around the source. */
+static void fov_visible_span(fov_private_data_type *data, uint64_t *bits,
+                             int x0, int y0, int x1, int y1) {
+    unsigned vx0, vx1, vy;
+
+    vx0 = (unsigned)(x0 - data->source_x) + data->radius;
+    vx1 = (unsigned)(x1 - data->source_x) + data->radius;
+    for (vy = (unsigned)(y0 - data->source_y) + data->radius;
+         vy <= (unsigned)(y1 - data->source_y) + data->radius; ++vy) {
+        fov_visible_row(data, bits, vy, vx0, vx1);
+    }
+}
+
+/* The octant owning the tile at offset (dx,dy) from the source,
+ * numbered as in fov_stats_type. */
+static unsigned fov_tile_octant(int dx, int dy) {
+    if (dx > 0 && -dx <= dy && dy <= dx) {
+        return dy >= 0 ? 0 : 2;
+    } else if (dx < 0 && dx <= dy && dy <= -dx) {
+        return dy >= 0 ? 4 : 6;
+    } else if (dy > 0) {
+        return dx >= 0 ? 1 : 3;
+    }
+    return dx >= 0 ? 5 : 7;
+}
+
+/* Sum of i*i for i from 1 to n, or minus that from n+1 to 0 for
+ * negative n, so that the sum from a to b is fov_sum_squares(b) -
+ * fov_sum_squares(a-1) either way. */
+static int64_t fov_sum_squares(int64_t n) {
+    return n*(n + 1)*(2*n + 1)/6;
+}
+
+/* Add the run of tiles at offsets (dx0,dy0) to (dx1,dy1) from the
+ * source, all in one column of one octant, to the totals. */
+static void fov_stats_span(fov_private_data_type *data, int dx0, int dy0, int dx1, int dy1) {
+    fov_stats_type *stats = data->stats;
+    int n = dx1 - dx0 + dy1 - dy0 + 1;
+
+    stats->cells += (unsigned long)n;
+    stats->octants[fov_tile_octant(dx1, dy1)] += (unsigned long)n;
+    if (dx0 == dx1) {
+        stats->distance2 += (uint64_t)((int64_t)n*dx0*dx0 + fov_sum_squares(dy1) - fov_sum_squares(dy0 - 1));
+    } else {
+        stats->distance2 += (uint64_t)((int64_t)n*dy0*dy0 + fov_sum_squares(dx1) - fov_sum_squares(dx0 - 1));
+    }
+    if (data->bands != NULL) {
+        /* Every tile of a column is the same number of steps away. */
+        data->bands[abs(dx1) > abs(dy1) ? abs(dx1) : abs(dy1)] += (unsigned long)n;
+    }
+}
+
+/* Report a straight run of lit tiles from (x0,y0) to (x1,y1), which
+ * share a row or a column. */
+static void fov_apply_span(fov_private_data_type *data, int x0, int y0, int x1, int y1) {
+    int t;
+
+    if (x0 > x1) {
+        t = x0; x0 = x1; x1 = t;
+    }
+    if (y0 > y1) {
+        t = y0; y0 = y1; y1 = t;
+    }
+    if (data->stats != NULL) {
+        fov_stats_span(data, x0 - data->source_x, y0 - data->source_y,
+                       x1 - data->source_x, y1 - data->source_y);
+    } else if (data->visible != NULL) {
+        fov_visible_span(data, data->visible, x0, y0, x1, y1);
+    } else {
+        data->settings->apply_span(data->map, x0, y0, x1, y1, data->source);
+    }
+}
+
+/* Record that the opacity of the tiles from (x0,y0) to (x1,y1), which
+ * share a row or a column, decided the scan. */
+static void fov_probe_span(fov_private_data_type *data, int x0, int y0, int x1, int y1) {
+    int t;
+
+    if (x0 > x1) {
+        t = x0; x0 = x1; x1 = t;
+    }
+    if (y0 > y1) {
+        t = y0; y0 = y1; y1 = t;
+    }
+    fov_visible_span(data, data->probed, x0, y0, x1, y1);
+}
+
+/* Call f on the run of tiles between rows first and last of the
+ * current column of an octant. Used inside FOV_DEFINE_OCTANT, where ry
+ * names the map coordinate that changes along the column. */
+#define FOV_SPAN(f, ry, signy, first, last)                         \
+    do {                                                            \
+        int span_x, span_y;                                         \
+        ry = data->source_##ry signy (first);                       \
+        span_x = x;                                                 \
+        span_y = y;                                                 \
+        ry = data->source_##ry signy (last);                        \
+        f(data, span_x, span_y, x, y);                              \
+    } while (0)
+
+/* Octants -------------------------------------------------------- */
+
+/* Height of the column dx tiles from the source, for the settings' shape. */
+static unsigned fov_column_height(fov_private_data_type *data, int dx) {
+    switch (data->settings->shape) {
+    case FOV_SHAPE_CIRCLE_PRECALCULATE:
+        return height(data->settings, dx, data->radius);
+    case FOV_SHAPE_CIRCLE:
+        return fov_isqrt((uint64_t)data->radius*data->radius - (uint64_t)dx*dx);
+    case FOV_SHAPE_OCTAGON:
+        return (data->radius - dx)<<1;
+    default:
+        return data->radius;
+    }
+}
+
+/* Hooks for FOV_OCTANT_SCAN, see fov_octant.h. */
+#define FOV_OCTANT_EMPTY() (sp == 0)
+#define FOV_OCTANT_POP()                                                                            \
+    do {                                                                                            \
+        --sp;                                                                                       \
+        dx = stack[sp].dx;                                                                          \
+        dy = stack[sp].dy;                                                                          \
+        run = stack[sp].run;                                                                        \
+        start_slope = stack[sp].start_slope;                                                        \
+        end_slope = stack[sp].end_slope;                                                            \
+    } while (0)
+#define FOV_OCTANT_PUSH(dx, dy, run, s, e) fov_push(stack, &sp, dx, dy, run, s, e)
+#define FOV_OCTANT_SLOPE(n, d) fov_slope(n, d)
+#define FOV_OCTANT_ROW(dx, s) fov_slope_row(dx, s)
+#define FOV_OCTANT_SOURCE(c) data->source_##c
+#define FOV_OCTANT_RADIUS data->radius
+#define FOV_OCTANT_HEIGHT(dx) fov_column_height(data, dx)
+#define FOV_OCTANT_COLUMN(ry, signy)                                                                \
+    do {                                                                                            \
+        if (data->opacity != NULL && dy <= dy1) {                                                   \
+            FOV_SPAN(fov_opaque_span, ry, signy, dy, dy1);                                          \
+        }                                                                                           \
+        dys = dy;                                                                                   \
+        same = 0;                                                                                   \
+    } while (0)
+#define FOV_OCTANT_TEST(ry, signy)                                                                  \
+    do {                                                                                            \
+        if (data->opacity != NULL) {                                                                \
+            blocked = (0 signy 1) > 0 ? data->opacity[dy - dys] : data->opacity[dy1 - dy];          \
+        } else if (data->bitmap == NULL) {                                                          \
+            blocked = fov_opaque(data, x, y);                                                       \
+        } else if (same > 0) {                                                                      \
+            --same;                                                                                 \
+        } else {                                                                                    \
+            same = fov_bitmap_run_##ry(data->bitmap, x, y, 0 signy 1, dy1 - dy + 1, &blocked) - 1;  \
+        }                                                                                           \
+    } while (0)
+#define FOV_OCTANT_PROBE(ry, signy, first, last)                                                    \
+    do {                                                                                            \
+        if (data->probed != NULL) {                                                                 \
+            FOV_SPAN(fov_probe_span, ry, signy, first, last);                                       \
+        }                                                                                           \
+    } while (0)
+#define FOV_OCTANT_APPLY(ry, signy)                                                                 \
+    do {                                                                                            \
+        if (!data->span) {                                                                          \
+            fov_apply(data, x, y);                                                                  \
+        } else if (run < 0) {                                                                       \
+            run = dy;                                                                               \
+        }                                                                                           \
+    } while (0)
+#define FOV_OCTANT_SPAN(ry, signy, first, last) FOV_SPAN(fov_apply_span, ry, signy, first, last)
+#define FOV_OCTANT_SKIP(ry, signy, apply_edge)                                                      \
+    do {                                                                                            \
+        if (same > 0 && data->span && (apply_edge || dy > 0)) {                                     \
+            /* Nothing changes until the end of the run. */                                         \
+            FOV_OCTANT_PROBE(ry, signy, dy + 1, dy + same);                                         \
+            dy += same;                                                                             \
+            same = 0;                                                                               \
+        }                                                                                           \
+    } while (0)
+
+#define FOV_DEFINE_OCTANT(signx, signy, rx, ry, nx, ny, nf, apply_edge, apply_diag)                 \
+    static void fov_octant_##nx##ny##nf(                                                            \
+                                        fov_private_data_type *data,                                \
+                                        int dx,                                                     \
+                                        fov_slope_type start_slope,                                 \
+                                        fov_slope_type end_slope) {                                 \
+        int x, y, dy, dy0, dy1;                                                                     \
+        unsigned h;                                                                                 \
+        int prev_blocked, run, dys, same;                                                           \
+        bool blocked;                                                                               \
+        fov_frame_type *stack = data->stack;                                                        \
+        unsigned sp = 0;                                                                            \
+        bool opaque_apply = data->settings->opaque_apply == FOV_OPAQUE_APPLY;                       \
+                                                                                                    \
+        if (dx == 0) {                                                                              \
+            dx = 1;                                                                                 \
+        }                                                                                           \
+        fov_push(stack, &sp, dx, 0, -1, start_slope, end_slope);                                    \
+        FOV_OCTANT_SCAN(signx, signy, rx, ry, apply_edge, apply_diag)                               \
+    }
+
+FOV_DEFINE_OCTANT(+,+,x,y,p,p,n,true,true)
+FOV_DEFINE_OCTANT(+,+,y,x,p,p,y,true,false)
+FOV_DEFINE_OCTANT(+,-,x,y,p,m,n,false,true)
+FOV_DEFINE_OCTANT(+,-,y,x,p,m,y,false,false)
+FOV_DEFINE_OCTANT(-,+,x,y,m,p,n,true,true)
+FOV_DEFINE_OCTANT(-,+,y,x,m,p,y,true,false)
+FOV_DEFINE_OCTANT(-,-,x,y,m,m,n,false,true)
+FOV_DEFINE_OCTANT(-,-,y,x,m,m,y,false,false)
+
+static const fov_octants_type fov_octants = {
+    fov_octant_ppn,
+    fov_octant_ppy,
+    fov_octant_pmn,
+    fov_octant_pmy,
+    fov_octant_mpn,
+    fov_octant_mpy,
+    fov_octant_mmn,
+    fov_octant_mmy
+};
+
+/* Circle --------------------------------------------------------- */
+
+static void fov_init_data(fov_private_data_type *data,
+                          fov_settings_type *settings,
+                          const fov_bitmap_type *bitmap,
+                          void *map, void *source,
+                          int source_x, int source_y, unsigned radius) {
+    data->settings = settings;
+    data->map = map;
+    data->source = source;
+    data->bitmap = bitmap;
+    data->chunks = settings->chunks;
+    data->chunk = NULL;
+    data->visible = NULL;
+    data->stats = NULL;
+    data->bands = NULL;
+    data->probed = NULL;
+    data->visible_stride = 0;
+    data->span = settings->apply_span != NULL;
+    data->stack = NULL;
+    data->opacity = NULL;
+    data->source_x = source_x;
+    data->source_y = source_y;
+    data->radius = radius;
+}
+
+/* Set up the scratch space for a scan. */
+static bool fov_prepare(fov_private_data_type *data) {
+    fov_settings_type *settings = data->settings;
+
+    if (!fov_reserve_stack(settings, data->radius)) {
+        return false;
+    }
+    data->octants = &fov_octants;
+    data->stack = settings->scratch->stack;
+    if (data->bitmap == NULL && data->chunks == NULL && settings->opaque_span != NULL) {
+        data->opacity = settings->scratch->opacity;
+    }
+    return true;
+}
+
+static void fov_init_visible(fov_private_data_type *data, uint64_t *visible) {
+    data->visible = visible;
+    data->visible_stride = fov_visibility_stride(data->radius);
+    data->span = true;
+    memset(visible, 0, fov_visibility_size(data->radius)*sizeof(uint64_t));
+}
+
+static void _fov_circle(fov_private_data_type *data) {
+    /*
+     * Octants are defined by (x,y,r) where:
+     *  x = [p]ositive or [n]egative x increment
+     *  y = [p]ositive or [n]egative y increment
+     *  r = [y]es or [n]o for reflecting on axis x = y
+     *
+     *   \pmy|ppy/
+     *    \  |  /
+     *     \ | /
+     *   mpn\|/ppn
+     *   ----@----
+     *   mmn/|\pmn
+     *     / | \
+     *    /  |  \
+     *   /mmy|mpy\
+     */
+    fov_slope_type zero = fov_slope(0, 1), one = fov_slope(1, 1);
+
+    if (!fov_prepare(data)) {
+        return;
+    }
+
+    data->octants->ppn(data, 1, zero, one);
+    data->octants->ppy(data, 1, zero, one);
+    data->octants->pmn(data, 1, zero, one);
+    data->octants->pmy(data, 1, zero, one);
+    data->octants->mpn(data, 1, zero, one);
+    data->octants->mpy(data, 1, zero, one);
+    data->octants->mmn(data, 1, zero, one);
+    data->octants->mmy(data, 1, zero, one);
+}
+
+void fov_circle(fov_settings_type *settings,
+                void *map,
+                void *source,
+                int source_x,
+                int source_y,
+                unsigned radius) {
+    fov_private_data_type data;
+
+    fov_init_data(&data, settings, NULL, map, source, source_x, source_y, radius);
+
+    _fov_circle(&data);
+}
+
+void fov_circle_bitmap(fov_settings_type *settings,
+                       const fov_bitmap_type *bitmap,
+                       void *map,
+                       void *source,
+                       int source_x,
+                       int source_y,
+                       unsigned radius) {
+    fov_private_data_type data;
+
+    fov_init_data(&data, settings, bitmap, map, source, source_x, source_y, radius);
+
+    _fov_circle(&data);
+}
+
+void fov_circle_visibility(fov_settings_type *settings,
+                           const fov_bitmap_type *bitmap,
+                           void *map,
+                           int source_x,
+                           int source_y,
+                           unsigned radius,
+                           uint64_t *visible) {
+    fov_private_data_type data;
+
+    fov_init_data(&data, settings, bitmap, map, NULL, source_x, source_y, radius);
+    fov_init_visible(&data, visible);
+
+    _fov_circle(&data);
+}
+
+void fov_circle_stats(fov_settings_type *settings,
+                      const fov_bitmap_type *bitmap,
+                      void *map,
+                      int source_x,
+                      int source_y,
+                      unsigned radius,
+                      fov_stats_type *stats,
+                      unsigned long *bands) {
+    fov_private_data_type data;
+
+    fov_init_data(&data, settings, bitmap, map, NULL, source_x, source_y, radius);
+    memset(stats, 0, sizeof(fov_stats_type));
+    if (bands != NULL) {
+        memset(bands, 0, ((size_t)radius + 1)*sizeof(unsigned long));
+    }
+    data.stats = stats;
+    data.bands = bands;
+    data.span = true;
+
+    _fov_circle(&data);
+}
+
+/* Beam angles are measured in fixed point, with FOV_FIXED_ONE units
+ * per 45 degrees, so that beam edges fall on the same tiles whatever
+ * the compiler does with floating point. */
+#define FOV_FIXED_ONE 65536
+
+/**
+ * Limit x to the range [0, FOV_FIXED_ONE] and return it as a slope.
+ */
+static fov_slope_type fov_fixed_slope(int x) {
+    if (x < 0) {
+        x = 0;
+    } else if (x > FOV_FIXED_ONE) {
+        x = FOV_FIXED_ONE;
+    }
+    return fov_slope(x, FOV_FIXED_ONE);
+}
+
+#define BEAM_DIRECTION(d, p1, p2, p3, p4, p5, p6, p7, p8)           \
+    if (direction == d) {                                           \
+        end_slope = fov_fixed_slope(a);                             \
+        data->octants->p1(data, 1, zero, end_slope);                \
+        data->octants->p2(data, 1, zero, end_slope);                \
+        if (a > FOV_FIXED_ONE) {                                    \
+            start_slope = fov_fixed_slope(2*FOV_FIXED_ONE - a);     \
+            data->octants->p3(data, 1, start_slope, one);           \
+            data->octants->p4(data, 1, start_slope, one);           \
+        }                                                           \
+        if (a > 2*FOV_FIXED_ONE) {                                  \
+            end_slope = fov_fixed_slope(a - 2*FOV_FIXED_ONE);       \
+            data->octants->p5(data, 1, zero, end_slope);            \
+            data->octants->p6(data, 1, zero, end_slope);            \
+        }                                                           \
+        if (a > 3*FOV_FIXED_ONE) {                                  \
+            start_slope = fov_fixed_slope(4*FOV_FIXED_ONE - a);     \
+            data->octants->p7(data, 1, start_slope, one);           \
+            data->octants->p8(data, 1, start_slope, one);           \
+        }                                                           \
+    }
+
+#define BEAM_DIRECTION_DIAG(d, p1, p2, p3, p4, p5, p6, p7, p8)      \
+    if (direction == d) {                                           \
+        start_slope = fov_fixed_slope(FOV_FIXED_ONE - a);           \
+        data->octants->p1(data, 1, start_slope, one);               \
+        data->octants->p2(data, 1, start_slope, one);               \
+        if (a > FOV_FIXED_ONE) {                                    \
+            end_slope = fov_fixed_slope(a - FOV_FIXED_ONE);         \
+            data->octants->p3(data, 1, zero, end_slope);            \
+            data->octants->p4(data, 1, zero, end_slope);            \
+        }                                                           \
+        if (a > 2*FOV_FIXED_ONE) {                                  \
+            start_slope = fov_fixed_slope(3*FOV_FIXED_ONE - a);     \
+            data->octants->p5(data, 1, start_slope, one);           \
+            data->octants->p6(data, 1, start_slope, one);           \
+        }                                                           \
+        if (a > 3*FOV_FIXED_ONE) {                                  \
+            end_slope = fov_fixed_slope(a - 3*FOV_FIXED_ONE);       \
+            data->octants->p7(data, 1, zero, end_slope);            \
+            data->octants->p8(data, 1, zero, end_slope);            \
+        }                                                           \
+    }
+
+static void _fov_beam(fov_private_data_type *data,
+                      fov_direction_type direction, float angle) {
+    fov_slope_type zero = fov_slope(0, 1), one = fov_slope(1, 1);
+    fov_slope_type start_slope, end_slope;
+    int a;
+
+    if (angle <= 0.0f) {
+        return;
+    } else if (angle >= 360.0f) {
+        _fov_circle(data);
+        return;
+    }
+
+    if (!fov_prepare(data)) {
+        return;
+    }
+
+    /* Calculate the angle as a percentage of 45 degrees, halved (for
+     * each side of the centre of the beam). e.g. angle = 180.0f means
+     * half the beam is 90.0 which is 2x45, so the result is 2.0, or
+     * 2*FOV_FIXED_ONE in fixed point.
+     */
+    a = (int)((double)angle*FOV_FIXED_ONE/90.0 + 0.5);
+
+    BEAM_DIRECTION(FOV_EAST, ppn, pmn, ppy, mpy, pmy, mmy, mpn, mmn);
+    BEAM_DIRECTION(FOV_WEST, mpn, mmn, pmy, mmy, ppy, mpy, ppn, pmn);
+    BEAM_DIRECTION(FOV_NORTH, mpy, mmy, mmn, pmn, mpn, ppn, pmy, ppy);
+    BEAM_DIRECTION(FOV_SOUTH, pmy, ppy, mpn, ppn, mmn, pmn, mmy, mpy);
+    BEAM_DIRECTION_DIAG(FOV_NORTHEAST, pmn, mpy, mmy, ppn, mmn, ppy, mpn, pmy);
+    BEAM_DIRECTION_DIAG(FOV_NORTHWEST, mmn, mmy, mpn, mpy, pmy, pmn, ppy, ppn);
+    BEAM_DIRECTION_DIAG(FOV_SOUTHEAST, ppn, ppy, pmy, pmn, mpn, mpy, mmn, mmy);
+    BEAM_DIRECTION_DIAG(FOV_SOUTHWEST, pmy, mpn, ppy, mmn, ppn, mmy, pmn, mpy);
+}
+
+void fov_beam(fov_settings_type *settings, void *map, void *source,
+              int source_x, int source_y, unsigned radius,
+              fov_direction_type direction, float angle) {
+
+    fov_private_data_type data;
+
+    fov_init_data(&data, settings, NULL, map, source, source_x, source_y, radius);
+
+    _fov_beam(&data, direction, angle);
+}
+
+void fov_beam_bitmap(fov_settings_type *settings,
+                     const fov_bitmap_type *bitmap,
+                     void *map, void *source,
+                     int source_x, int source_y, unsigned radius,
+                     fov_direction_type direction, float angle) {
+
+    fov_private_data_type data;
+
+    fov_init_data(&data, settings, bitmap, map, source, source_x, source_y, radius);
+
+    _fov_beam(&data, direction, angle);
+}
+
+void fov_beam_visibility(fov_settings_type *settings,
+                         const fov_bitmap_type *bitmap,
+                         void *map,
+                         int source_x, int source_y, unsigned radius,
+                         fov_direction_type direction, float angle,
+                         uint64_t *visible) {
+
+    fov_private_data_type data;
+
+    fov_init_data(&data, settings, bitmap, map, NULL, source_x, source_y, radius);
+    fov_init_visible(&data, visible);
+
+    _fov_beam(&data, direction, angle);
+}
+
+/* Cones ---------------------------------------------------------- */
+
+#define FOV_PI 3.14159265358979323846
+
+/* Cone edges which fall within this many radians of an octant's edge
+ * are taken to be on it, which covers the rounding of headings such as
+ * pi/4 to float. */
+#define FOV_CONE_EPSILON 1e-6
+
+/** \cond INTERNAL */
+/* The heading of an octant's edge, slope 0, and whether headings grow
+ * (+1) or shrink (-1) with the slope across the octant. Headings are
+ * anticlockwise from east, with north, towards -y, at pi/2. */
+typedef struct {
+    double base;
+    int sign;
+} fov_cone_octant_type;
+/** \endcond */
+
+static void _fov_cone(fov_private_data_type *data, float direction, float half_angle) {
+    static const fov_cone_octant_type octants[8] = {
+        { 0.0, -1 },            /* ppn */
+        { -FOV_PI/2, 1 },       /* ppy */
+        { 0.0, 1 },             /* pmn */
+        { -FOV_PI/2, -1 },      /* pmy */
+        { FOV_PI, 1 },          /* mpn */
+        { FOV_PI/2, -1 },       /* mpy */
+        { FOV_PI, -1 },         /* mmn */
+        { FOV_PI/2, 1 }         /* mmy */
+    };
+    fov_octant_function octant;
+    double h = half_angle, c, lo, hi;
+    int i, k;
+
+    if (h < 0.0) {
+        return;
+    } else if (h >= FOV_PI) {
+        _fov_circle(data);
+        return;
+    }
+    if (!fov_prepare(data)) {
+        return;
+    }
+
+    for (i = 0; i < 8; ++i) {
+        switch (i) {
+        case 0: octant = data->octants->ppn; break;
+        case 1: octant = data->octants->ppy; break;
+        case 2: octant = data->octants->pmn; break;
+        case 3: octant = data->octants->pmy; break;
+        case 4: octant = data->octants->mpn; break;
+        case 5: octant = data->octants->mpy; break;
+        case 6: octant = data->octants->mmn; break;
+        default: octant = data->octants->mmy; break;
+        }
+        /* The heading across the octant from its edge, in (-pi, pi]. */
+        c = fmod(octants[i].sign*((double)direction - octants[i].base), 2*FOV_PI);
+        if (c > FOV_PI) {
+            c -= 2*FOV_PI;
+        } else if (c <= -FOV_PI) {
+            c += 2*FOV_PI;
+        }
+        /* A cone of less than a full turn covers at most two pieces of
+         * an octant, one from each end. */
+        for (k = -1; k <= 1; ++k) {
+            lo = c + 2*FOV_PI*k - h;
+            hi = c + 2*FOV_PI*k + h;
+            if (lo < 0.0) {
+                lo = 0.0;
+            }
+            if (hi > FOV_PI/4) {
+                hi = FOV_PI/4;
+            }
+            if (lo <= hi + FOV_CONE_EPSILON) {
+                octant(data, 1,
+                       fov_fixed_slope((int)(tan(lo)*FOV_FIXED_ONE + 0.5)),
+                       fov_fixed_slope((int)(tan(hi)*FOV_FIXED_ONE + 0.5)));
+            }
+        }
+    }
+}
+
+void fov_cone(fov_settings_type *settings, void *map, void *source,
+              int source_x, int source_y, unsigned radius,
+              float direction, float half_angle) {
+    fov_private_data_type data;
+
+    fov_init_data(&data, settings, NULL, map, source, source_x, source_y, radius);
+
+    _fov_cone(&data, direction, half_angle);
+}
+
+void fov_cone_bitmap(fov_settings_type *settings,
+                     const fov_bitmap_type *bitmap,
+                     void *map, void *source,
+                     int source_x, int source_y, unsigned radius,
+                     float direction, float half_angle) {
+    fov_private_data_type data;
+
+    fov_init_data(&data, settings, bitmap, map, source, source_x, source_y, radius);
+
+    _fov_cone(&data, direction, half_angle);
+}
+
+void fov_cone_visibility(fov_settings_type *settings,
+                         const fov_bitmap_type *bitmap,
+                         void *map,
+                         int source_x, int source_y, unsigned radius,
+                         float direction, float half_angle,
+                         uint64_t *visible) {
+    fov_private_data_type data;
+
+    fov_init_data(&data, settings, bitmap, map, NULL, source_x, source_y, radius);
+    fov_init_visible(&data, visible);
+
+    _fov_cone(&data, direction, half_angle);
+}
+
+/* Line of sight -------------------------------------------------- */
+
+/** \cond INTERNAL */
+/* An octant as fov_los() walks it, with the same signs and edges as
+ * the octant functions. Reflected octants swap the x and y axes. */
+typedef struct {
+    int signx;
+    int signy;
+    bool reflect;
+    bool apply_edge;
+    bool apply_diag;
+} fov_los_octant_type;
+/** \endcond */
+
+static const fov_los_octant_type fov_los_octants[8] = {
+    {  1,  1, false, true,  true  },    /* ppn */
+    {  1,  1, true,  true,  false },    /* ppy */
+    {  1, -1, false, false, true  },    /* pmn */
+    {  1, -1, true,  false, false },    /* pmy */
+    { -1,  1, false, true,  true  },    /* mpn */
+    { -1,  1, true,  true,  false },    /* mpy */
+    { -1, -1, false, false, true  },    /* mmn */
+    { -1, -1, true,  false, false }     /* mmy */
+};
+
+/* Number of clear tiles in the column dx of an octant, starting at row
+ * dy and stepping by step, at most n. */
+static int fov_los_clear(fov_private_data_type *data, const fov_los_octant_type *o,
+                         int dx, int dy, int step, int n) {
+    int x, y, i;
+    bool blocked;
+
+    if (o->reflect) {
+        x = data->source_x + o->signy*dy;
+        y = data->source_y + o->signx*dx;
+    } else {
+        x = data->source_x + o->signx*dx;
+        y = data->source_y + o->signy*dy;
+    }
+    if (data->bitmap != NULL) {
+        if (o->reflect) {
+            i = fov_bitmap_run_x(data->bitmap, x, y, o->signy*step, n, &blocked);
+        } else {
+            i = fov_bitmap_run_y(data->bitmap, x, y, o->signy*step, n, &blocked);
+        }
+        return blocked ? 0 : i;
+    }
+    for (i = 0; i < n; ++i) {
+        if (fov_opaque(data, o->reflect ? x + o->signy*step*i : x,
+                       o->reflect ? y : y + o->signy*step*i)) {
+            break;
+        }
+    }
+    return i;
+}
+
+/* ceil(n/d) for d > 0. */
+static int64_t fov_ceil_div(int64_t n, int64_t d) {
+    return n >= 0 ? (n + d - 1)/d : -((-n)/d);
+}
+
+/* Find whether the octant lights the tile at (tdx,tdy) in its own
+ * coordinates, setting *lit if so. Returns false if the scan would
+ * overrun the stack, which the bound below rules out. This follows the octant function's scan, but splits each
+ * column into its runs of clear tiles directly and follows only the
+ * runs whose slopes can still reach the target. A run starting at a
+ * slope of (2*tdy+1)/(2*tdx) or more starts below the target's row in
+ * its column, and one ending below (2*tdy-1)/(2*tdx) ends above it;
+ * slopes only narrow from column to column, so neither can light it. */
+static bool fov_los_octant(fov_private_data_type *data, const fov_los_octant_type *o,
+                           int tdx, int tdy, bool *lit) {
+    fov_frame_type *stack = data->stack;
+    unsigned sp = 0, size = data->settings->scratch->size;
+    const int64_t hn = 2*(int64_t)tdy + 1, ln = 2*(int64_t)tdy - 1, td = 2*(int64_t)tdx;
+    fov_slope_type start_slope, end_slope;
+    int dx, dy, dy0, dy1, lo, hi, a, b, n;
+    int64_t a_hi, b_lo;
+    unsigned h;
+
+    if (tdy < 0 || tdy > tdx || (tdy == 0 && !o->apply_edge) || (tdy == tdx && !o->apply_diag)) {
+        return true;
+    }
+    fov_push(stack, &sp, 1, 0, -1, fov_slope(0, 1), fov_slope(1, 1));
+
+    while (sp > 0) {
+        --sp;
+        dx = stack[sp].dx;
+        start_slope = stack[sp].start_slope;
+        end_slope = stack[sp].end_slope;
+
+        if ((unsigned)dx > data->radius
+            || start_slope.n*td >= hn*start_slope.d
+            || end_slope.n*td < ln*end_slope.d) {
+            continue;
+        }
+
+        dy0 = fov_slope_row(dx, start_slope);
+        dy1 = fov_slope_row(dx, end_slope);
+        if (!o->apply_diag && dy1 == dx) {
+            --dy1;
+            if (dy0 > dy1 && start_slope.n < start_slope.d) {
+                fov_push(stack, &sp, dx + 1, 0, -1, start_slope, end_slope);
+                continue;
+            }
+        }
+        h = fov_column_height(data, dx);
+        if ((unsigned)dy1 > h) {
+            if (h == 0) {
+                continue;
+            }
+            dy1 = (int)h;
+        }
+
+        if (dx == tdx) {
+            /* Every row from dy0 to dy1 is scanned, resuming after
+             * each blocked tile. */
+            *lit = dy0 <= tdy && tdy <= dy1
+                && (data->settings->opaque_apply == FOV_OPAQUE_APPLY
+                    || fov_los_clear(data, o, dx, tdy, 1, 1) == 1);
+            return true;
+        } else if (dy0 > dy1) {
+            /* An empty column ends the scan. */
+            continue;
+        }
+
+        /* Runs which can reach the target start no later than a_hi,
+         * unless they start the column, and end no earlier than b_lo,
+         * unless they end it, so each one covers a row from lo to hi. */
+        a_hi = fov_ceil_div(hn*(2*dx - 1), td)/2;
+        if (a_hi < dy0) {
+            a_hi = dy0;
+        }
+        b_lo = fov_ceil_div(fov_ceil_div(ln*(2*dx + 1), td) - 1, 2);
+        lo = (int)(a_hi < b_lo ? a_hi : b_lo);
+        hi = (int)(a_hi > b_lo ? a_hi : b_lo);
+        lo = lo < dy0 ? dy0 : (lo > dy1 ? dy1 : lo);
+        hi = hi > dy1 ? dy1 : hi;
+
+        for (dy = lo; dy <= hi; dy = b + 2) {
+            n = fov_los_clear(data, o, dx, dy, 1, dy1 - dy + 1);
+            if (n == 0) {
+                b = dy - 1;
+                continue;
+            }
+            a = dy;
+            b = dy + n - 1;
+            if (a == lo && a > dy0) {
+                a -= fov_los_clear(data, o, dx, a - 1, -1, a - dy0);
+            }
+            /* The rounding of a_hi and b_lo leaves hi - lo <= 2, so at
+             * most two runs meet rows lo to hi, and each column pushes
+             * at most two frames, all for the next column. Frames are
+             * popped deepest first, so every column but the deepest
+             * has at most one frame left waiting: with columns 1 to
+             * radius + 1, that is at most radius + 2 frames. The map
+             * is the caller's, so fail the query rather than trust
+             * this with the stack. */
+            if (sp >= size) {
+                return false;
+            }
+            fov_push(stack, &sp, dx + 1, 0, -1,
+                     a == dy0 ? start_slope : fov_slope(2*a - 1, 2*dx - 1),
+                     b == dy1 ? end_slope : fov_slope(2*b + 1, 2*dx + 1));
+        }
+    }
+    return true;
+}
+
+/* Find whether (x,y) is lit, once the stack has been reserved for
+ * radius. Returns false if the scan overran the stack. */
+static bool fov_los_scan(fov_settings_type *settings,
+                         const fov_bitmap_type *bitmap, void *map,
+                         int source_x, int source_y, int x, int y,
+                         unsigned radius, bool *lit) {
+    fov_private_data_type data;
+    const fov_los_octant_type *o;
+    int i, tdx, tdy;
+
+    fov_init_data(&data, settings, bitmap, map, NULL, source_x, source_y, radius);
+    data.stack = settings->scratch->stack;
+
+    *lit = false;
+    for (i = 0; i < 8 && !*lit; ++i) {
+        o = &fov_los_octants[i];
+        tdx = o->signx*(o->reflect ? y - source_y : x - source_x);
+        tdy = o->signy*(o->reflect ? x - source_x : y - source_y);
+        if (tdx > 0 && !fov_los_octant(&data, o, tdx, tdy, lit)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool fov_los(fov_settings_type *settings,
+             const fov_bitmap_type *bitmap,
+             void *map,
+             int source_x, int source_y,
+             int x, int y,
+             unsigned radius,
+             bool *lit) {
+    bool found;
+
+    if (!fov_reserve_stack(settings, radius)
+        || !fov_los_scan(settings, bitmap, map, source_x, source_y, x, y, radius, &found)) {
+        return false;
+    }
+    *lit = found;
+    return true;
+}
+
+/* Target search -------------------------------------------------- */
+
+/* The tile at row dy of column dx of an octant, in map coordinates. */
+static void fov_octant_tile(fov_private_data_type *data, const fov_los_octant_type *o,
+                            int dx, int dy, int *x, int *y) {
+    if (o->reflect) {
+        *x = data->source_x + o->signy*dy;
+        *y = data->source_y + o->signx*dx;
+    } else {
+        *x = data->source_x + o->signx*dx;
+        *y = data->source_y + o->signy*dy;
+    }
+}
+
+bool fov_circle_search(fov_settings_type *settings,
+                       const fov_bitmap_type *bitmap,
+                       void *map, void *source,
+                       int source_x, int source_y, unsigned radius,
+                       bool (*target)(void *map, int x, int y,
+                                      int dx, int dy, void *src),
+                       int *found_x, int *found_y) {
+    fov_private_data_type data;
+    const fov_los_octant_type *o;
+    fov_frame_type *frames, *next;
+    fov_slope_type start_slope, end_slope;
+    unsigned count[8], cap = radius + 2, i, f, n, h;
+    int dx, dy, dy0, dy1, a, x, y;
+    bool blocked;
+
+    /* The octant functions scan depth first, so columns are visited
+     * here a whole distance at a time instead. The frames of a column
+     * of an octant cover different rows, so there are at most dx + 2
+     * of them in column dx + 1; each octant keeps those of the column
+     * being scanned and of the next in two spaces of cap frames. */
+    if (!fov_reserve_stack(settings, FOV_RESERVE_STACK(radius))) {
+        return false;
+    }
+    fov_init_data(&data, settings, bitmap, map, source, source_x, source_y, radius);
+    for (i = 0; i < 8; ++i) {
+        count[i] = 0;
+        fov_push(settings->scratch->stack + 2*i*cap, &count[i], 1, 0, -1, fov_slope(0, 1), fov_slope(1, 1));
+    }
+
+    for (dx = 1; (unsigned)dx <= radius; ++dx) {
+        h = fov_column_height(&data, dx);
+        for (i = 0; i < 8; ++i) {
+            o = &fov_los_octants[i];
+            frames = settings->scratch->stack + (2*i + (unsigned)(dx + 1)%2)*cap;
+            next = settings->scratch->stack + (2*i + (unsigned)dx%2)*cap;
+            n = 0;
+            for (f = 0; f < count[i]; ++f) {
+                start_slope = frames[f].start_slope;
+                end_slope = frames[f].end_slope;
+                dy0 = fov_slope_row(dx, start_slope);
+                dy1 = fov_slope_row(dx, end_slope);
+                if (!o->apply_diag && dy1 == dx) {
+                    --dy1;
+                    if (dy0 > dy1 && start_slope.n < start_slope.d) {
+                        fov_push(next, &n, dx + 1, 0, -1, start_slope, end_slope);
+                        continue;
+                    }
+                }
+                if ((unsigned)dy1 > h) {
+                    if (h == 0) {
+                        continue;
+                    }
+                    dy1 = (int)h;
+                }
+
+                /* a is the first row of the run of clear tiles being
+                 * crossed, or -1. */
+                a = -1;
+                for (dy = dy0; dy <= dy1; ++dy) {
+                    fov_octant_tile(&data, o, dx, dy, &x, &y);
+                    blocked = bitmap != NULL ? fov_bitmap_opaque(bitmap, x, y) : fov_opaque(&data, x, y);
+                    if ((o->apply_edge || dy > 0)
+                        && (!blocked || settings->opaque_apply == FOV_OPAQUE_APPLY)
+                        && target(map, x, y, x - source_x, y - source_y, source)) {
+                        if (found_x != NULL) {
+                            *found_x = x;
+                        }
+                        if (found_y != NULL) {
+                            *found_y = y;
+                        }
+                        return true;
+                    }
+                    if (!blocked && a < 0) {
+                        a = dy;
+                    } else if (blocked && a >= 0) {
+                        fov_push(next, &n, dx + 1, 0, -1,
+                                 a == dy0 ? start_slope : fov_slope(2*a - 1, 2*dx - 1),
+                                 fov_slope(2*dy - 1, 2*dx + 1));
+                        a = -1;
+                    }
+                }
+                if (a >= 0) {
+                    fov_push(next, &n, dx + 1, 0, -1,
+                             a == dy0 ? start_slope : fov_slope(2*a - 1, 2*dx - 1), end_slope);
+                }
+            }
+            count[i] = n;
+        }
+    }
+    return false;
+}
+
+/* Caches --------------------------------------------------------- */
+
+/** \cond INTERNAL */
+typedef struct {
+    int x;
+    int y;
+    unsigned radius;
+    bool used;
+    bool stale;
+    /* Whether the viewer is in the buckets its window overlaps. If not,
+     * it could miss an invalidation, so it is never trusted. */
+    bool indexed;
+    /* Visibility bitset, and the tiles the scan tested, both covering
+     * the window around (x,y). */
+    /*@null@*/ uint64_t *visible;
+    /*@null@*/ uint64_t *probed;
+} fov_cache_entry_type;
+
+/* The viewers whose windows overlap one square of the map. */
+typedef struct {
+    /*@null@*/ int *viewers;
+    unsigned n;
+    unsigned size;
+} fov_bucket_type;
+
+struct fov_cache {
+    fov_settings_type *settings;
+    /*@null@*/ const fov_bitmap_type *bitmap;
+    void *map;
+    unsigned width;
+    unsigned height;
+    unsigned bucketsx;
+    unsigned bucketsy;
+    fov_bucket_type *buckets;
+    /*@null@*/ fov_cache_entry_type *entries;
+    unsigned numentries;
+    /* Entries allocated, of which numentries are in use or free. */
+    unsigned maxentries;
+    /* No entry before this one is free. */
+    unsigned firstfree;
+    unsigned long scans;
+};
+/** \endcond */
+
+fov_cache_type *fov_cache_create(fov_settings_type *settings,
+                                 const fov_bitmap_type *bitmap, void *map,
+                                 unsigned width, unsigned height) {
+    fov_cache_type *cache = (fov_cache_type *)fov_malloc(sizeof(fov_cache_type));
+
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->settings = settings;
+    cache->bitmap = bitmap;
+    cache->map = map;
+    cache->width = width;
+    cache->height = height;
+    cache->bucketsx = (width + FOV_CACHE_BUCKET - 1)/FOV_CACHE_BUCKET;
+    cache->bucketsy = (height + FOV_CACHE_BUCKET - 1)/FOV_CACHE_BUCKET;
+    cache->buckets = (fov_bucket_type *)fov_calloc((size_t)cache->bucketsx*cache->bucketsy + 1,
+                                               sizeof(fov_bucket_type));
+    cache->entries = NULL;
+    cache->numentries = 0;
+    cache->maxentries = 0;
+    cache->firstfree = 0;
+    cache->scans = 0;
+    if (cache->buckets == NULL) {
+        fov_free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void fov_cache_free(fov_cache_type *cache) {
+    unsigned i;
+
+    if (cache == NULL) {
+        return;
+    }
+    for (i = 0; i < cache->bucketsx*cache->bucketsy; ++i) {
+        fov_free(cache->buckets[i].viewers);
+    }
+    for (i = 0; i < cache->numentries; ++i) {
+        fov_free(cache->entries[i].visible);
+        fov_free(cache->entries[i].probed);
+    }
+    fov_free(cache->buckets);
+    fov_free(cache->entries);
+    fov_free(cache);
+}
+
+/* The range of buckets overlapping tiles [x0, x1]*[y0, y1], which is
+ * empty if they are all off the map. */
+static bool fov_cache_buckets(const fov_cache_type *cache, int x0, int y0, int x1, int y1,
+                              unsigned *bx0, unsigned *by0, unsigned *bx1, unsigned *by1) {
+    if (x1 < 0 || y1 < 0 || x0 >= (int)cache->width || y0 >= (int)cache->height) {
+        return false;
+    }
+    *bx0 = x0 < 0 ? 0 : (unsigned)x0/FOV_CACHE_BUCKET;
+    *by0 = y0 < 0 ? 0 : (unsigned)y0/FOV_CACHE_BUCKET;
+    *bx1 = (x1 >= (int)cache->width ? cache->width - 1 : (unsigned)x1)/FOV_CACHE_BUCKET;
+    *by1 = (y1 >= (int)cache->height ? cache->height - 1 : (unsigned)y1)/FOV_CACHE_BUCKET;
+    return true;
+}
+
+/* Add a viewer to, or remove it from, the buckets its window overlaps. */
+static bool fov_cache_index(fov_cache_type *cache, int viewer, bool add) {
+    fov_cache_entry_type *e = &cache->entries[viewer];
+    int r = (int)e->radius;
+    unsigned bx0, by0, bx1, by1, bx, by, i;
+    fov_bucket_type *bucket;
+    int *viewers;
+
+    if (!fov_cache_buckets(cache, e->x - r, e->y - r, e->x + r, e->y + r, &bx0, &by0, &bx1, &by1)) {
+        return true;
+    }
+    for (by = by0; by <= by1; ++by) {
+        for (bx = bx0; bx <= bx1; ++bx) {
+            bucket = &cache->buckets[by*cache->bucketsx + bx];
+            if (add) {
+                if (bucket->n == bucket->size) {
+                    viewers = (int *)fov_realloc(bucket->viewers, (bucket->size*2 + 4)*sizeof(int));
+                    if (viewers == NULL) {
+                        return false;
+                    }
+                    bucket->viewers = viewers;
+                    bucket->size = bucket->size*2 + 4;
+                }
+                bucket->viewers[bucket->n++] = viewer;
+            } else {
+                for (i = 0; i < bucket->n; ++i) {
+                    if (bucket->viewers[i] == viewer) {
+                        bucket->viewers[i] = bucket->viewers[--bucket->n];
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+int fov_cache_add(fov_cache_type *cache, int x, int y, unsigned radius) {
+    size_t size = fov_visibility_size(radius);
+    fov_cache_entry_type *entries, *e;
+    int viewer;
+
+    for (viewer = (int)cache->firstfree; viewer < (int)cache->numentries; ++viewer) {
+        if (!cache->entries[viewer].used) {
+            break;
+        }
+    }
+    cache->firstfree = (unsigned)viewer;
+    if (viewer == (int)cache->numentries) {
+        /* Double the entries, so adding n viewers copies them O(n)
+         * times in all. */
+        if (cache->numentries == cache->maxentries) {
+            entries = (fov_cache_entry_type *)fov_realloc(cache->entries,
+                (cache->maxentries*2 + 8)*sizeof(fov_cache_entry_type));
+            if (entries == NULL) {
+                return -1;
+            }
+            cache->entries = entries;
+            cache->maxentries = cache->maxentries*2 + 8;
+        }
+        entries = cache->entries;
+        entries[viewer].used = false;
+        entries[viewer].radius = 0;
+        entries[viewer].visible = NULL;
+        entries[viewer].probed = NULL;
+        ++cache->numentries;
+    }
+
+    e = &cache->entries[viewer];
+    if (e->visible == NULL || fov_visibility_size(e->radius) < size) {
+        fov_free(e->visible);
+        fov_free(e->probed);
+        e->visible = (uint64_t *)fov_malloc(size*sizeof(uint64_t));
+        e->probed = (uint64_t *)fov_malloc(size*sizeof(uint64_t));
+        if (e->visible == NULL || e->probed == NULL) {
+            fov_free(e->visible);
+            fov_free(e->probed);
+            e->visible = e->probed = NULL;
+            return -1;
+        }
+    }
+    e->x = x;
+    e->y = y;
+    e->radius = radius;
+    e->stale = true;
+    e->indexed = true;
+    if (!fov_cache_index(cache, viewer, true)) {
+        (void)fov_cache_index(cache, viewer, false);
+        return -1;
+    }
+    e->used = true;
+    return viewer;
+}
+
+void fov_cache_remove(fov_cache_type *cache, int viewer) {
+    if (cache->entries[viewer].indexed) {
+        (void)fov_cache_index(cache, viewer, false);
+    }
+    cache->entries[viewer].used = false;
+    if ((unsigned)viewer < cache->firstfree) {
+        cache->firstfree = (unsigned)viewer;
+    }
+}
+
+void fov_cache_move(fov_cache_type *cache, int viewer, int x, int y) {
+    fov_cache_entry_type *e = &cache->entries[viewer];
+
+    if (x == e->x && y == e->y) {
+        return;
+    }
+    if (e->indexed) {
+        (void)fov_cache_index(cache, viewer, false);
+    }
+    e->x = x;
+    e->y = y;
+    e->stale = true;
+    e->indexed = fov_cache_index(cache, viewer, true);
+    if (!e->indexed) {
+        (void)fov_cache_index(cache, viewer, false);
+    }
+}
+
+bool fov_cache_stale(const fov_cache_type *cache, int viewer) {
+    return cache->entries[viewer].stale || !cache->entries[viewer].indexed;
+}
+
+const uint64_t *fov_cache_visibility(fov_cache_type *cache, int viewer) {
+    fov_cache_entry_type *e = &cache->entries[viewer];
+    fov_private_data_type data;
+
+    if (e->stale || !e->indexed) {
+        fov_init_data(&data, cache->settings, cache->bitmap, cache->map, NULL, e->x, e->y, e->radius);
+        fov_init_visible(&data, e->visible);
+        data.probed = e->probed;
+        memset(e->probed, 0, fov_visibility_size(e->radius)*sizeof(uint64_t));
+        if (!fov_prepare(&data)) {
+            return NULL;
+        }
+        _fov_circle(&data);
+        e->stale = false;
+        ++cache->scans;
+    }
+    return e->visible;
+}
+
+void fov_cache_invalidate(fov_cache_type *cache, int x, int y) {
+    fov_cache_invalidate_rect(cache, x, y, x, y);
+}
+
+/* Whether any of bits [vx0, vx1] of a bitset row are set, a word at a
+ * time. */
+static bool fov_cache_row_any(const uint64_t *row, unsigned vx0, unsigned vx1) {
+    unsigned i, last = vx1 >> 6;
+    uint64_t w;
+
+    for (i = vx0 >> 6; i <= last; ++i) {
+        w = row[i];
+        if (i == vx0 >> 6) {
+            w &= ~(uint64_t)0 << (vx0 & 63u);
+        }
+        if (i == last) {
+            w &= ~(uint64_t)0 >> (63u - (vx1 & 63u));
+        }
+        if (w != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void fov_cache_invalidate_rect(fov_cache_type *cache, int x0, int y0, int x1, int y1) {
+    unsigned bx0, by0, bx1, by1, bx, by, i, vy;
+    const fov_bucket_type *bucket;
+    fov_cache_entry_type *e;
+    int t, r, wx0, wy0, wx1, wy1;
+    size_t stride;
+
+    if (x0 > x1) {
+        t = x0; x0 = x1; x1 = t;
+    }
+    if (y0 > y1) {
+        t = y0; y0 = y1; y1 = t;
+    }
+    if (!fov_cache_buckets(cache, x0, y0, x1, y1, &bx0, &by0, &bx1, &by1)) {
+        return;
+    }
+    for (by = by0; by <= by1; ++by) {
+        for (bx = bx0; bx <= bx1; ++bx) {
+            bucket = &cache->buckets[by*cache->bucketsx + bx];
+            for (i = 0; i < bucket->n; ++i) {
+                e = &cache->entries[bucket->viewers[i]];
+                if (e->stale) {
+                    continue;
+                }
+                /* Clip the rectangle to the viewer's window, then test
+                 * the tiles the scan probed a row of words at a time. */
+                r = (int)e->radius;
+                wx0 = x0 > e->x - r ? x0 : e->x - r;
+                wy0 = y0 > e->y - r ? y0 : e->y - r;
+                wx1 = x1 < e->x + r ? x1 : e->x + r;
+                wy1 = y1 < e->y + r ? y1 : e->y + r;
+                if (wx0 > wx1 || wy0 > wy1) {
+                    continue;
+                }
+                stride = fov_visibility_stride(e->radius);
+                for (vy = (unsigned)(wy0 - e->y + r); !e->stale && vy <= (unsigned)(wy1 - e->y + r); ++vy) {
+                    e->stale = fov_cache_row_any(e->probed + vy*stride,
+                                                 (unsigned)(wx0 - e->x + r), (unsigned)(wx1 - e->x + r));
+                }
+            }
+        }
+    }
+}
+
+unsigned long fov_cache_scans(const fov_cache_type *cache) {
+    return cache->scans;
+}
+
+/* Thread pools -------------------------------------------------- */
+
+/** \cond INTERNAL */
+typedef struct fov_worker fov_worker_type;
+
+/* Brightness of a light at each offset from it, see fov_light_weights(). */
+typedef struct {
+    /*@null@*/ float *values;
+    size_t size;
+    /* Radius and falloff of the values, or a falloff of -1 for none. */
+    unsigned radius;
+    int falloff;
+} fov_weights_type;
+
+struct fov_worker {
+    fov_pool_type *pool;
+    pthread_t thread;
+    /* Scan stack and opacity buffer, reused between jobs. */
+    fov_settings_type scratch;
+    /* Visibility bitset for this worker's octants. */
+    /*@null@*/ uint64_t *visible;
+    size_t visiblesize;
+    /* Index of this worker's share of a job. */
+    unsigned index;
+    /* Whether this worker's share of the current job could not be
+     * done, for jobs which can fail. */
+    bool failed;
+    /* Brightness table for lighting. */
+    fov_weights_type weights;
+};
+
+struct fov_pool {
+    unsigned threads;
+    /* One per thread; the first is run by the thread which starts a
+     * job and has no thread of its own. */
+    fov_worker_type *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    /* Counts jobs started, so that workers can tell a new one. */
+    unsigned long generation;
+    /* Number of threads still working on the current job. */
+    unsigned busy;
+    bool quit;
+    /* Smallest radius fov_circle_parallel() splits between threads. */
+    unsigned threshold;
+    /* Heights shared by the workers when the settings have none. */
+    /*@null@*/ fov_heights_type *heights;
+
+    /* The current job. */
+    void (*job)(fov_worker_type *worker);
+    fov_settings_type *settings;
+    /*@null@*/ const fov_heights_type *job_heights;
+    const fov_bitmap_type *bitmap;
+    void *map;
+    const fov_source_type *sources;
+    size_t n;
+    /* Visibility bitsets for each source, for jobs which fill them,
+     * outputsize words apart. */
+    /*@null@*/ uint64_t *outputs;
+    size_t outputsize;
+    /* Line of sight queries and their results. */
+    const fov_los_query_type *queries;
+    uint64_t *results;
+    /* Lights and the buffer to add them to. */
+    const fov_light_type *lights;
+    float *buffer;
+    unsigned width;
+    unsigned height;
+};
+/** \endcond */
+
+static void *fov_worker_main(void *arg) {
+    fov_worker_type *worker = (fov_worker_type *)arg;
+    fov_pool_type *pool = worker->pool;
+    unsigned long seen = 0;
+
+    for (;;) {
+        (void)pthread_mutex_lock(&pool->lock);
+        while (!pool->quit && pool->generation == seen) {
+            (void)pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->quit) {
+            (void)pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        seen = pool->generation;
+        (void)pthread_mutex_unlock(&pool->lock);
+
+        pool->job(worker);
+
+        (void)pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0) {
+            (void)pthread_cond_signal(&pool->done);
+        }
+        (void)pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+fov_pool_type *fov_pool_create(unsigned threads) {
+    fov_pool_type *pool;
+    unsigned i;
+
+    if (threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (unsigned)online : 1;
+    }
+    pool = (fov_pool_type *)fov_malloc(sizeof(fov_pool_type));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->workers = (fov_worker_type *)fov_malloc(threads*sizeof(fov_worker_type));
+    if (pool->workers == NULL) {
+        fov_free(pool);
+        return NULL;
+    }
+    pool->threads = 1;
+    pool->generation = 0;
+    pool->busy = 0;
+    pool->quit = false;
+    pool->threshold = FOV_POOL_THRESHOLD;
+    pool->heights = NULL;
+    pool->outputs = NULL;
+    (void)pthread_mutex_init(&pool->lock, NULL);
+    (void)pthread_cond_init(&pool->start, NULL);
+    (void)pthread_cond_init(&pool->done, NULL);
+
+    for (i = 0; i < threads; ++i) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        pool->workers[i].visible = NULL;
+        pool->workers[i].visiblesize = 0;
+        pool->workers[i].failed = false;
+        pool->workers[i].weights.values = NULL;
+        pool->workers[i].weights.size = 0;
+        pool->workers[i].weights.falloff = -1;
+        fov_settings_init(&pool->workers[i].scratch);
+    }
+    for (i = 1; i < threads; ++i) {
+        if (pthread_create(&pool->workers[i].thread, NULL, fov_worker_main, &pool->workers[i]) != 0) {
+            fov_pool_free(pool);
+            return NULL;
+        }
+        pool->threads = i + 1;
+    }
+    pool->threads = threads;
+    return pool;
+}
+
+void fov_pool_set_threshold(fov_pool_type *pool, unsigned radius) {
+    pool->threshold = radius;
+}
+
+void fov_pool_free(fov_pool_type *pool) {
+    unsigned i;
+
+    if (pool == NULL) {
+        return;
+    }
+    (void)pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    (void)pthread_cond_broadcast(&pool->start);
+    (void)pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->threads; ++i) {
+        if (i > 0) {
+            (void)pthread_join(pool->workers[i].thread, NULL);
+        }
+        fov_settings_free(&pool->workers[i].scratch);
+        fov_free(pool->workers[i].visible);
+        fov_free(pool->workers[i].weights.values);
+    }
+    (void)pthread_cond_destroy(&pool->done);
+    (void)pthread_cond_destroy(&pool->start);
+    (void)pthread_mutex_destroy(&pool->lock);
+    fov_heights_free(pool->heights);
+    fov_free(pool->workers);
+    fov_free(pool);
+}
+
+/* Set up a job for the workers to share. */
+static void fov_pool_setup(fov_pool_type *pool, void (*job)(fov_worker_type *worker),
+                           fov_settings_type *settings, unsigned max_radius,
+                           const fov_bitmap_type *bitmap, void *map) {
+    unsigned i;
+
+    pool->job = job;
+    pool->settings = settings;
+    pool->bitmap = bitmap;
+    pool->map = map;
+    for (i = 0; i < pool->threads; ++i) {
+        pool->workers[i].failed = false;
+    }
+
+    /* The workers' own settings would each precalculate the same
+     * heights, so share one table between them instead. */
+    pool->job_heights = settings->shared_heights;
+    if (settings->shape == FOV_SHAPE_CIRCLE_PRECALCULATE
+        && (settings->shared_heights == NULL || settings->shared_heights->max_radius < max_radius)) {
+        if (pool->heights == NULL || pool->heights->max_radius < max_radius) {
+            fov_heights_free(pool->heights);
+            pool->heights = fov_heights_create(max_radius);
+        }
+        if (pool->heights != NULL) {
+            pool->job_heights = pool->heights;
+        }
+    }
+}
+
+/* Run the job on every worker and wait for them all to finish. */
+static void fov_pool_run(fov_pool_type *pool) {
+    (void)pthread_mutex_lock(&pool->lock);
+    pool->busy = pool->threads - 1;
+    ++pool->generation;
+    (void)pthread_cond_broadcast(&pool->start);
+    (void)pthread_mutex_unlock(&pool->lock);
+
+    pool->job(&pool->workers[0]);
+
+    (void)pthread_mutex_lock(&pool->lock);
+    while (pool->busy > 0) {
+        (void)pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    (void)pthread_mutex_unlock(&pool->lock);
+}
+
+/* Whether any worker's share of the last job failed. */
+static bool fov_pool_failed(const fov_pool_type *pool) {
+    unsigned i;
+
+    for (i = 0; i < pool->threads; ++i) {
+        if (pool->workers[i].failed) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* The worker's own settings for the current job. */
+static fov_settings_type *fov_worker_settings(fov_worker_type *worker) {
+    fov_settings_type *scratch = &worker->scratch;
+    fov_settings_type *settings = worker->pool->settings;
+
+    scratch->opaque = settings->opaque;
+    scratch->opaque_span = settings->opaque_span;
+    scratch->apply = settings->apply;
+    scratch->apply_span = settings->apply_span;
+    scratch->shape = settings->shape;
+    scratch->corner_peek = settings->corner_peek;
+    scratch->opaque_apply = settings->opaque_apply;
+    scratch->shared_heights = worker->pool->job_heights;
+    scratch->chunks = settings->chunks;
+    return scratch;
+}
+
+/* Give every worker the scan stack for fields of view up to radius
+ * before the job is started, so that no worker runs out of memory part
+ * way through it. Follows fov_pool_setup(), whose shared heights must
+ * then cover every radius, since a worker short of them would have to
+ * calculate its own. */
+static bool fov_pool_reserve(fov_pool_type *pool, unsigned radius) {
+    unsigned i;
+
+    if (pool->settings->shape == FOV_SHAPE_CIRCLE_PRECALCULATE && radius > 0
+        && (pool->job_heights == NULL || pool->job_heights->max_radius < radius)) {
+        return false;
+    }
+    for (i = 0; i < pool->threads; ++i) {
+        if (!fov_reserve_stack(fov_worker_settings(&pool->workers[i]), radius)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Batches -------------------------------------------------------- */
+
+/* Light a worker's block of sources. */
+static void fov_batch_job(fov_worker_type *worker) {
+    fov_pool_type *pool = worker->pool;
+    fov_settings_type *settings = fov_worker_settings(worker);
+    fov_private_data_type data;
+    size_t i, first, last;
+
+    first = pool->n*worker->index/pool->threads;
+    last = pool->n*(worker->index + 1)/pool->threads;
+    for (i = first; i < last; ++i) {
+        fov_init_data(&data, settings, pool->bitmap, pool->map, pool->sources[i].source,
+                      pool->sources[i].x, pool->sources[i].y, pool->sources[i].radius);
+        _fov_circle(&data);
+    }
+}
+
+void fov_circle_batch(fov_settings_type *settings,
+                      const fov_bitmap_type *bitmap,
+                      void *map,
+                      const fov_source_type *sources,
+                      size_t n,
+                      fov_pool_type *pool) {
+    fov_private_data_type data;
+    unsigned max_radius = 0;
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        if (sources[i].radius > max_radius) {
+            max_radius = sources[i].radius;
+        }
+    }
+    if (pool != NULL) {
+        fov_pool_setup(pool, fov_batch_job, settings, max_radius, bitmap, map);
+        if (fov_pool_reserve(pool, max_radius)) {
+            pool->sources = sources;
+            pool->n = n;
+            fov_pool_run(pool);
+            return;
+        }
+    }
+
+    /* Without a pool, or the memory for its workers. */
+    for (i = 0; i < n; ++i) {
+        fov_init_data(&data, settings, bitmap, map, sources[i].source,
+                      sources[i].x, sources[i].y, sources[i].radius);
+        _fov_circle(&data);
+    }
+}
+
+/* Parallel octants ----------------------------------------------- */
+
+/* Scan a worker's share of the eight octants around the first source
+ * into its own visibility bitset. */
+static void fov_octants_job(fov_worker_type *worker) {
+    fov_pool_type *pool = worker->pool;
+    const fov_source_type *source = pool->sources;
+    fov_slope_type zero = fov_slope(0, 1), one = fov_slope(1, 1);
+    fov_private_data_type data;
+    fov_octant_function octant;
+    unsigned i;
+
+    if (worker->index >= 8) {
+        return;
+    }
+    fov_init_data(&data, fov_worker_settings(worker), pool->bitmap, pool->map, NULL,
+                  source->x, source->y, source->radius);
+    fov_init_visible(&data, worker->visible);
+    if (!fov_prepare(&data)) {
+        worker->failed = true;
+        return;
+    }
+    for (i = worker->index; i < 8; i += pool->threads) {
+        switch (i) {
+        case 0: octant = data.octants->ppn; break;
+        case 1: octant = data.octants->ppy; break;
+        case 2: octant = data.octants->pmn; break;
+        case 3: octant = data.octants->pmy; break;
+        case 4: octant = data.octants->mpn; break;
+        case 5: octant = data.octants->mpy; break;
+        case 6: octant = data.octants->mmn; break;
+        default: octant = data.octants->mmy; break;
+        }
+        octant(&data, 1, zero, one);
+    }
+}
+
+/* Report the tiles marked in a visibility bitset to the apply
+ * callbacks, a row at a time. */
+static void fov_apply_visible(fov_private_data_type *data, const uint64_t *visible) {
+    size_t stride = fov_visibility_stride(data->radius);
+    unsigned size = data->radius*2 + 1;
+    unsigned vx, vy, first;
+    uint64_t w;
+
+    for (vy = 0; vy < size; ++vy) {
+        vx = 0;
+        while (vx < size) {
+            /* Find the next run of set bits from vx. */
+            w = visible[vy*stride + (vx >> 6)] >> (vx & 63u);
+            if (w == 0) {
+                vx = (vx | 63u) + 1;
+                continue;
+            }
+            vx += fov_lowest_bit(w);
+            first = vx;
+            for (;;) {
+                w = ~visible[vy*stride + (vx >> 6)] >> (vx & 63u);
+                if (w != 0) {
+                    vx += fov_lowest_bit(w);
+                    break;
+                }
+                vx = (vx | 63u) + 1;
+            }
+            if (data->settings->apply_span != NULL) {
+                data->settings->apply_span(data->map,
+                                           data->source_x - (int)data->radius + (int)first,
+                                           data->source_y - (int)data->radius + (int)vy,
+                                           data->source_x - (int)data->radius + (int)vx - 1,
+                                           data->source_y - (int)data->radius + (int)vy,
+                                           data->source);
+            } else {
+                for (; first < vx; ++first) {
+                    fov_apply(data, data->source_x - (int)data->radius + (int)first,
+                              data->source_y - (int)data->radius + (int)vy);
+                }
+            }
+        }
+    }
+}
+
+/* Make sure every worker has a visibility bitset of size words. */
+static bool fov_pool_reserve_visible(fov_pool_type *pool, size_t size) {
+    fov_worker_type *worker;
+    unsigned i;
+
+    for (i = 0; i < pool->threads; ++i) {
+        worker = &pool->workers[i];
+        if (worker->visiblesize < size) {
+            fov_free(worker->visible);
+            worker->visible = (uint64_t *)fov_malloc(size*sizeof(uint64_t));
+            worker->visiblesize = worker->visible != NULL ? size : 0;
+            if (worker->visible == NULL) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void fov_circle_parallel(fov_settings_type *settings,
+                         const fov_bitmap_type *bitmap,
+                         void *map,
+                         void *source,
+                         int source_x,
+                         int source_y,
+                         unsigned radius,
+                         uint64_t *visible,
+                         fov_pool_type *pool) {
+    fov_private_data_type data;
+    fov_source_type centre;
+    size_t size = fov_visibility_size(radius);
+    uint64_t *merged;
+    bool scanned = false;
+    unsigned i;
+    size_t j;
+
+    fov_init_data(&data, settings, bitmap, map, source, source_x, source_y, radius);
+    if (pool != NULL && pool->threads >= 2 && radius >= pool->threshold
+        && fov_pool_reserve_visible(pool, size)) {
+        centre.x = source_x;
+        centre.y = source_y;
+        centre.radius = radius;
+        centre.source = source;
+        fov_pool_setup(pool, fov_octants_job, settings, radius, bitmap, map);
+        if (fov_pool_reserve(pool, radius)) {
+            pool->sources = &centre;
+            pool->n = 1;
+            fov_pool_run(pool);
+            scanned = !fov_pool_failed(pool);
+        }
+        if (scanned) {
+            /* Octants never share a tile, so the bitsets merge with OR. */
+            merged = visible != NULL ? visible : pool->workers[0].visible;
+            if (visible != NULL) {
+                memcpy(merged, pool->workers[0].visible, size*sizeof(uint64_t));
+            }
+            for (i = 1; i < pool->threads && i < 8; ++i) {
+                for (j = 0; j < size; ++j) {
+                    merged[j] |= pool->workers[i].visible[j];
+                }
+            }
+            if (visible == NULL) {
+                fov_apply_visible(&data, merged);
+            }
+            return;
+        }
+    }
+
+    /* Without the memory for the threads' bitsets and stacks, the
+     * calling thread scans the circle itself rather than lighting
+     * nothing. */
+    if (visible != NULL) {
+        fov_init_visible(&data, visible);
+    }
+    _fov_circle(&data);
+}
+
+/* Ordered batches ------------------------------------------------ */
+
+/* Scan one source per worker into the worker's own visibility bitset. */
+static void fov_ordered_job(fov_worker_type *worker) {
+    fov_pool_type *pool = worker->pool;
+    const fov_source_type *source = pool->sources + worker->index;
+    fov_private_data_type data;
+
+    if (worker->index >= pool->n) {
+        return;
+    }
+    fov_init_data(&data, fov_worker_settings(worker), pool->bitmap, pool->map, NULL,
+                  source->x, source->y, source->radius);
+    fov_init_visible(&data, worker->visible);
+    _fov_circle(&data);
+}
+
+void fov_circle_batch_ordered(fov_settings_type *settings,
+                              const fov_bitmap_type *bitmap,
+                              void *map,
+                              const fov_source_type *sources,
+                              size_t n,
+                              fov_pool_type *pool) {
+    fov_private_data_type data;
+    unsigned max_radius = 0;
+    size_t i, j, count;
+
+    for (i = 0; i < n; ++i) {
+        if (sources[i].radius > max_radius) {
+            max_radius = sources[i].radius;
+        }
+    }
+    /* On the calling thread alone the sources are already lit in order,
+     * and so they are when the bitsets or stacks cannot be allocated. */
+    if (pool != NULL) {
+        fov_pool_setup(pool, fov_ordered_job, settings, max_radius, bitmap, map);
+    }
+    if (pool == NULL || pool->threads < 2 || n < 2
+        || !fov_pool_reserve_visible(pool, fov_visibility_size(max_radius))
+        || !fov_pool_reserve(pool, max_radius)) {
+        fov_circle_batch(settings, bitmap, map, sources, n, NULL);
+        return;
+    }
+
+    /* A round of one source per thread, then the calling thread reports
+     * the round's bitsets in order before the next round starts. */
+    for (i = 0; i < n; i += count) {
+        count = n - i < pool->threads ? n - i : pool->threads;
+        pool->sources = sources + i;
+        pool->n = count;
+        fov_pool_run(pool);
+        for (j = 0; j < count; ++j) {
+            fov_init_data(&data, settings, bitmap, map, sources[i + j].source,
+                          sources[i + j].x, sources[i + j].y, sources[i + j].radius);
+            fov_apply_visible(&data, pool->workers[j].visible);
+        }
+    }
+}
+
+/* Result caches -------------------------------------------------- */
+
+/** \cond INTERNAL */
+/* Everything a field of view depends on. Cleared with memset before it
+ * is filled in, so it can be hashed and compared as bytes. */
+typedef struct {
+    const void *map;
+    const void *bitmap;
+    unsigned long generation;
+    int x;
+    int y;
+    unsigned radius;
+    int shape;
+    int opaque_apply;
+    /* -1 for a circle. */
+    int direction;
+    long angle;
+} fov_memo_key_type;
+
+typedef struct fov_memo_entry fov_memo_entry_type;
+
+struct fov_memo_entry {
+    /* Next entry in the same hash bucket. */
+    /*@null@*/ fov_memo_entry_type *next;
+    /* Neighbours in order of use. */
+    /*@null@*/ fov_memo_entry_type *newer;
+    /*@null@*/ fov_memo_entry_type *older;
+    fov_memo_key_type key;
+    size_t hash;
+    size_t bytes;
+    /* Followed by, for each row of the window, the number of runs and
+     * then the first and last column of each run. */
+};
+
+struct fov_memo {
+    size_t max_bytes;
+    fov_memo_entry_type **buckets;
+    size_t numbuckets;
+    /*@null@*/ fov_memo_entry_type *newest;
+    /*@null@*/ fov_memo_entry_type *oldest;
+    /* Visibility bitset calculated or replayed into. */
+    /*@null@*/ uint64_t *scratch;
+    size_t scratchsize;
+    fov_memo_stats_type stats;
+};
+/** \endcond */
+
+/* Windows wider than this are not cached, since their columns would
+ * not fit the encoding. */
+#define FOV_MEMO_MAX_RADIUS 32767u
+
+#define FOV_MEMO_CODES(entry) ((uint16_t *)((entry) + 1))
+
+fov_memo_type *fov_memo_create(size_t max_bytes) {
+    fov_memo_type *memo = (fov_memo_type *)fov_malloc(sizeof(fov_memo_type));
+
+    if (memo == NULL) {
+        return NULL;
+    }
+    memo->numbuckets = 64;
+    memo->buckets = (fov_memo_entry_type **)fov_calloc(memo->numbuckets, sizeof(fov_memo_entry_type *));
+    if (memo->buckets == NULL) {
+        fov_free(memo);
+        return NULL;
+    }
+    memo->max_bytes = max_bytes;
+    memo->newest = NULL;
+    memo->oldest = NULL;
+    memo->scratch = NULL;
+    memo->scratchsize = 0;
+    memset(&memo->stats, 0, sizeof(memo->stats));
+    return memo;
+}
+
+void fov_memo_free(fov_memo_type *memo) {
+    fov_memo_entry_type *e, *older;
+
+    if (memo == NULL) {
+        return;
+    }
+    for (e = memo->newest; e != NULL; e = older) {
+        older = e->older;
+        fov_free(e);
+    }
+    fov_free(memo->buckets);
+    fov_free(memo->scratch);
+    fov_free(memo);
+}
+
+void fov_memo_stats(const fov_memo_type *memo, fov_memo_stats_type *stats) {
+    *stats = memo->stats;
+}
+
+static size_t fov_memo_hash(const fov_memo_key_type *key) {
+    const unsigned char *p = (const unsigned char *)key;
+    size_t h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < sizeof(*key); ++i) {
+        h = (h ^ p[i])*16777619u;
+    }
+    return h;
+}
+
+static void fov_memo_unlink(fov_memo_type *memo, fov_memo_entry_type *e) {
+    if (e->newer != NULL) {
+        e->newer->older = e->older;
+    } else {
+        memo->newest = e->older;
+    }
+    if (e->older != NULL) {
+        e->older->newer = e->newer;
+    } else {
+        memo->oldest = e->newer;
+    }
+}
+
+static void fov_memo_link(fov_memo_type *memo, fov_memo_entry_type *e) {
+    e->newer = NULL;
+    e->older = memo->newest;
+    if (memo->newest != NULL) {
+        memo->newest->newer = e;
+    } else {
+        memo->oldest = e;
+    }
+    memo->newest = e;
+}
+
+/* Drop the least recently used entries until there is room for
+ * another of the given size. */
+static void fov_memo_evict(fov_memo_type *memo, size_t bytes) {
+    fov_memo_entry_type *e, **p;
+
+    while (memo->oldest != NULL && memo->stats.bytes + bytes > memo->max_bytes) {
+        e = memo->oldest;
+        fov_memo_unlink(memo, e);
+        for (p = &memo->buckets[e->hash & (memo->numbuckets - 1)]; *p != e; p = &(*p)->next) {
+        }
+        *p = e->next;
+        memo->stats.bytes -= e->bytes;
+        --memo->stats.entries;
+        ++memo->stats.evictions;
+        fov_free(e);
+    }
+}
+
+/* Double the hash table once it holds more entries than buckets. */
+static void fov_memo_grow(fov_memo_type *memo) {
+    size_t n = memo->numbuckets*2, i;
+    fov_memo_entry_type **buckets, *e, *next;
+
+    buckets = (fov_memo_entry_type **)fov_calloc(n, sizeof(fov_memo_entry_type *));
+    if (buckets == NULL) {
+        return;
+    }
+    for (i = 0; i < memo->numbuckets; ++i) {
+        for (e = memo->buckets[i]; e != NULL; e = next) {
+            next = e->next;
+            e->next = buckets[e->hash & (n - 1)];
+            buckets[e->hash & (n - 1)] = e;
+        }
+    }
+    fov_free(memo->buckets);
+    memo->buckets = buckets;
+    memo->numbuckets = n;
+}
+
+/* Number of runs of set bits in row vy of a visibility bitset, and if
+ * codes is not NULL, their first and last columns. */
+static size_t fov_memo_runs(const uint64_t *visible, unsigned radius, unsigned vy,
+                            /*@null@*/ uint16_t *codes) {
+    size_t stride = fov_visibility_stride(radius);
+    const uint64_t *row = visible + vy*stride;
+    unsigned size = radius*2 + 1, vx = 0;
+    size_t n = 0;
+    uint64_t w;
+
+    while (vx < size) {
+        w = row[vx >> 6] >> (vx & 63u);
+        if (w == 0) {
+            vx = (vx | 63u) + 1;
+            continue;
+        }
+        vx += fov_lowest_bit(w);
+        if (codes != NULL) {
+            codes[2*n] = (uint16_t)vx;
+        }
+        for (;;) {
+            w = ~row[vx >> 6] >> (vx & 63u);
+            if (w != 0) {
+                vx += fov_lowest_bit(w);
+                break;
+            }
+            vx = (vx | 63u) + 1;
+        }
+        if (codes != NULL) {
+            codes[2*n + 1] = (uint16_t)(vx - 1);
+        }
+        ++n;
+    }
+    return n;
+}
+
+/* Store the field of view in the scratch bitset under key. */
+static void fov_memo_store(fov_memo_type *memo, const fov_memo_key_type *key, size_t hash) {
+    unsigned radius = key->radius, vy;
+    size_t codes = 0, bytes;
+    fov_memo_entry_type *e;
+    uint16_t *p;
+
+    for (vy = 0; vy < radius*2 + 1; ++vy) {
+        codes += 1 + 2*fov_memo_runs(memo->scratch, radius, vy, NULL);
+    }
+    bytes = sizeof(fov_memo_entry_type) + codes*sizeof(uint16_t);
+    if (bytes > memo->max_bytes) {
+        return;
+    }
+    fov_memo_evict(memo, bytes);
+    e = (fov_memo_entry_type *)fov_malloc(bytes);
+    if (e == NULL) {
+        return;
+    }
+    memcpy(&e->key, key, sizeof(*key));
+    e->hash = hash;
+    e->bytes = bytes;
+    p = FOV_MEMO_CODES(e);
+    for (vy = 0; vy < radius*2 + 1; ++vy) {
+        *p = (uint16_t)fov_memo_runs(memo->scratch, radius, vy, p + 1);
+        p += 1 + 2*(*p);
+    }
+    e->next = memo->buckets[hash & (memo->numbuckets - 1)];
+    memo->buckets[hash & (memo->numbuckets - 1)] = e;
+    fov_memo_link(memo, e);
+    memo->stats.bytes += bytes;
+    if (++memo->stats.entries > memo->numbuckets) {
+        fov_memo_grow(memo);
+    }
+}
+
+/* Replay a stored field of view into the scratch bitset. */
+static void fov_memo_replay(fov_memo_type *memo, fov_private_data_type *data,
+                            const fov_memo_entry_type *e) {
+    const uint16_t *p = FOV_MEMO_CODES(e);
+    unsigned radius = e->key.radius, vy, n;
+
+    memset(memo->scratch, 0, fov_visibility_size(radius)*sizeof(uint64_t));
+    for (vy = 0; vy < radius*2 + 1; ++vy) {
+        for (n = *p++; n > 0; --n, p += 2) {
+            fov_visible_row(data, memo->scratch, vy, p[0], p[1]);
+        }
+    }
+}
+
+/* Answer from the cache, or calculate with the circle or beam and
+ * store the answer, then pass it on. */
+static void fov_memo_run(fov_memo_type *memo, fov_private_data_type *data,
+                         fov_memo_key_type *key, fov_direction_type direction, float angle,
+                         uint64_t *visible) {
+    size_t size = fov_visibility_size(data->radius), hash;
+    fov_memo_entry_type *e;
+    uint64_t *scratch;
+
+    if (memo->scratchsize < size) {
+        scratch = (uint64_t *)fov_malloc(size*sizeof(uint64_t));
+        if (scratch == NULL) {
+            /* Calculate the answer without the cache, rather than
+             * giving none. */
+            ++memo->stats.misses;
+            if (visible != NULL) {
+                fov_init_visible(data, visible);
+            }
+            if (key->direction < 0) {
+                _fov_circle(data);
+            } else {
+                _fov_beam(data, direction, angle);
+            }
+            return;
+        }
+        fov_free(memo->scratch);
+        memo->scratch = scratch;
+        memo->scratchsize = size;
+    }
+    key->map = data->map;
+    key->bitmap = data->bitmap;
+    key->x = data->source_x;
+    key->y = data->source_y;
+    key->radius = data->radius;
+    key->shape = (int)data->settings->shape;
+    key->opaque_apply = (int)data->settings->opaque_apply;
+    hash = fov_memo_hash(key);
+
+    for (e = memo->buckets[hash & (memo->numbuckets - 1)]; e != NULL; e = e->next) {
+        if (e->hash == hash && memcmp(&e->key, key, sizeof(*key)) == 0) {
+            break;
+        }
+    }
+    /* The bitset's stride is needed to replay into it. */
+    data->visible_stride = fov_visibility_stride(data->radius);
+    if (e != NULL) {
+        ++memo->stats.hits;
+        fov_memo_unlink(memo, e);
+        fov_memo_link(memo, e);
+        fov_memo_replay(memo, data, e);
+    } else {
+        ++memo->stats.misses;
+        fov_init_visible(data, memo->scratch);
+        if (key->direction < 0) {
+            _fov_circle(data);
+        } else {
+            _fov_beam(data, direction, angle);
+        }
+        if (data->radius <= FOV_MEMO_MAX_RADIUS) {
+            fov_memo_store(memo, key, hash);
+        }
+    }
+
+    if (visible != NULL) {
+        memcpy(visible, memo->scratch, size*sizeof(uint64_t));
+    } else {
+        fov_apply_visible(data, memo->scratch);
+    }
+}
+
+void fov_memo_circle(fov_memo_type *memo, fov_settings_type *settings,
+                     const fov_bitmap_type *bitmap, void *map, void *source,
+                     int source_x, int source_y, unsigned radius,
+                     unsigned long generation, uint64_t *visible) {
+    fov_private_data_type data;
+    fov_memo_key_type key;
+
+    memset(&key, 0, sizeof(key));
+    key.generation = generation;
+    key.direction = -1;
+    fov_init_data(&data, settings, bitmap, map, source, source_x, source_y, radius);
+    fov_memo_run(memo, &data, &key, FOV_EAST, 0.0f, visible);
+}
+
+void fov_memo_beam(fov_memo_type *memo, fov_settings_type *settings,
+                   const fov_bitmap_type *bitmap, void *map, void *source,
+                   int source_x, int source_y, unsigned radius,
+                   fov_direction_type direction, float angle,
+                   unsigned long generation, uint64_t *visible) {
+    fov_private_data_type data;
+    fov_memo_key_type key;
+
+    if (angle > 360.0f) {
+        angle = 360.0f;
+    } else if (angle < 0.0f) {
+        angle = 0.0f;
+    }
+    memset(&key, 0, sizeof(key));
+    key.generation = generation;
+    key.direction = (int)direction;
+    /* Beams are lit from the angle in fixed point, see _fov_beam(). */
+    key.angle = (long)((double)angle*FOV_FIXED_ONE/90.0 + 0.5);
+    fov_init_data(&data, settings, bitmap, map, source, source_x, source_y, radius);
+    fov_memo_run(memo, &data, &key, direction, angle, visible);
+}
+
+/* Line of sight batches ------------------------------------------ */
+
+/* Answer the queries of words first to last of the results. Returns
+ * false if a scan overran the stack. */
+static bool fov_los_words(fov_settings_type *settings, const fov_bitmap_type *bitmap, void *map,
+                          const fov_los_query_type *queries, size_t n, uint64_t *results,
+                          size_t first, size_t last) {
+    const fov_los_query_type *q;
+    size_t i, j, end;
+    uint64_t w;
+    bool lit;
+
+    for (i = first; i < last; ++i) {
+        w = 0;
+        end = n - i*64 < 64 ? n - i*64 : 64;
+        for (j = 0; j < end; ++j) {
+            q = &queries[i*64 + j];
+            if (!fov_los_scan(settings, bitmap, map, q->source_x, q->source_y, q->x, q->y,
+                              q->radius, &lit)) {
+                return false;
+            }
+            if (lit) {
+                w |= (uint64_t)1 << j;
+            }
+        }
+        results[i] = w;
+    }
+    return true;
+}
+
+static void fov_los_job(fov_worker_type *worker) {
+    fov_pool_type *pool = worker->pool;
+    size_t words = (pool->n + 63)/64;
+
+    worker->failed = !fov_los_words(fov_worker_settings(worker), pool->bitmap, pool->map, pool->queries,
+                  pool->n, pool->results, words*worker->index/pool->threads,
+                  words*(worker->index + 1)/pool->threads);
+}
+
+bool fov_los_batch(fov_settings_type *settings,
+                   const fov_bitmap_type *bitmap, void *map,
+                   const fov_los_query_type *queries, size_t n,
+                   uint64_t *results,
+                   fov_pool_type *pool) {
+    unsigned max_radius = 0;
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        if (queries[i].radius > max_radius) {
+            max_radius = queries[i].radius;
+        }
+    }
+    /* Make room for fov_los() up front, so that no query fails. */
+    if (pool == NULL || pool->threads < 2 || n <= 64) {
+        return fov_reserve_stack(settings, max_radius)
+            && fov_los_words(settings, bitmap, map, queries, n, results, 0, (n + 63)/64);
+    }
+    for (i = 0; i < pool->threads; ++i) {
+        if (!fov_reserve_stack(&pool->workers[i].scratch, max_radius)) {
+            return false;
+        }
+    }
+    fov_pool_setup(pool, fov_los_job, settings, max_radius, bitmap, map);
+    pool->queries = queries;
+    pool->results = results;
+    pool->n = n;
+    fov_pool_run(pool);
+    return !fov_pool_failed(pool);
+}
+
+/* Potentially visible sets --------------------------------------- */
+
+#define FOV_PVS_HEADER 32u
+#define FOV_PVS_FOOTER 16u
+#define FOV_PVS_RECORD 8u
+
+/* How the bits of a record's rectangle follow it. */
+#define FOV_PVS_BITS 0u
+#define FOV_PVS_RUNS 1u
+
+static const char fov_pvs_magic[8] = { 'L', 'I', 'B', 'F', 'O', 'V', 'P', 'V' };
+
+/** \cond INTERNAL */
+struct fov_pvs {
+    const unsigned char *data;
+    size_t size;
+    unsigned width;
+    unsigned height;
+    unsigned radius;
+    /* Offset of each tile's record. */
+    const unsigned char *index;
+};
+/** \endcond */
+
+/* Write and read little endian numbers of the given number of bytes. */
+static void fov_pvs_put(unsigned char *p, uint64_t value, unsigned bytes) {
+    unsigned i;
+
+    for (i = 0; i < bytes; ++i) {
+        p[i] = (unsigned char)(value >> (8*i));
+    }
+}
+
+static uint64_t fov_pvs_get(const unsigned char *p, unsigned bytes) {
+    uint64_t value = 0;
+    unsigned i;
+
+    for (i = bytes; i > 0; --i) {
+        value = (value << 8) | p[i - 1];
+    }
+    return value;
+}
+
+/* Write the length of a run seven bits a byte, low bits first, with the
+ * top bit set on every byte but the last. Returns the bytes written. */
+static size_t fov_pvs_put_run(unsigned char *p, uint64_t length) {
+    size_t i = 0;
+
+    while (length >= 0x80u) {
+        p[i++] = (unsigned char)(0x80u | (length & 0x7fu));
+        length >>= 7;
+    }
+    p[i++] = (unsigned char)length;
+    return i;
+}
+
+/* Read the length of a run at *p, which must end before end, and step
+ * past it. A rectangle has fewer than 2^32 bits, so a run of more than
+ * five bytes is corrupt. */
+static bool fov_pvs_get_run(const unsigned char **p, const unsigned char *end, uint64_t *length) {
+    unsigned shift;
+
+    *length = 0;
+    for (shift = 0; shift < 35 && *p < end; shift += 7) {
+        *length |= (uint64_t)(**p & 0x7fu) << shift;
+        if ((*(*p)++ & 0x80u) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Fill in a worker's block of visibility bitsets. */
+static void fov_visibility_job(fov_worker_type *worker) {
+    fov_pool_type *pool = worker->pool;
+    fov_settings_type *settings = fov_worker_settings(worker);
+    fov_private_data_type data;
+    size_t i, first, last;
+
+    first = pool->n*worker->index/pool->threads;
+    last = pool->n*(worker->index + 1)/pool->threads;
+    for (i = first; i < last; ++i) {
+        fov_init_data(&data, settings, pool->bitmap, pool->map, NULL,
+                      pool->sources[i].x, pool->sources[i].y, pool->sources[i].radius);
+        fov_init_visible(&data, pool->outputs + i*pool->outputsize);
+        _fov_circle(&data);
+    }
+}
+
+/* Crop a visibility bitset to the rectangle holding its set bits and
+ * encode it as a record, as runs of clear and set bits or, if those
+ * would take more room, as the bits themselves. Returns the length of
+ * the record, which fits in FOV_PVS_RECORD + 10 bytes more than the
+ * bits of the whole window. */
+static size_t fov_pvs_encode(const uint64_t *visible, unsigned radius, unsigned char *record) {
+    size_t stride = fov_visibility_stride(radius);
+    unsigned size = radius*2 + 1;
+    int x0 = (int)size, y0 = -1, x1 = -1, y1 = -1;
+    unsigned vx, vy, k = 0;
+    size_t i, bytes, length = 1;
+    uint64_t run = 0;
+    bool set = false, bit;
+
+    for (vy = 0; vy < size; ++vy) {
+        for (i = 0; i < stride; ++i) {
+            uint64_t w = visible[vy*stride + i];
+            if (w != 0) {
+                if ((int)(i*64) + fov_lowest_bit(w) < x0) {
+                    x0 = (int)(i*64) + fov_lowest_bit(w);
+                }
+                if ((int)(i*64) + fov_highest_bit(w) > x1) {
+                    x1 = (int)(i*64) + fov_highest_bit(w);
+                }
+                if (y0 < 0) {
+                    y0 = (int)vy;
+                }
+                y1 = (int)vy;
+            }
+        }
+    }
+    if (y0 < 0) {
+        /* Nothing visible: an empty rectangle. */
+        x0 = y0 = (int)radius;
+        x1 = y1 = (int)radius - 1;
+    }
+    fov_pvs_put(record, (uint64_t)(uint16_t)(int16_t)(x0 - (int)radius), 2);
+    fov_pvs_put(record + 2, (uint64_t)(uint16_t)(int16_t)(y0 - (int)radius), 2);
+    fov_pvs_put(record + 4, (uint64_t)(uint16_t)(int16_t)(x1 - (int)radius), 2);
+    fov_pvs_put(record + 6, (uint64_t)(uint16_t)(int16_t)(y1 - (int)radius), 2);
+    record += FOV_PVS_RECORD;
+    if (x1 < x0 || y1 < y0) {
+        return FOV_PVS_RECORD;
+    }
+
+    /* Runs alternate between clear and set, starting with clear, and
+     * give up once they are no shorter than the bits. */
+    bytes = ((size_t)(x1 - x0 + 1)*(size_t)(y1 - y0 + 1) + 7)/8;
+    record[0] = FOV_PVS_RUNS;
+    for (vy = (unsigned)y0; vy <= (unsigned)y1 && length <= bytes; ++vy) {
+        for (vx = (unsigned)x0; vx <= (unsigned)x1 && length <= bytes; ++vx) {
+            bit = ((visible[vy*stride + (vx >> 6)] >> (vx & 63u)) & 1u) != 0;
+            if (bit != set) {
+                length += fov_pvs_put_run(record + length, run);
+                set = bit;
+                run = 0;
+            }
+            ++run;
+        }
+    }
+    length += fov_pvs_put_run(record + length, run);
+    if (length <= bytes) {
+        return FOV_PVS_RECORD + length;
+    }
+
+    record[0] = FOV_PVS_BITS;
+    memset(record + 1, 0, bytes);
+    for (vy = (unsigned)y0; vy <= (unsigned)y1; ++vy) {
+        for (vx = (unsigned)x0; vx <= (unsigned)x1; ++vx, ++k) {
+            if ((visible[vy*stride + (vx >> 6)] >> (vx & 63u)) & 1u) {
+                record[1 + (k >> 3)] |= (unsigned char)(1u << (k & 7u));
+            }
+        }
+    }
+    return FOV_PVS_RECORD + 1 + bytes;
+}
+
+bool fov_pvs_build(fov_settings_type *settings, const fov_bitmap_type *bitmap,
+                   unsigned radius, FILE *out, fov_pool_type *pool) {
+    unsigned width = bitmap->width, height = bitmap->height;
+    size_t size = fov_visibility_size(radius);
+    unsigned char header[FOV_PVS_HEADER];
+    unsigned char footer[FOV_PVS_FOOTER];
+    unsigned char *record = NULL;
+    uint64_t *offsets = NULL, *visible = NULL;
+    fov_source_type *sources = NULL;
+    uint64_t at = 0;
+    bool ok = false;
+    unsigned x, y;
+    size_t i, n;
+
+    if (radius > 32767u) {
+        return false;
+    }
+    offsets = (uint64_t *)fov_malloc(((size_t)width*height + 1)*sizeof(uint64_t));
+    visible = (uint64_t *)fov_malloc(((size_t)width + 1)*size*sizeof(uint64_t));
+    sources = (fov_source_type *)fov_malloc(((size_t)width + 1)*sizeof(fov_source_type));
+    record = (unsigned char *)fov_malloc(FOV_PVS_RECORD + 10 + ((size_t)(radius*2 + 1)*(radius*2 + 1) + 7)/8);
+    if (offsets == NULL || visible == NULL || sources == NULL || record == NULL) {
+        goto done;
+    }
+    /* Without room to scan, a set would be written empty; and without
+     * room for every thread, the calling thread builds them all. */
+    if (!fov_settings_reserve(settings, radius)) {
+        goto done;
+    }
+    if (pool != NULL) {
+        fov_pool_setup(pool, fov_visibility_job, settings, radius, bitmap, NULL);
+        if (!fov_pool_reserve(pool, radius)) {
+            pool = NULL;
+        }
+    }
+
+    memcpy(header, fov_pvs_magic, sizeof(fov_pvs_magic));
+    fov_pvs_put(header + 8, FOV_PVS_VERSION, 4);
+    fov_pvs_put(header + 12, width, 4);
+    fov_pvs_put(header + 16, height, 4);
+    fov_pvs_put(header + 20, radius, 4);
+    fov_pvs_put(header + 24, (uint64_t)settings->shape, 4);
+    fov_pvs_put(header + 28, (uint64_t)settings->opaque_apply, 4);
+    if (fwrite(header, 1, sizeof(header), out) != sizeof(header)) {
+        goto done;
+    }
+    at = sizeof(header);
+
+    /* A row of the map at a time, so that the records are written in
+     * order while the pool works on the next ones. */
+    for (y = 0; y < height; ++y) {
+        n = 0;
+        for (x = 0; x < width; ++x) {
+            if (!fov_bitmap_opaque(bitmap, (int)x, (int)y)) {
+                sources[n].x = (int)x;
+                sources[n].y = (int)y;
+                sources[n].radius = radius;
+                sources[n].source = NULL;
+                ++n;
+            }
+        }
+        if (pool != NULL && n > 1) {
+            pool->sources = sources;
+            pool->n = n;
+            pool->outputs = visible;
+            pool->outputsize = size;
+            fov_pool_run(pool);
+        } else {
+            for (i = 0; i < n; ++i) {
+                fov_circle_visibility(settings, bitmap, NULL, sources[i].x, sources[i].y,
+                                      radius, visible + i*size);
+            }
+        }
+
+        for (x = 0, i = 0; x < width; ++x) {
+            size_t length;
+            if (i < n && sources[i].x == (int)x) {
+                length = fov_pvs_encode(visible + i*size, radius, record);
+                ++i;
+            } else {
+                /* Opaque tiles see nothing. */
+                fov_pvs_put(record, 0, 4);
+                fov_pvs_put(record + 4, 0xffffffffu, 4);
+                length = FOV_PVS_RECORD;
+            }
+            if (fwrite(record, 1, length, out) != length) {
+                goto done;
+            }
+            offsets[(size_t)y*width + x] = at;
+            at += length;
+        }
+    }
+
+    for (i = 0; i < (size_t)width*height; ++i) {
+        fov_pvs_put(record, offsets[i], 8);
+        if (fwrite(record, 1, 8, out) != 8) {
+            goto done;
+        }
+    }
+    fov_pvs_put(footer, at, 8);
+    memcpy(footer + 8, fov_pvs_magic, sizeof(fov_pvs_magic));
+    ok = fwrite(footer, 1, sizeof(footer), out) == sizeof(footer) && fflush(out) == 0;
+
+done:
+    fov_free(offsets);
+    fov_free(visible);
+    fov_free(sources);
+    fov_free(record);
+    return ok;
+}
+
+fov_pvs_type *fov_pvs_open(const char *path) {
+    fov_pvs_type *pvs;
+    struct stat st;
+    uint64_t index;
+    void *data;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)(FOV_PVS_HEADER + FOV_PVS_FOOTER)) {
+        (void)close(fd);
+        return NULL;
+    }
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    (void)close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    pvs = (fov_pvs_type *)fov_malloc(sizeof(fov_pvs_type));
+    if (pvs == NULL) {
+        (void)munmap(data, (size_t)st.st_size);
+        return NULL;
+    }
+    pvs->data = (const unsigned char *)data;
+    pvs->size = (size_t)st.st_size;
+    pvs->width = (unsigned)fov_pvs_get(pvs->data + 12, 4);
+    pvs->height = (unsigned)fov_pvs_get(pvs->data + 16, 4);
+    pvs->radius = (unsigned)fov_pvs_get(pvs->data + 20, 4);
+    index = fov_pvs_get(pvs->data + pvs->size - FOV_PVS_FOOTER, 8);
+
+    /* The table must fill the file between the records and the footer,
+     * checked without overflow before pointing into it. */
+    if (memcmp(pvs->data, fov_pvs_magic, sizeof(fov_pvs_magic)) != 0
+        || memcmp(pvs->data + pvs->size - 8, fov_pvs_magic, sizeof(fov_pvs_magic)) != 0
+        || fov_pvs_get(pvs->data + 8, 4) != FOV_PVS_VERSION
+        || pvs->radius > 32767u
+        || index < FOV_PVS_HEADER
+        || index > pvs->size - FOV_PVS_FOOTER
+        || (pvs->size - FOV_PVS_FOOTER - index) % 8 != 0
+        || (pvs->size - FOV_PVS_FOOTER - index)/8 != (uint64_t)pvs->width*pvs->height) {
+        fov_pvs_close(pvs);
+        return NULL;
+    }
+    pvs->index = pvs->data + index;
+    return pvs;
+}
+
+void fov_pvs_close(fov_pvs_type *pvs) {
+    if (pvs == NULL) {
+        return;
+    }
+    (void)munmap((void *)pvs->data, pvs->size);
+    fov_free(pvs);
+}
+
+unsigned fov_pvs_radius(const fov_pvs_type *pvs) {
+    return pvs->radius;
+}
+
+/* A record's rectangle and where its bits or runs are. */
+typedef struct {
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+    unsigned encoding;
+    /* Bits of the rectangle, a row at a time. */
+    uint64_t bits;
+    const unsigned char *data;
+    /* End of the records, which the runs must not pass. */
+    const unsigned char *end;
+} fov_pvs_record_type;
+
+/* Find the record for the tile at (x,y), or return false if there is
+ * none or its rectangle is empty. */
+static bool fov_pvs_record(const fov_pvs_type *pvs, int x, int y, fov_pvs_record_type *record) {
+    const unsigned char *p;
+    uint64_t offset, records = (uint64_t)(pvs->index - pvs->data);
+
+    if ((unsigned)x >= pvs->width || (unsigned)y >= pvs->height) {
+        return false;
+    }
+    offset = fov_pvs_get(pvs->index + ((size_t)y*pvs->width + (unsigned)x)*8, 8);
+    if (offset < FOV_PVS_HEADER || offset + FOV_PVS_RECORD > records) {
+        return false;
+    }
+    p = pvs->data + offset;
+    record->x0 = (int16_t)fov_pvs_get(p, 2);
+    record->y0 = (int16_t)fov_pvs_get(p + 2, 2);
+    record->x1 = (int16_t)fov_pvs_get(p + 4, 2);
+    record->y1 = (int16_t)fov_pvs_get(p + 6, 2);
+    if (record->x1 < record->x0 || record->y1 < record->y0
+        || record->x0 < -(int)pvs->radius || record->x1 > (int)pvs->radius
+        || record->y0 < -(int)pvs->radius || record->y1 > (int)pvs->radius
+        || offset + FOV_PVS_RECORD + 1 > records) {
+        return false;
+    }
+    record->bits = (uint64_t)(record->x1 - record->x0 + 1)*(uint64_t)(record->y1 - record->y0 + 1);
+    record->encoding = p[FOV_PVS_RECORD];
+    record->data = p + FOV_PVS_RECORD + 1;
+    record->end = pvs->index;
+    if (record->encoding == FOV_PVS_BITS) {
+        return offset + FOV_PVS_RECORD + 1 + (record->bits + 7)/8 <= records;
+    }
+    return record->encoding == FOV_PVS_RUNS;
+}
+
+bool fov_pvs_query(const fov_pvs_type *pvs, int from_x, int from_y, int to_x, int to_y) {
+    fov_pvs_record_type record;
+    int dx = to_x - from_x, dy = to_y - from_y;
+    const unsigned char *p;
+    uint64_t k, at = 0, run;
+    bool set = false;
+
+    if (!fov_pvs_record(pvs, from_x, from_y, &record)
+        || dx < record.x0 || dx > record.x1 || dy < record.y0 || dy > record.y1) {
+        return false;
+    }
+    k = (uint64_t)(dy - record.y0)*(uint64_t)(record.x1 - record.x0 + 1) + (uint64_t)(dx - record.x0);
+    if (record.encoding == FOV_PVS_BITS) {
+        return ((record.data[k >> 3] >> (k & 7u)) & 1u) != 0;
+    }
+    for (p = record.data; fov_pvs_get_run(&p, record.end, &run); set = !set) {
+        at += run;
+        if (k < at) {
+            return set;
+        }
+    }
+    return false;
+}
+
+void fov_pvs_visibility(const fov_pvs_type *pvs, int x, int y, uint64_t *visible) {
+    size_t stride = fov_visibility_stride(pvs->radius);
+    fov_pvs_record_type record;
+    const unsigned char *p;
+    uint64_t k = 0, run;
+    unsigned vx, vy;
+    bool set = false, next = false;
+    int dx, dy;
+
+    memset(visible, 0, fov_visibility_size(pvs->radius)*sizeof(uint64_t));
+    if (!fov_pvs_record(pvs, x, y, &record)) {
+        return;
+    }
+    p = record.data;
+    run = 0;
+    for (dy = record.y0; dy <= record.y1; ++dy) {
+        for (dx = record.x0; dx <= record.x1; ++dx, ++k) {
+            if (record.encoding == FOV_PVS_BITS) {
+                set = ((record.data[k >> 3] >> (k & 7u)) & 1u) != 0;
+            } else {
+                /* Step to the run holding this tile, past any of no
+                 * tiles. */
+                while (run == 0) {
+                    if (!fov_pvs_get_run(&p, record.end, &run)) {
+                        return;
+                    }
+                    set = next;
+                    next = !next;
+                }
+                --run;
+            }
+            if (set) {
+                vx = (unsigned)(dx + (int)pvs->radius);
+                vy = (unsigned)(dy + (int)pvs->radius);
+                visible[vy*stride + (vx >> 6)] |= (uint64_t)1 << (vx & 63u);
+            }
+        }
+    }
+}
+
+/* Opacity grids -------------------------------------------------- */
+
+#define FOV_GRID_HEADER 64u
+
+/* 64-bit FNV-1a, 14695981039346656037 and 1099511628211. */
+#define FOV_FNV_BASIS (((uint64_t)0xcbf29ce4u << 32) | 0x84222325u)
+#define FOV_FNV_PRIME (((uint64_t)0x100u << 32) | 0x000001b3u)
+
+static const char fov_grid_magic[8] = { 'L', 'I', 'B', 'F', 'O', 'V', 'G', 'R' };
+
+/** \cond INTERNAL */
+struct fov_grid {
+    const unsigned char *data;
+    size_t size;
+    /* Points into data. */
+    fov_bitmap_type bitmap;
+    uint64_t checksum;
+};
+/** \endcond */
+
+/* Checksum of the header before its own checksum. */
+static uint64_t fov_grid_header_checksum(const unsigned char *header) {
+    uint64_t h = FOV_FNV_BASIS;
+    unsigned i;
+
+    for (i = 0; i < FOV_GRID_HEADER - 8; ++i) {
+        h = (h ^ header[i])*FOV_FNV_PRIME;
+    }
+    return h;
+}
+
+/* Word w of row y of a bitmap as written to a grid, with the bits past
+ * the width clear. */
+static uint64_t fov_grid_word(const fov_bitmap_type *bitmap, unsigned y, size_t w) {
+    uint64_t word = bitmap->bits[(size_t)y*bitmap->stride + w];
+    size_t rest = bitmap->width - w*64;
+
+    return rest < 64 ? word & ~(~(uint64_t)0 << rest) : word;
+}
+
+/* Grids are scanned in place, so the words must be in the host's order. */
+static bool fov_little_endian(void) {
+    const uint64_t one = 1;
+
+    return *(const unsigned char *)&one == 1;
+}
+
+bool fov_grid_write(const fov_bitmap_type *bitmap, FILE *out) {
+    size_t stride = ((size_t)bitmap->width + 63)/64, w;
+    unsigned char header[FOV_GRID_HEADER], *row;
+    uint64_t checksum = FOV_FNV_BASIS;
+    unsigned y;
+    bool ok = false;
+
+    /* The checksum goes first, so the rows are read twice rather than
+     * needing to seek back in the file. */
+    for (y = 0; y < bitmap->height; ++y) {
+        for (w = 0; w < stride; ++w) {
+            checksum = (checksum ^ fov_grid_word(bitmap, y, w))*FOV_FNV_PRIME;
+        }
+    }
+    memcpy(header, fov_grid_magic, sizeof(fov_grid_magic));
+    fov_pvs_put(header + 8, FOV_GRID_VERSION, 4);
+    fov_pvs_put(header + 12, FOV_GRID_HEADER, 4);
+    fov_pvs_put(header + 16, bitmap->width, 4);
+    fov_pvs_put(header + 20, bitmap->height, 4);
+    fov_pvs_put(header + 24, stride, 8);
+    fov_pvs_put(header + 32, FOV_GRID_HEADER, 8);
+    fov_pvs_put(header + 40, checksum, 8);
+    fov_pvs_put(header + 48, stride, 4);
+    fov_pvs_put(header + 52, 1, 4);
+    fov_pvs_put(header + 56, fov_grid_header_checksum(header), 8);
+    if (fwrite(header, 1, sizeof(header), out) != sizeof(header)) {
+        return false;
+    }
+
+    row = (unsigned char *)fov_malloc(stride*8 + 1);
+    if (row == NULL) {
+        return false;
+    }
+    for (y = 0; y < bitmap->height; ++y) {
+        for (w = 0; w < stride; ++w) {
+            fov_pvs_put(row + w*8, fov_grid_word(bitmap, y, w), 8);
+        }
+        if (fwrite(row, 1, stride*8, out) != stride*8) {
+            goto done;
+        }
+    }
+    ok = fflush(out) == 0;
+
+done:
+    fov_free(row);
+    return ok;
+}
+
+/* Whether the rows of a grid take up exactly the rest of a file of size
+ * bytes from offset. The offset comes from the file, so nothing is added
+ * to it, which could wrap around. */
+static bool fov_grid_fits(size_t size, uint64_t offset, uint64_t stride, unsigned height) {
+    uint64_t words;
+
+    if (offset > size || (size - offset) % 8 != 0) {
+        return false;
+    }
+    words = (size - offset)/8;
+    if (stride == 0) {
+        return words == 0;
+    }
+    return words % stride == 0 && words/stride == height;
+}
+
+fov_grid_type *fov_grid_open(const char *path) {
+    fov_grid_type *grid;
+    struct stat st;
+    uint64_t stride, offset;
+    void *data;
+    int fd;
+
+    if (!fov_little_endian()) {
+        return NULL;
+    }
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)FOV_GRID_HEADER) {
+        (void)close(fd);
+        return NULL;
+    }
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    (void)close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    grid = (fov_grid_type *)fov_malloc(sizeof(fov_grid_type));
+    if (grid == NULL) {
+        (void)munmap(data, (size_t)st.st_size);
+        return NULL;
+    }
+    grid->data = (const unsigned char *)data;
+    grid->size = (size_t)st.st_size;
+    grid->bitmap.width = (unsigned)fov_pvs_get(grid->data + 16, 4);
+    grid->bitmap.height = (unsigned)fov_pvs_get(grid->data + 20, 4);
+    stride = fov_pvs_get(grid->data + 24, 8);
+    offset = fov_pvs_get(grid->data + 32, 8);
+    grid->checksum = fov_pvs_get(grid->data + 40, 8);
+
+    if (memcmp(grid->data, fov_grid_magic, sizeof(fov_grid_magic)) != 0
+        || fov_pvs_get(grid->data + 8, 4) != FOV_GRID_VERSION
+        || fov_pvs_get(grid->data + 12, 4) != FOV_GRID_HEADER
+        || fov_pvs_get(grid->data + 56, 8) != fov_grid_header_checksum(grid->data)
+        || stride != ((uint64_t)grid->bitmap.width + 63)/64
+        || fov_pvs_get(grid->data + 48, 4) != stride
+        || fov_pvs_get(grid->data + 52, 4) != 1
+        || offset < FOV_GRID_HEADER || offset % 8 != 0
+        || !fov_grid_fits(grid->size, offset, stride, grid->bitmap.height)) {
+        fov_grid_close(grid);
+        return NULL;
+    }
+    grid->bitmap.stride = (size_t)stride;
+    grid->bitmap.bits = (const uint64_t *)(grid->data + offset);
+    return grid;
+}
+
+void fov_grid_close(fov_grid_type *grid) {
+    if (grid == NULL) {
+        return;
+    }
+    (void)munmap((void *)grid->data, grid->size);
+    fov_free(grid);
+}
+
+bool fov_grid_verify(const fov_grid_type *grid) {
+    const uint64_t *bits = grid->bitmap.bits;
+    size_t i, n = grid->bitmap.stride*grid->bitmap.height;
+    uint64_t h = FOV_FNV_BASIS;
+
+    for (i = 0; i < n; ++i) {
+        h = (h ^ bits[i])*FOV_FNV_PRIME;
+    }
+    return h == grid->checksum;
+}
+
+const fov_bitmap_type *fov_grid_bitmap(const fov_grid_type *grid) {
+    return &grid->bitmap;
+}
+
+/* Lighting ------------------------------------------------------- */
+
+/* Make room in a brightness table for lights up to a radius. */
+static bool fov_reserve_weights(fov_weights_type *weights, unsigned radius) {
+    size_t size = ((size_t)radius + 1)*((size_t)radius*2 + 1);
+    float *values;
+
+    if (weights->size >= size) {
+        return true;
+    }
+    values = (float *)fov_malloc(size*sizeof(float));
+    if (values == NULL) {
+        return false;
+    }
+    fov_free(weights->values);
+    weights->values = values;
+    weights->size = size;
+    weights->falloff = -1;
+    return true;
+}
+
+/* Fill in the brightness of a light at offset (vx - radius, dy) in row
+ * dy*(2*radius + 1) of the table, for dy from 0 to the radius, unless
+ * it already holds this radius and falloff. */
+static const float *fov_light_weights(fov_weights_type *weights, unsigned radius,
+                                      fov_falloff_type falloff) {
+    unsigned size = radius*2 + 1, vx, dy;
+    float *w = weights->values;
+    double d, t;
+
+    if (weights->falloff == (int)falloff && weights->radius == radius) {
+        return weights->values;
+    }
+    for (dy = 0; dy <= radius; ++dy) {
+        for (vx = 0; vx < size; ++vx, ++w) {
+            d = sqrt((double)((int)vx - (int)radius)*((int)vx - (int)radius) + (double)dy*dy);
+            t = 1.0 - d/(radius + 1.0);
+            if (t < 0.0) {
+                t = 0.0;
+            }
+            switch (falloff) {
+            case FOV_FALLOFF_LINEAR: *w = (float)t; break;
+            case FOV_FALLOFF_QUADRATIC: *w = (float)(t*t); break;
+            default: *w = 1.0f; break;
+            }
+        }
+    }
+    weights->radius = radius;
+    weights->falloff = (int)falloff;
+    return weights->values;
+}
+
+/* Add a light, whose field of view is marked in visible, to the rows
+ * of the buffer from y0 up to y1. */
+static void fov_light_add(const fov_light_type *light, const uint64_t *visible,
+                          const float *weights, float *buffer,
+                          unsigned width, unsigned y0, unsigned y1) {
+    size_t stride = fov_visibility_stride(light->radius);
+    int radius = (int)light->radius, size = radius*2 + 1;
+    int left = light->x - radius, top = light->y - radius;
+    float r = light->colour[0], g = light->colour[1], b = light->colour[2];
+    int vx, vy, first, last, vx0, vx1, vy0, vy1;
+    const float *row;
+    float *out, *p;
+    uint64_t w;
+
+    /* The part of the window over the buffer and these rows. */
+    vx0 = left < 0 ? -left : 0;
+    vx1 = (long)left + size > (long)width ? (int)((long)width - left) : size;
+    vy0 = top < (int)y0 ? (int)y0 - top : 0;
+    vy1 = (long)top + size > (long)y1 ? (int)((long)y1 - top) : size;
+
+    for (vy = vy0; vy < vy1; ++vy) {
+        row = weights + (vy < radius ? radius - vy : vy - radius)*size;
+        out = buffer + 3*(size_t)(top + vy)*width;
+        if (vy == radius && vx0 <= radius && radius < vx1) {
+            /* The light's own tile. */
+            p = out + 3*(size_t)light->x;
+            p[0] += r;
+            p[1] += g;
+            p[2] += b;
+        }
+        vx = vx0;
+        while (vx < vx1) {
+            /* Find the next run of set bits from vx. */
+            w = visible[(size_t)vy*stride + ((unsigned)vx >> 6)] >> ((unsigned)vx & 63u);
+            if (w == 0) {
+                vx = (vx | 63) + 1;
+                continue;
+            }
+            first = vx + fov_lowest_bit(w);
+            if (first >= vx1) {
+                break;
+            }
+            vx = first;
+            for (;;) {
+                w = ~visible[(size_t)vy*stride + ((unsigned)vx >> 6)] >> ((unsigned)vx & 63u);
+                if (w != 0) {
+                    vx += fov_lowest_bit(w);
+                    break;
+                }
+                vx = (vx | 63) + 1;
+            }
+            last = vx < vx1 ? vx : vx1;
+            p = out + 3*(size_t)(left + first);
+            for (; first < last; ++first, p += 3) {
+                p[0] += r*row[first];
+                p[1] += g*row[first];
+                p[2] += b*row[first];
+            }
+        }
+    }
+}
+
+/* Add every light to a worker's band of rows. */
+static void fov_light_job(fov_worker_type *worker) {
+    fov_pool_type *pool = worker->pool;
+    unsigned y0 = (unsigned)((uint64_t)pool->height*worker->index/pool->threads);
+    unsigned y1 = (unsigned)((uint64_t)pool->height*(worker->index + 1)/pool->threads);
+    const fov_light_type *light;
+    size_t i;
+
+    for (i = 0; i < pool->n && y0 < y1; ++i) {
+        light = &pool->lights[i];
+        if (light->y + (int)light->radius < (int)y0 || light->y - (int)light->radius >= (int)y1) {
+            continue;
+        }
+        fov_light_add(light, pool->outputs + i*pool->outputsize,
+                      fov_light_weights(&worker->weights, light->radius, light->falloff),
+                      pool->buffer, pool->width, y0, y1);
+    }
+}
+
+bool fov_light_batch(fov_settings_type *settings,
+                     const fov_bitmap_type *bitmap, void *map,
+                     const fov_light_type *lights, size_t n,
+                     float *buffer, unsigned width, unsigned height,
+                     fov_pool_type *pool) {
+    fov_weights_type weights;
+    fov_source_type *sources;
+    uint64_t *visible;
+    unsigned max_radius = 0;
+    size_t i, size;
+
+    for (i = 0; i < n; ++i) {
+        if (lights[i].radius > max_radius) {
+            max_radius = lights[i].radius;
+        }
+    }
+    size = fov_visibility_size(max_radius);
+
+    if (pool == NULL || pool->threads < 2 || n < 2) {
+        weights.values = NULL;
+        weights.size = 0;
+        weights.falloff = -1;
+        visible = (uint64_t *)fov_malloc(size*sizeof(uint64_t));
+        if (visible == NULL || !fov_reserve_weights(&weights, max_radius)
+            || !fov_settings_reserve(settings, max_radius)) {
+            fov_free(visible);
+            fov_free(weights.values);
+            return false;
+        }
+        for (i = 0; i < n; ++i) {
+            fov_circle_visibility(settings, bitmap, map, lights[i].x, lights[i].y,
+                                  lights[i].radius, visible);
+            fov_light_add(&lights[i], visible,
+                          fov_light_weights(&weights, lights[i].radius, lights[i].falloff),
+                          buffer, width, 0, height);
+        }
+        fov_free(visible);
+        fov_free(weights.values);
+        return true;
+    }
+
+    /* A bitset for every light, whose size must not wrap around. */
+    if (n > (size_t)-1/sizeof(uint64_t)/size) {
+        return false;
+    }
+    fov_pool_setup(pool, fov_visibility_job, settings, max_radius, bitmap, map);
+    for (i = 0; i < pool->threads; ++i) {
+        if (!fov_reserve_weights(&pool->workers[i].weights, max_radius)) {
+            return false;
+        }
+    }
+    if (!fov_pool_reserve(pool, max_radius)) {
+        return false;
+    }
+    sources = (fov_source_type *)fov_calloc(n, sizeof(fov_source_type));
+    visible = (uint64_t *)fov_malloc(n*size*sizeof(uint64_t));
+    if (sources == NULL || visible == NULL) {
+        fov_free(sources);
+        fov_free(visible);
+        return false;
+    }
+    for (i = 0; i < n; ++i) {
+        sources[i].x = lights[i].x;
+        sources[i].y = lights[i].y;
+        sources[i].radius = lights[i].radius;
+        sources[i].source = NULL;
+    }
+
+    /* Share out the fields of view first, then the rows of the buffer. */
+    pool->sources = sources;
+    pool->n = n;
+    pool->outputs = visible;
+    pool->outputsize = size;
+    fov_pool_run(pool);
+
+    pool->job = fov_light_job;
+    pool->lights = lights;
+    pool->buffer = buffer;
+    pool->width = width;
+    pool->height = height;
+    fov_pool_run(pool);
+
+    fov_free(sources);
+    fov_free(visible);
+    return true;
 }
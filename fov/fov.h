@@ -32,6 +32,8 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -71,8 +73,42 @@ typedef enum {
 
 /** @cond INTERNAL */
 typedef /*@null@*/ unsigned *height_array_t;
+typedef struct fov_scratch fov_scratch_type;
 /** @endcond */
 
+/**
+ * Table of precalculated circle heights, created by
+ * fov_heights_create().
+ */
+typedef struct fov_heights fov_heights_type;
+
+/**
+ * Sparse store of the opacity of a map far too big for a bitmap,
+ * created by fov_chunks_create().
+ */
+typedef struct fov_chunks fov_chunks_type;
+
+/**
+ * Block of memory owned by the caller, from which settings take their
+ * scratch space instead of the heap. Set up by fov_arena_init().
+ */
+typedef struct {
+    /** Start of the block. */
+    /*@null@*/ unsigned char *base;
+
+    /** Size of the block in bytes. */
+    size_t size;
+
+    /** Bytes handed out so far. */
+    size_t used;
+} fov_arena_type;
+
+/**
+ * Settings for field of view calculations, set up by
+ * fov_settings_init() and the fov_settings_set_ functions. Fields are
+ * only ever added at the end; those from apply_span on were added in
+ * release 1.1.0.
+ */
 typedef struct {
     /** Opacity test callback. */
     /*@null@*/ bool (*opaque)(void *map, int x, int y);
@@ -98,8 +134,53 @@ typedef struct {
     unsigned numheights;
 
     /** \endcond */
+
+    /** Lighting callback to set lighting on a run of map tiles. */
+    /*@null@*/ void (*apply_span)(void *map, int x0, int y0, int x1, int y1, void *src);
+
+    /** Opacity test callback for a run of tiles. */
+    /*@null@*/ void (*opaque_span)(void *map, int x0, int y0, int x1, int y1, bool *opaque);
+
+    /** Shared table of precalculated heights, or NULL. */
+    /*@null@*/ const fov_heights_type *shared_heights;
+
+    /** Chunked opacity store read instead of the opacity callbacks, or NULL. */
+    /*@null@*/ const fov_chunks_type *chunks;
+
+    /** Arena scratch space is taken from, or NULL for the heap. */
+    /*@null@*/ fov_arena_type *arena;
+
+    /** \cond INTERNAL */
+
+    /** Scan stack and opacity buffer, reused between calls. \internal */
+    /*@null@*/ fov_scratch_type *scratch;
+
+    /** \endcond */
 } fov_settings_type;
 
+/**
+ * Packed opacity bitmap owned by the caller. Tile (x,y) is opaque if
+ * bit (x & 63) of word (y*stride + x/64) is set. Tiles outside
+ * width*height are treated as opaque.
+ *
+ * The scanner finds runs of equally opaque tiles along a row a 64-bit
+ * word at a time, and down a column a tile at a time. This is plain
+ * portable C. There is no SIMD code and no runtime CPU dispatch.
+ */
+typedef struct {
+    /** Packed rows of opacity bits. */
+    const uint64_t *bits;
+
+    /** Width of the map in tiles. */
+    unsigned width;
+
+    /** Height of the map in tiles. */
+    unsigned height;
+
+    /** Distance between the start of consecutive rows, in 64-bit words. */
+    size_t stride;
+} fov_bitmap_type;
+
 /** The opposite direction to that given. */
 #define fov_direction_opposite(direction) ((fov_direction_type)(((direction)+4)&0x7))
 
@@ -129,7 +210,8 @@ void fov_settings_init(fov_settings_type *settings);
  * circle with radius R by precalculating, which consumes more memory
  * at the rate of 4*(R+2) bytes per R used in calls to fov_circle. 
  * Each radius is only calculated once so that it can be used again. 
- * Use fov_free() to free this precalculated data's memory.
+ * Use fov_free() to free this precalculated data's memory. To share
+ * one table between settings and threads, see fov_settings_set_heights().
  *
  * - FOV_SHAPE_CIRCLE: Limit the FOV to a circle with radius R by
  * calculating on-the-fly.
@@ -186,6 +268,21 @@ void fov_settings_set_opaque_apply(fov_settings_type *settings, fov_opaque_apply
  */
 void fov_settings_set_opacity_test_function(fov_settings_type *settings, bool (*f)(void *map, int x, int y));
 
+/**
+ * Set the function used to test the opacity of a run of map tiles. If
+ * set, it is called instead of the opacity test function, once each
+ * time the scanner starts on a column of an octant. The tiles from
+ * (x0,y0) to (x1,y1) inclusive share a row or a column, with x0 <= x1
+ * and y0 <= y1. It must set opaque[i] to the opacity of the i-th tile
+ * from (x0,y0). Tiles after a blocked tile which splits the column may
+ * be asked for again when the scanner comes back to the column. Pass
+ * NULL to go back to testing each tile.
+ *
+ * \param settings Pointer to data structure containing settings.
+ * \param f The function called to test the opacity of a run of map tiles.
+ */
+void fov_settings_set_opacity_span_function(fov_settings_type *settings, void (*f)(void *map, int x0, int y0, int x1, int y1, bool *opaque));
+
 /**
  * Set the function used to apply lighting to a map tile.
  *
@@ -194,9 +291,196 @@ void fov_settings_set_opacity_test_function(fov_settings_type *settings, bool (*
  */
 void fov_settings_set_apply_lighting_function(fov_settings_type *settings, void (*f)(void *map, int x, int y, int dx, int dy, void *src));
 
+/**
+ * Set the function used to apply lighting to a run of map tiles. If
+ * set, it is called instead of the apply callback, once for each
+ * unbroken run of lit tiles in a column of an octant. The tiles from
+ * (x0,y0) to (x1,y1) inclusive share a row or a column, with x0 <= x1
+ * and y0 <= y1. Pass NULL to go back to calling the apply callback for
+ * each tile.
+ *
+ * \param settings Pointer to data structure containing settings.
+ * \param f The function called to apply lighting to a run of map tiles.
+ */
+void fov_settings_set_apply_span_function(fov_settings_type *settings, void (*f)(void *map, int x0, int y0, int x1, int y1, void *src));
+
+/**
+ * Precalculate the heights of circles of every radius from 1 to
+ * max_radius, for FOV_SHAPE_CIRCLE_PRECALCULATE. The table is never
+ * modified after it is created, so it can be shared by any number of
+ * settings structures, used from any number of threads at once. It
+ * takes about 2*R*(R+3) bytes for a maximum radius R.
+ *
+ * \param max_radius Largest radius to precalculate.
+ * \return The new table, or NULL if out of memory.
+ */
+/*@null@*/ fov_heights_type *fov_heights_create(unsigned max_radius);
+
+/**
+ * Free a table created by fov_heights_create(). No settings may still
+ * be using it.
+ *
+ * \param heights Table to free.
+ */
+void fov_heights_free(/*@null@*/ fov_heights_type *heights);
+
+/**
+ * Use a shared table of precalculated heights for
+ * FOV_SHAPE_CIRCLE_PRECALCULATE. Calls with radii the table covers only
+ * read it, and leave the settings' own precalculated heights alone;
+ * larger radii are still precalculated into the settings as before.
+ * The settings still hold a scan stack reused between calls, so each
+ * thread needs its own settings structure. The table is not freed with
+ * the settings.
+ *
+ * \param settings Pointer to data structure containing settings.
+ * \param heights Table created by fov_heights_create(), or NULL.
+ */
+void fov_settings_set_heights(fov_settings_type *settings, /*@null@*/ const fov_heights_type *heights);
+
+/**
+ * Create an empty chunked opacity store, in which every tile is clear.
+ * Tiles are kept in chunks of 64 by 64, found through a hash table by
+ * their 64-bit chunk coordinates, and chunks which are wholly clear or
+ * wholly opaque share one read-only chunk instead of their own, so a
+ * mostly empty map of any size costs little more than its walls.
+ *
+ * \return The new store, or NULL if out of memory.
+ */
+/*@null@*/ fov_chunks_type *fov_chunks_create(void);
+
+/**
+ * Free a store created by fov_chunks_create(). No settings may still
+ * be using it.
+ *
+ * \param chunks Store to free.
+ */
+void fov_chunks_free(/*@null@*/ fov_chunks_type *chunks);
+
+/**
+ * Set the opacity of the tile at (x,y).
+ *
+ * \param chunks Store created by fov_chunks_create().
+ * \param x x-axis coordinate of the tile.
+ * \param y y-axis coordinate of the tile.
+ * \param opaque Whether the tile is opaque.
+ * \return Whether the tile was set, or false if out of memory.
+ */
+bool fov_chunks_set(fov_chunks_type *chunks, int x, int y, bool opaque);
+
+/**
+ * Set the opacity of every tile from (x0,y0) to (x1,y1) inclusive.
+ * Chunks wholly inside the rectangle give up their own tiles for the
+ * shared clear or opaque chunk.
+ *
+ * \param chunks Store created by fov_chunks_create().
+ * \param x0 x-axis coordinate of the first corner.
+ * \param y0 y-axis coordinate of the first corner.
+ * \param x1 x-axis coordinate of the opposite corner, at least x0.
+ * \param y1 y-axis coordinate of the opposite corner, at least y0.
+ * \param opaque Whether the tiles are opaque.
+ * \return Whether the tiles were set, or false if out of memory, in
+ * which case only some of them may have been.
+ */
+bool fov_chunks_fill(fov_chunks_type *chunks, int x0, int y0, int x1, int y1, bool opaque);
+
+/**
+ * Whether the tile at (x,y) is opaque.
+ *
+ * \param chunks Store created by fov_chunks_create().
+ * \param x x-axis coordinate of the tile.
+ * \param y y-axis coordinate of the tile.
+ */
+bool fov_chunks_opaque(const fov_chunks_type *chunks, int x, int y);
+
+/**
+ * Number of chunks holding tiles of their own, rather than sharing the
+ * clear or opaque chunk. Each takes 512 bytes.
+ *
+ * \param chunks Store created by fov_chunks_create().
+ */
+size_t fov_chunks_stored(const fov_chunks_type *chunks);
+
+/**
+ * Read opacity from a chunked store instead of calling the opacity
+ * test functions, in every calculation not given a bitmap. Each
+ * calculation keeps the last chunk it read, so tiles in the same chunk
+ * need no hash lookup. The store must not change while a calculation
+ * reads it, but any number may read it at once. It is not freed with
+ * the settings.
+ *
+ * \param settings Pointer to data structure containing settings.
+ * \param chunks Store created by fov_chunks_create(), or NULL to go
+ * back to the opacity test functions.
+ */
+void fov_settings_set_opacity_chunks(fov_settings_type *settings, /*@null@*/ const fov_chunks_type *chunks);
+
+/**
+ * Route every allocation the library makes through the given
+ * functions, which behave like malloc(), realloc() and free(). Set
+ * this before any other call, while no other thread is using the
+ * library, since memory must be freed by the functions that allocated
+ * it. If any of them is NULL, the standard functions are used again.
+ *
+ * \param alloc Allocate a block, or return NULL.
+ * \param resize Resize a block, or return NULL leaving it unchanged.
+ * \param release Free a block; never given NULL.
+ */
+void fov_set_allocator(/*@null@*/ void *(*alloc)(size_t size),
+                       /*@null@*/ void *(*resize)(void *p, size_t size),
+                       /*@null@*/ void (*release)(void *p));
+
+/**
+ * Set up an arena over a block of memory owned by the caller. Memory
+ * is handed out from the start of the block and never given back, so
+ * the arena is meant to be filled once, by fov_settings_reserve(). To
+ * reuse the block, free every settings using it and set it up again.
+ *
+ * \param arena Arena to set up.
+ * \param buf Block of memory, which must outlive the arena.
+ * \param size Size of the block in bytes.
+ */
+void fov_arena_init(fov_arena_type *arena, /*@null@*/ void *buf, size_t size);
+
+/**
+ * Size of arena sure to be big enough for fov_settings_reserve() with
+ * the given radius.
+ *
+ * \param max_radius Largest radius to be reserved.
+ */
+size_t fov_arena_size(unsigned max_radius);
+
+/**
+ * Take the settings' scratch space from an arena instead of the heap.
+ * Any scratch space the settings already hold is freed first. An
+ * arena must only be used by one thread at a time, though several
+ * settings used by the same thread may share one.
+ *
+ * \param settings Pointer to data structure containing settings.
+ * \param arena Arena set up by fov_arena_init(), or NULL to go back
+ * to the heap.
+ */
+void fov_settings_set_arena(fov_settings_type *settings, /*@null@*/ fov_arena_type *arena);
+
+/**
+ * Allocate all the scratch space the settings need for calculations
+ * of up to the given radius: the scan stack, and for
+ * FOV_SHAPE_CIRCLE_PRECALCULATE the heights of every radius not in the
+ * shared table. After this, no calculation with these settings of a
+ * radius up to max_radius allocates memory, so call it once the shape
+ * and shared heights are set. Memory comes from the settings' arena if
+ * they have one.
+ *
+ * \param settings Pointer to data structure containing settings.
+ * \param max_radius Largest radius to allocate for.
+ * \return Whether the space was allocated, or false if out of memory.
+ */
+bool fov_settings_reserve(fov_settings_type *settings, unsigned max_radius);
+
 /**
  * Free any memory that may have been cached in the settings
- * structure.
+ * structure. Memory taken from an arena stays taken until the arena is
+ * set up again.
  *
  * \param settings Pointer to data structure containing settings.
  */
@@ -205,6 +489,12 @@ void fov_settings_free(fov_settings_type *settings);
 /**
  * Calculate a full circle field of view from a source at (x,y).
  *
+ * The settings hold the scan stack, which a calculation grows when it
+ * needs a bigger one, so two threads must not calculate with the same
+ * settings at once unless fov_settings_reserve() has already made room
+ * for the radius; from then on such calculations only read them. If
+ * the stack cannot be allocated, nothing is lit.
+ *
  * \param settings Pointer to data structure containing settings.
  * \param map Pointer to map data structure to be passed to callbacks.
  * \param source Pointer to data structure holding source of light.
@@ -222,7 +512,8 @@ void fov_circle(fov_settings_type *settings, void *map, void *source,
  * the angle, the wider, "less focused" the beam. Each side of the
  * line pointing in the direction from the source will be half the
  * angle given such that the angle specified will be represented on
- * the raster.
+ * the raster. The settings are used as by fov_circle(): grown when the
+ * radius needs it, and lighting nothing without the memory to grow.
  *
  * \param settings Pointer to data structure containing settings.
  * \param map Pointer to map data structure to be passed to callbacks.
@@ -238,6 +529,961 @@ void fov_beam(fov_settings_type *settings, void *map, void *source,
               fov_direction_type direction, float angle
 );
 
+/**
+ * Calculate a full circle field of view from a source at (x,y), reading
+ * opacity from a packed bitmap instead of calling the opacity test
+ * function. The apply callback is called exactly as by fov_circle().
+ *
+ * \param settings Pointer to data structure containing settings.
+ * \param bitmap Packed opacity bitmap of the map.
+ * \param map Pointer to map data structure to be passed to callbacks.
+ * \param source Pointer to data structure holding source of light.
+ * \param source_x x-axis coordinate from which to start.
+ * \param source_y y-axis coordinate from which to start.
+ * \param radius Euclidean distance from (x,y) after which to stop.
+ */
+void fov_circle_bitmap(fov_settings_type *settings,
+                       const fov_bitmap_type *bitmap,
+                       void *map, void *source,
+                       int source_x, int source_y, unsigned radius
+);
+
+/**
+ * Calculate a beam field of view as fov_beam() does, reading opacity
+ * from a packed bitmap instead of calling the opacity test function.
+ *
+ * \param settings Pointer to data structure containing settings.
+ * \param bitmap Packed opacity bitmap of the map.
+ * \param map Pointer to map data structure to be passed to callbacks.
+ * \param source Pointer to data structure holding source of light.
+ * \param source_x x-axis coordinate from which to start.
+ * \param source_y y-axis coordinate from which to start.
+ * \param radius Euclidean distance from (x,y) after which to stop.
+ * \param direction One of eight directions the beam of light can point.
+ * \param angle The angle at the base of the beam of light, in degrees.
+ */
+void fov_beam_bitmap(fov_settings_type *settings,
+                     const fov_bitmap_type *bitmap,
+                     void *map, void *source,
+                     int source_x, int source_y, unsigned radius,
+                     fov_direction_type direction, float angle
+);
+
+/**
+ * Number of 64-bit words in each row of a visibility bitset for the
+ * given radius.
+ *
+ * \param radius Radius the bitset will be used with.
+ */
+size_t fov_visibility_stride(unsigned radius);
+
+/**
+ * Number of 64-bit words a visibility bitset for the given radius
+ * needs. The bitset covers the (2R+1)*(2R+1) window centred on the
+ * source, one row of fov_visibility_stride() words per row of tiles.
+ *
+ * \param radius Radius the bitset will be used with.
+ */
+size_t fov_visibility_size(unsigned radius);
+
+/**
+ * Whether the tile at offset (dx,dy) from the source was marked
+ * visible in a visibility bitset.
+ *
+ * \param visible Visibility bitset filled in by fov_circle_visibility(),
+ * fov_beam_visibility() or fov_cone_visibility().
+ * \param radius Radius the bitset was filled in with.
+ * \param dx x-axis offset of the tile from the source.
+ * \param dy y-axis offset of the tile from the source.
+ */
+bool fov_visibility_test(const uint64_t *visible, unsigned radius, int dx, int dy);
+
+/**
+ * Calculate a full circle field of view from a source at (x,y),
+ * marking each lit tile in a visibility bitset instead of calling the
+ * apply callback. The bitset is cleared first.
+ *
+ * \param settings Pointer to data structure containing settings.
+ * \param bitmap Packed opacity bitmap of the map, or NULL to use the
+ * opacity test function.
+ * \param map Pointer to map data structure to be passed to callbacks.
+ * \param source_x x-axis coordinate from which to start.
+ * \param source_y y-axis coordinate from which to start.
+ * \param radius Euclidean distance from (x,y) after which to stop.
+ * \param visible Bitset of fov_visibility_size() words.
+ */
+void fov_circle_visibility(fov_settings_type *settings,
+                           const fov_bitmap_type *bitmap, void *map,
+                           int source_x, int source_y, unsigned radius,
+                           uint64_t *visible
+);
+
+/** Totals of the tiles lit by a field of view, from fov_circle_stats(). */
+typedef struct {
+    /** Number of tiles lit. */
+    unsigned long cells;
+
+    /**
+     * Number of tiles lit in each octant. Octant i holds the tiles at
+     * offsets (dx,dy) from the source with:
+     * 0: 0 <= dy <= dx, 1: 0 <= dx < dy, 2: -dx <= dy < 0,
+     * 3: 0 < -dx < dy, 4: 0 <= dy <= -dx, 5: 0 <= dx < -dy,
+     * 6: dx <= dy < 0, 7: dy < dx < 0.
+     */
+    unsigned long octants[8];
+
+    /** Sum of dx*dx + dy*dy over the tiles lit. */
+    uint64_t distance2;
+} fov_stats_type;
+
+/**
+ * Count the tiles a full circle field of view from a source at (x,y)
+ * lights, without calling the apply callback or marking any tile. Each
+ * run of lit tiles in a column is added to the totals at once. The
+ * totals are the number of times fov_circle() would call apply, which
+ * lights no tile twice.
+ *
+ * \param settings Pointer to data structure containing settings.
+ * \param bitmap Packed opacity bitmap of the map, or NULL to use the
+ * opacity test function.
+ * \param map Pointer to map data structure to be passed to callbacks.
+ * \param source_x x-axis coordinate from which to start.
+ * \param source_y y-axis coordinate from which to start.
+ * \param radius Euclidean distance from (x,y) after which to stop.
+ * \param stats Totals to fill in.
+ * \param bands Unless NULL, radius+1 counters, where bands[d] is set to
+ * the number of tiles lit d steps from the source, max(|dx|,|dy|).
+ */
+void fov_circle_stats(fov_settings_type *settings,
+                      const fov_bitmap_type *bitmap, void *map,
+                      int source_x, int source_y, unsigned radius,
+                      fov_stats_type *stats,
+                      /*@null@*/ unsigned long *bands
+);
+
+/**
+ * Calculate a beam field of view as fov_beam() does, marking each lit
+ * tile in a visibility bitset instead of calling the apply callback.
+ * The bitset is cleared first.
+ *
+ * \param settings Pointer to data structure containing settings.
+ * \param bitmap Packed opacity bitmap of the map, or NULL to use the
+ * opacity test function.
+ * \param map Pointer to map data structure to be passed to callbacks.
+ * \param source_x x-axis coordinate from which to start.
+ * \param source_y y-axis coordinate from which to start.
+ * \param radius Euclidean distance from (x,y) after which to stop.
+ * \param direction One of eight directions the beam of light can point.
+ * \param angle The angle at the base of the beam of light, in degrees.
+ * \param visible Bitset of fov_visibility_size() words.
+ */
+void fov_beam_visibility(fov_settings_type *settings,
+                         const fov_bitmap_type *bitmap, void *map,
+                         int source_x, int source_y, unsigned radius,
+                         fov_direction_type direction, float angle,
+                         uint64_t *visible
+);
+
+/**
+ * Calculate a field of view from a source at (x,y) in a cone pointing
+ * in any direction. Each octant the cone covers is scanned between the
+ * slopes of the cone's edges within it, and the others not at all.
+ * Tiles on the rays along the cone's edges are lit, so a cone pointing
+ * along one of the eight directions of fov_beam(), with a half angle of
+ * a multiple of 45 degrees, lights the beam's tiles and perhaps those
+ * on its edges too. Where the cone leaves a gap narrower than a tile
+ * within an octant, the tiles by the gap may be lit twice. Like
+ * fov_circle(), it may grow the settings' scan stack.
+ *
+ * \param settings Pointer to data structure containing settings.
+ * \param map Pointer to map data structure to be passed to callbacks.
+ * \param source Pointer to data structure holding source of light.
+ * \param source_x x-axis coordinate from which to start.
+ * \param source_y y-axis coordinate from which to start.
+ * \param radius Euclidean distance from (x,y) after which to stop.
+ * \param direction Direction of the middle of the cone in radians,
+ * anticlockwise from east (+x), so that north (-y) is pi/2.
+ * \param half_angle Angle between the middle and each edge of the
+ * cone in radians. Pi or more gives a full circle; less than 0
+ * lights nothing.
+ */
+void fov_cone(fov_settings_type *settings, void *map, void *source,
+              int source_x, int source_y, unsigned radius,
+              float direction, float half_angle
+);
+
+/**
+ * Calculate a cone field of view as fov_cone() does, reading opacity
+ * from a packed bitmap instead of calling the opacity test function.
+ *
+ * \param settings Pointer to data structure containing settings.
+ * \param bitmap Packed opacity bitmap of the map.
+ * \param map Pointer to map data structure to be passed to callbacks.
+ * \param source Pointer to data structure holding source of light.
+ * \param source_x x-axis coordinate from which to start.
+ * \param source_y y-axis coordinate from which to start.
+ * \param radius Euclidean distance from (x,y) after which to stop.
+ * \param direction Direction of the middle of the cone in radians.
+ * \param half_angle Angle between the middle and each edge in radians.
+ */
+void fov_cone_bitmap(fov_settings_type *settings,
+                     const fov_bitmap_type *bitmap,
+                     void *map, void *source,
+                     int source_x, int source_y, unsigned radius,
+                     float direction, float half_angle
+);
+
+/**
+ * Calculate a cone field of view as fov_cone() does, marking each lit
+ * tile in a visibility bitset instead of calling the apply callback.
+ * The bitset is cleared first.
+ *
+ * \param settings Pointer to data structure containing settings.
+ * \param bitmap Packed opacity bitmap of the map, or NULL to use the
+ * opacity test function.
+ * \param map Pointer to map data structure to be passed to callbacks.
+ * \param source_x x-axis coordinate from which to start.
+ * \param source_y y-axis coordinate from which to start.
+ * \param radius Euclidean distance from (x,y) after which to stop.
+ * \param direction Direction of the middle of the cone in radians.
+ * \param half_angle Angle between the middle and each edge in radians.
+ * \param visible Bitset of fov_visibility_size() words.
+ */
+void fov_cone_visibility(fov_settings_type *settings,
+                         const fov_bitmap_type *bitmap, void *map,
+                         int source_x, int source_y, unsigned radius,
+                         float direction, float half_angle,
+                         uint64_t *visible
+);
+
+/**
+ * Whether the tile at (x,y) is lit by a full circle field of view from
+ * (source_x,source_y), exactly as by fov_circle(), without calculating
+ * the rest of the field of view. Only the octants holding the tile are
+ * scanned, and in each one only the runs of clear tiles whose slopes
+ * can still reach it. As with fov_circle(), the source itself is never
+ * lit.
+ *
+ * \param settings Pointer to data structure containing settings. The
+ * apply callbacks are not used.
+ * \param bitmap Packed opacity bitmap of the map, or NULL to use the
+ * opacity test function.
+ * \param map Pointer to map data structure to be passed to callbacks.
+ * \param source_x x-axis coordinate from which to start.
+ * \param source_y y-axis coordinate from which to start.
+ * \param x x-axis coordinate of the tile.
+ * \param y y-axis coordinate of the tile.
+ * \param radius Euclidean distance from the source after which to stop.
+ * \param lit Set to whether the tile is lit.
+ * \return false if there was not enough memory to tell, or if the scan
+ * would have overrun its stack, which should never happen. Either way
+ * lit is left alone.
+ */
+bool fov_los(fov_settings_type *settings,
+             const fov_bitmap_type *bitmap, void *map,
+             int source_x, int source_y, int x, int y,
+             unsigned radius, bool *lit
+);
+
+/**
+ * Search a full circle field of view from (source_x,source_y) for a
+ * tile passing a test, stopping at the first one found. The tiles
+ * tested are exactly those fov_circle() would light, but they are
+ * visited nearest first: every octant's column at a distance of 1 from
+ * the source, then every column at 2, and so on, each from its axis
+ * out, so a target close by is found after only a few tiles.
+ *
+ * \param settings Pointer to data structure containing settings. The
+ * apply callbacks are not used.
+ * \param bitmap Packed opacity bitmap of the map, or NULL to use the
+ * opacity test function.
+ * \param map Pointer to map data structure to be passed to callbacks.
+ * \param source Pointer to data structure holding source of light.
+ * \param source_x x-axis coordinate from which to start.
+ * \param source_y y-axis coordinate from which to start.
+ * \param radius Euclidean distance from the source after which to stop.
+ * \param target Called with the same arguments as the apply callback
+ * for each tile in view until it returns true.
+ * \param found_x Set to the x-axis coordinate of the tile found, unless
+ * NULL.
+ * \param found_y Set to the y-axis coordinate of the tile found, unless
+ * NULL.
+ * \return Whether a tile was found, or false if there was not enough
+ * memory.
+ */
+bool fov_circle_search(fov_settings_type *settings,
+                       const fov_bitmap_type *bitmap,
+                       void *map, void *source,
+                       int source_x, int source_y, unsigned radius,
+                       bool (*target)(void *map, int x, int y,
+                                      int dx, int dy, void *src),
+                       /*@null@*/ int *found_x, /*@null@*/ int *found_y
+);
+
+/** Cache of the fields of view of many viewers on one map. */
+typedef struct fov_cache fov_cache_type;
+
+/** Side, in tiles, of the squares a cache indexes viewers by. */
+#define FOV_CACHE_BUCKET 16
+
+/**
+ * Create a cache of fields of view on a map of width*height tiles.
+ * Each viewer's field of view is calculated as fov_circle_visibility()
+ * does, and kept until a tile whose opacity it tested is invalidated
+ * or the viewer moves. The settings, bitmap and map must stay valid
+ * until the cache is freed.
+ *
+ * \param settings Pointer to data structure containing settings.
+ * \param bitmap Packed opacity bitmap of the map, or NULL to use the
+ * opacity test function.
+ * \param map Pointer to map data structure to be passed to callbacks.
+ * \param width Width of the map in tiles.
+ * \param height Height of the map in tiles.
+ * \return The new cache, or NULL if out of memory.
+ */
+/*@null@*/ fov_cache_type *fov_cache_create(fov_settings_type *settings,
+                                           const fov_bitmap_type *bitmap, void *map,
+                                           unsigned width, unsigned height);
+
+/**
+ * Free a cache and all its viewers.
+ *
+ * \param cache Cache created by fov_cache_create().
+ */
+void fov_cache_free(/*@null@*/ fov_cache_type *cache);
+
+/**
+ * Add a viewer at (x,y). Its field of view is calculated the first time
+ * it is asked for.
+ *
+ * \param cache Cache created by fov_cache_create().
+ * \param x x-axis coordinate of the viewer.
+ * \param y y-axis coordinate of the viewer.
+ * \param radius Euclidean distance from (x,y) after which to stop.
+ * \return Number identifying the viewer, or -1 if out of memory.
+ */
+int fov_cache_add(fov_cache_type *cache, int x, int y, unsigned radius);
+
+/**
+ * Remove a viewer. Its number may be given to a later viewer.
+ *
+ * \param cache Cache created by fov_cache_create().
+ * \param viewer Number returned by fov_cache_add().
+ */
+void fov_cache_remove(fov_cache_type *cache, int viewer);
+
+/**
+ * Move a viewer to (x,y), making its field of view stale.
+ *
+ * \param cache Cache created by fov_cache_create().
+ * \param viewer Number returned by fov_cache_add().
+ * \param x New x-axis coordinate of the viewer.
+ * \param y New y-axis coordinate of the viewer.
+ */
+void fov_cache_move(fov_cache_type *cache, int viewer, int x, int y);
+
+/**
+ * Whether a viewer's field of view needs calculating again.
+ *
+ * \param cache Cache created by fov_cache_create().
+ * \param viewer Number returned by fov_cache_add().
+ */
+bool fov_cache_stale(const fov_cache_type *cache, int viewer);
+
+/**
+ * The visibility bitset of a viewer, calculated again first if it is
+ * stale. Test it with fov_visibility_test() and the viewer's radius.
+ * It stays valid until the viewer is next moved, removed or
+ * recalculated.
+ *
+ * \param cache Cache created by fov_cache_create().
+ * \param viewer Number returned by fov_cache_add().
+ * \return The bitset, or NULL if out of memory.
+ */
+/*@null@*/ const uint64_t *fov_cache_visibility(fov_cache_type *cache, int viewer);
+
+/**
+ * Tell the cache that the opacity of the tile at (x,y) has changed.
+ * Only the viewers whose last calculation tested the tile become stale:
+ * a tile which was never tested could not have changed the result.
+ *
+ * \param cache Cache created by fov_cache_create().
+ * \param x x-axis coordinate of the tile.
+ * \param y y-axis coordinate of the tile.
+ */
+void fov_cache_invalidate(fov_cache_type *cache, int x, int y);
+
+/**
+ * Tell the cache that the opacity of some of the tiles from (x0,y0) to
+ * (x1,y1) inclusive has changed, as fov_cache_invalidate() does for a
+ * single tile.
+ *
+ * \param cache Cache created by fov_cache_create().
+ * \param x0 x-axis coordinate of one corner.
+ * \param y0 y-axis coordinate of one corner.
+ * \param x1 x-axis coordinate of the opposite corner.
+ * \param y1 y-axis coordinate of the opposite corner.
+ */
+void fov_cache_invalidate_rect(fov_cache_type *cache, int x0, int y0, int x1, int y1);
+
+/**
+ * Number of fields of view a cache has calculated since it was created.
+ *
+ * \param cache Cache created by fov_cache_create().
+ */
+unsigned long fov_cache_scans(const fov_cache_type *cache);
+
+/** Cache of recent fields of view, see fov_memo_create(). */
+typedef struct fov_memo fov_memo_type;
+
+/** Counters kept by a cache of recent fields of view. */
+typedef struct {
+    /** Calls answered from the cache. */
+    unsigned long hits;
+
+    /** Calls which had to calculate the field of view. */
+    unsigned long misses;
+
+    /** Fields of view dropped to stay within the memory limit. */
+    unsigned long evictions;
+
+    /** Fields of view held. */
+    size_t entries;
+
+    /** Memory used by the fields of view held, in bytes. */
+    size_t bytes;
+} fov_memo_stats_type;
+
+/**
+ * Create a cache of recent fields of view. Each is stored as the runs
+ * of lit tiles in each row, and keyed by the position, radius, shape,
+ * opaque apply setting, beam direction and angle, map and bitmap
+ * pointers, and a generation number chosen by the caller. The least
+ * recently used fields of view are dropped to keep their memory within
+ * max_bytes.
+ *
+ * \param max_bytes Limit on the memory used by the stored fields of view.
+ * \return The new cache, or NULL if out of memory.
+ */
+/*@null@*/ fov_memo_type *fov_memo_create(size_t max_bytes);
+
+/**
+ * Free a cache of recent fields of view.
+ *
+ * \param memo Cache created by fov_memo_create().
+ */
+void fov_memo_free(/*@null@*/ fov_memo_type *memo);
+
+/**
+ * Calculate a full circle field of view as fov_circle_visibility()
+ * does, or replay it from the cache if the same question was asked
+ * with the same generation number. A replay never calls the opacity
+ * test. The caller must change the generation number whenever the
+ * opacity of the map changes.
+ *
+ * If visible is NULL, each lit tile is reported once, a row at a time
+ * in increasing y and x, through apply_span for each run of a row if
+ * it is set, otherwise through apply. This is the same on a hit and a
+ * miss. Otherwise the tiles are marked in visible and no apply callback
+ * is called. If the cache has no memory for the bitset it works in,
+ * the field of view is calculated without it, as fov_circle() or
+ * fov_circle_visibility() would, reporting tiles in the order it finds
+ * them.
+ *
+ * \param memo Cache created by fov_memo_create().
+ * \param settings Pointer to data structure containing settings.
+ * \param bitmap Packed opacity bitmap of the map, or NULL to use the
+ * opacity test function.
+ * \param map Pointer to map data structure to be passed to callbacks.
+ * \param source Pointer to data structure holding source of light.
+ * \param source_x x-axis coordinate from which to start.
+ * \param source_y y-axis coordinate from which to start.
+ * \param radius Euclidean distance from (x,y) after which to stop.
+ * \param generation Caller's version number of the map's opacity.
+ * \param visible Bitset of fov_visibility_size() words, or NULL.
+ */
+void fov_memo_circle(fov_memo_type *memo, fov_settings_type *settings,
+                     const fov_bitmap_type *bitmap, void *map, void *source,
+                     int source_x, int source_y, unsigned radius,
+                     unsigned long generation, /*@null@*/ uint64_t *visible
+);
+
+/**
+ * Calculate a beam field of view as fov_beam_visibility() does, or
+ * replay it from the cache, as fov_memo_circle() does.
+ *
+ * \param memo Cache created by fov_memo_create().
+ * \param settings Pointer to data structure containing settings.
+ * \param bitmap Packed opacity bitmap of the map, or NULL to use the
+ * opacity test function.
+ * \param map Pointer to map data structure to be passed to callbacks.
+ * \param source Pointer to data structure holding source of light.
+ * \param source_x x-axis coordinate from which to start.
+ * \param source_y y-axis coordinate from which to start.
+ * \param radius Euclidean distance from (x,y) after which to stop.
+ * \param direction One of eight directions the beam of light can point.
+ * \param angle The angle at the base of the beam of light, in degrees.
+ * \param generation Caller's version number of the map's opacity.
+ * \param visible Bitset of fov_visibility_size() words, or NULL.
+ */
+void fov_memo_beam(fov_memo_type *memo, fov_settings_type *settings,
+                   const fov_bitmap_type *bitmap, void *map, void *source,
+                   int source_x, int source_y, unsigned radius,
+                   fov_direction_type direction, float angle,
+                   unsigned long generation, /*@null@*/ uint64_t *visible
+);
+
+/**
+ * Read the counters of a cache of recent fields of view.
+ *
+ * \param memo Cache created by fov_memo_create().
+ * \param stats Filled in with the counters.
+ */
+void fov_memo_stats(const fov_memo_type *memo, fov_memo_stats_type *stats);
+
+/** A source of light in a batch. */
+typedef struct {
+    /** x-axis coordinate from which to start. */
+    int x;
+
+    /** y-axis coordinate from which to start. */
+    int y;
+
+    /** Euclidean distance from (x,y) after which to stop. */
+    unsigned radius;
+
+    /** Pointer to data structure holding source of light. */
+    void *source;
+} fov_source_type;
+
+/**
+ * Pool of worker threads for fov_circle_batch(),
+ * fov_circle_batch_ordered(), fov_circle_parallel(), fov_los_batch(),
+ * fov_pvs_build() and fov_light_batch().
+ */
+typedef struct fov_pool fov_pool_type;
+
+/** Default smallest radius fov_circle_parallel() splits between threads. */
+#define FOV_POOL_THRESHOLD 64
+
+/**
+ * Start a pool of worker threads. Each thread keeps its own scratch
+ * space, which is reused from batch to batch.
+ *
+ * \param threads Number of threads to light a batch with, including the
+ * calling thread, or 0 for one per online processor.
+ * \return The new pool, or NULL if the threads could not be started.
+ */
+/*@null@*/ fov_pool_type *fov_pool_create(unsigned threads);
+
+/**
+ * Set the smallest radius fov_circle_parallel() splits between the
+ * threads of a pool. Smaller fields of view are calculated on the
+ * calling thread alone. The default is FOV_POOL_THRESHOLD.
+ *
+ * \param pool Pool created by fov_pool_create().
+ * \param radius Smallest radius to split.
+ */
+void fov_pool_set_threshold(fov_pool_type *pool, unsigned radius);
+
+/**
+ * Stop the threads of a pool and free it.
+ *
+ * \param pool Pool created by fov_pool_create().
+ */
+void fov_pool_free(/*@null@*/ fov_pool_type *pool);
+
+/**
+ * Calculate a full circle field of view from each of a number of
+ * sources, as fov_circle() or fov_circle_bitmap() would, spread across
+ * the threads of a pool. The sources are split into consecutive blocks
+ * of equal size, one per thread, and each thread lights its block in
+ * order, so which thread lights a source and in what order never
+ * changes between runs. The threads' scan stacks are made ready first,
+ * and without the memory for them every source is lit on the calling
+ * thread instead. Returns once every source is done. The apply
+ * calls of different threads still interleave in whatever order the
+ * threads happen to run; fov_circle_batch_ordered() reports them in
+ * source order instead.
+ *
+ * The callbacks are called from several threads at once. The opacity
+ * test must only read the map, and apply must only change data that
+ * belongs to its source. The settings are only read.
+ *
+ * \param settings Pointer to data structure containing settings.
+ * \param bitmap Packed opacity bitmap of the map, or NULL to use the
+ * opacity test function.
+ * \param map Pointer to map data structure to be passed to callbacks.
+ * \param sources Array of sources of light.
+ * \param n Number of sources.
+ * \param pool Pool created by fov_pool_create(), or NULL to light every
+ * source on the calling thread.
+ */
+void fov_circle_batch(fov_settings_type *settings,
+                      const fov_bitmap_type *bitmap, void *map,
+                      const fov_source_type *sources, size_t n,
+                      /*@null@*/ fov_pool_type *pool
+);
+
+/**
+ * Calculate a full circle field of view from a source at (x,y), scanning
+ * the eight octants on the threads of a pool at once. Each thread marks
+ * its octants in a visibility bitset of its own, and these are merged
+ * once every thread is done.
+ *
+ * If visible is NULL, each lit tile is then reported once from the
+ * calling thread, a row at a time in increasing y and x. This is
+ * through apply_span for each run of a row if it is set, otherwise
+ * through apply. The same tiles are lit as by fov_circle(), but not in
+ * the same order. Otherwise the tiles are marked in visible as by
+ * fov_circle_visibility(), and no apply callback is called.
+ *
+ * Radii below the pool's threshold are calculated on the calling
+ * thread only, exactly as fov_circle_bitmap() or
+ * fov_circle_visibility() would, and so is any circle when there is
+ * not enough memory for the threads' bitsets and scan stacks, which
+ * are all made ready before the threads start. The opacity test may be
+ * called from several threads at once and must only read the map.
+ *
+ * \param settings Pointer to data structure containing settings.
+ * \param bitmap Packed opacity bitmap of the map, or NULL to use the
+ * opacity test function.
+ * \param map Pointer to map data structure to be passed to callbacks.
+ * \param source Pointer to data structure holding source of light.
+ * \param source_x x-axis coordinate from which to start.
+ * \param source_y y-axis coordinate from which to start.
+ * \param radius Euclidean distance from (x,y) after which to stop.
+ * \param visible Bitset of fov_visibility_size() words, or NULL.
+ * \param pool Pool created by fov_pool_create(), or NULL to use the
+ * calling thread only.
+ */
+void fov_circle_parallel(fov_settings_type *settings,
+                         const fov_bitmap_type *bitmap, void *map, void *source,
+                         int source_x, int source_y, unsigned radius,
+                         /*@null@*/ uint64_t *visible,
+                         /*@null@*/ fov_pool_type *pool
+);
+
+/**
+ * Calculate a full circle field of view from each of a number of
+ * sources like fov_circle_batch(), but report the lit tiles from the
+ * calling thread only, one source after another in the order of the
+ * array. The same calls are made on every run, whatever the number of
+ * threads.
+ *
+ * The threads scan a round of sources at a time, one each, into
+ * visibility bitsets of their own. Once a round is done the calling
+ * thread reports its sources in order, each a row at a time in
+ * increasing y and x. This is through apply_span for each run of a row
+ * if it is set, otherwise through apply. The same tiles are lit as by
+ * fov_circle(), but not in the same order within a source. Without a
+ * pool, or without the memory for the bitsets, every source is lit on
+ * the calling thread as by fov_circle_batch() with no pool.
+ *
+ * Only the opacity test is called from several threads at once, and it
+ * must only read the map. The apply callbacks may change anything.
+ *
+ * \param settings Pointer to data structure containing settings.
+ * \param bitmap Packed opacity bitmap of the map, or NULL to use the
+ * opacity test function.
+ * \param map Pointer to map data structure to be passed to callbacks.
+ * \param sources Array of sources of light.
+ * \param n Number of sources.
+ * \param pool Pool created by fov_pool_create(), or NULL to light every
+ * source on the calling thread.
+ */
+void fov_circle_batch_ordered(fov_settings_type *settings,
+                              const fov_bitmap_type *bitmap, void *map,
+                              const fov_source_type *sources, size_t n,
+                              /*@null@*/ fov_pool_type *pool
+);
+
+/** A line of sight query for fov_los_batch(). */
+typedef struct {
+    /** x-axis coordinate of the source. */
+    int source_x;
+
+    /** y-axis coordinate of the source. */
+    int source_y;
+
+    /** x-axis coordinate of the tile. */
+    int x;
+
+    /** y-axis coordinate of the tile. */
+    int y;
+
+    /** Euclidean distance from the source after which to stop. */
+    unsigned radius;
+} fov_los_query_type;
+
+/**
+ * Answer a batch of line of sight queries as fov_los() does. Each
+ * query is answered on its own by the same scalar scan; no queries are
+ * answered together in SIMD lanes. With a pool, each thread answers
+ * the queries of its own words of the results, so no two threads write
+ * the same word. The speed-up is that of the threads alone.
+ *
+ * \param settings Pointer to data structure containing settings. The
+ * apply callbacks are not used.
+ * \param bitmap Packed opacity bitmap of the map, or NULL to use the
+ * opacity test function.
+ * \param map Pointer to map data structure to be passed to callbacks.
+ * \param queries Queries to answer.
+ * \param n Number of queries.
+ * \param results Bitset of (n + 63)/64 words, in which bit i%64 of
+ * word i/64 is set if query i's tile is lit and cleared otherwise.
+ * \param pool Pool created by fov_pool_create(), or NULL to use the
+ * calling thread only.
+ * \return false if there was not enough memory, in which case no query
+ * has been answered, or if a query's scan would have overrun its stack,
+ * which should never happen, in which case the results are undefined.
+ */
+bool fov_los_batch(fov_settings_type *settings,
+                   const fov_bitmap_type *bitmap, void *map,
+                   const fov_los_query_type *queries, size_t n,
+                   uint64_t *results,
+                   /*@null@*/ fov_pool_type *pool
+);
+
+/** Version of the file format written by fov_pvs_build(). */
+#define FOV_PVS_VERSION 2
+
+/** Potentially visible sets read from a file, see fov_pvs_open(). */
+typedef struct fov_pvs fov_pvs_type;
+
+/**
+ * Calculate the field of view from every transparent tile of a static
+ * map, as fov_circle_visibility() would with the given radius, and
+ * write them to a file. Each tile's set is cropped to the smallest
+ * rectangle holding it and run-length encoded, unless its runs would
+ * take more room than its bits. The file is written front to back in
+ * one pass:
+ *
+ * - a 32 byte header: the 8 bytes "LIBFOVPV", then the format version,
+ *   width, height, radius, shape and opaque apply setting and a zero,
+ *   each as a 32-bit unsigned number;
+ * - a record for each tile, in increasing y and x: the offsets from the
+ *   tile of the left, top, right and bottom of the rectangle as 16-bit
+ *   signed numbers (right < left for an empty set, which ends the
+ *   record). Then a byte saying how the tiles of the rectangle, taken a
+ *   row at a time, follow:
+ *   - 0: their bits, least significant bit first, padded to a whole
+ *     byte;
+ *   - 1: the lengths of the runs of tiles not lit and lit in turn,
+ *     starting with one not lit which may be of no tiles. Each length
+ *     is written seven bits a byte, least significant first, with the
+ *     top bit set on all but its last byte;
+ * - the offset from the start of the file of each tile's record, each
+ *   as a 64-bit unsigned number;
+ * - the offset of that table as a 64-bit unsigned number, and the 8
+ *   bytes "LIBFOVPV" again.
+ *
+ * All numbers are little endian.
+ *
+ * \param settings Pointer to data structure containing settings.
+ * \param bitmap Packed opacity bitmap of the map.
+ * \param radius Radius to calculate each field of view with, at most
+ * 32767.
+ * \param out File to write to.
+ * \param pool Pool created by fov_pool_create() to share the work
+ * with, or NULL to use the calling thread only.
+ * \return Whether the whole file was written.
+ */
+bool fov_pvs_build(fov_settings_type *settings, const fov_bitmap_type *bitmap,
+                   unsigned radius, FILE *out, /*@null@*/ fov_pool_type *pool);
+
+/**
+ * Map a file written by fov_pvs_build() into memory.
+ *
+ * \param path Name of the file.
+ * \return The sets, or NULL if the file could not be mapped or is not
+ * a version FOV_PVS_VERSION file.
+ */
+/*@null@*/ fov_pvs_type *fov_pvs_open(const char *path);
+
+/**
+ * Unmap a file mapped by fov_pvs_open().
+ *
+ * \param pvs Sets returned by fov_pvs_open().
+ */
+void fov_pvs_close(/*@null@*/ fov_pvs_type *pvs);
+
+/**
+ * Radius the sets were calculated with.
+ *
+ * \param pvs Sets returned by fov_pvs_open().
+ */
+unsigned fov_pvs_radius(const fov_pvs_type *pvs);
+
+/**
+ * Whether the tile at (to_x,to_y) is in the field of view from the
+ * tile at (from_x,from_y), in constant time. As with fov_circle(), a
+ * tile is never in its own field of view.
+ *
+ * \param pvs Sets returned by fov_pvs_open().
+ * \param from_x x-axis coordinate of the source.
+ * \param from_y y-axis coordinate of the source.
+ * \param to_x x-axis coordinate of the tile.
+ * \param to_y y-axis coordinate of the tile.
+ */
+bool fov_pvs_query(const fov_pvs_type *pvs, int from_x, int from_y, int to_x, int to_y);
+
+/**
+ * Fill in a visibility bitset from the stored field of view from
+ * (x,y), as fov_circle_visibility() would, without testing opacity.
+ * The bitset is cleared first, and left clear for tiles off the map or
+ * opaque.
+ *
+ * \param pvs Sets returned by fov_pvs_open().
+ * \param x x-axis coordinate of the source.
+ * \param y y-axis coordinate of the source.
+ * \param visible Bitset of fov_visibility_size() words for the radius
+ * of the sets.
+ */
+void fov_pvs_visibility(const fov_pvs_type *pvs, int x, int y, uint64_t *visible);
+
+/** Version of the file format written by fov_grid_write(). */
+#define FOV_GRID_VERSION 1
+
+/** An opacity grid read from a file, see fov_grid_open(). */
+typedef struct fov_grid fov_grid_type;
+
+/**
+ * Write the opacity of a map to a file that fov_grid_open() can map
+ * into memory and scan in place. The file holds:
+ *
+ * - a 64 byte header: the 8 bytes "LIBFOVGR"; the format version and
+ *   the header's length, 64, as 32-bit unsigned numbers; the width and
+ *   height in tiles as 32-bit unsigned numbers; then as 64-bit unsigned
+ *   numbers the stride, the number of 64-bit words in a row, the offset
+ *   of the first row from the start of the file and the checksum of the
+ *   rows; then the tiling, as 32-bit unsigned numbers giving the width
+ *   of a tile in 64-bit words and its height in rows; and last the
+ *   checksum of the 56 bytes before it;
+ * - the rows of the map in increasing y, each stride 64-bit words
+ *   holding 64 tiles in increasing x from the least significant bit,
+ *   with 1 for opaque, as in fov_bitmap_type. Bits past the width are
+ *   zero.
+ *
+ * Only one tiling is written or read so far: tiles one row high and a
+ * whole row wide, that is stride words by 1 row, which is what lets the
+ * rows be scanned in place as a fov_bitmap_type. Files with any other
+ * tiling are refused; the field is there so that square tiles, stored
+ * one after another, can be added in a later version without changing
+ * the header.
+ *
+ * All numbers are little endian. A checksum is 64-bit FNV-1a taken a
+ * 64-bit word at a time, and for the header a byte at a time: starting
+ * from 14695981039346656037, each word or byte is xored in and the
+ * result multiplied by 1099511628211.
+ *
+ * \param bitmap Packed opacity bitmap of the map.
+ * \param out File to write to.
+ * \return Whether the whole file was written.
+ */
+bool fov_grid_write(const fov_bitmap_type *bitmap, FILE *out);
+
+/**
+ * Map a file written by fov_grid_write() into memory, read-only and
+ * shared, so that processes mapping the same file share one copy of it.
+ * Only the header is read and checked; call fov_grid_verify() to check
+ * the rows too. Hosts which are not little endian cannot scan the rows
+ * in place, and so cannot open grids.
+ *
+ * \param path Name of the file.
+ * \return The grid, or NULL if the file could not be mapped, is not a
+ * version FOV_GRID_VERSION file, or its header is damaged.
+ */
+/*@null@*/ fov_grid_type *fov_grid_open(const char *path);
+
+/**
+ * Unmap a file mapped by fov_grid_open(). Its bitmap may no longer be
+ * used.
+ *
+ * \param grid Grid returned by fov_grid_open().
+ */
+void fov_grid_close(/*@null@*/ fov_grid_type *grid);
+
+/**
+ * Check the rows of a grid against their checksum, reading the whole
+ * file.
+ *
+ * \param grid Grid returned by fov_grid_open().
+ * \return Whether the rows are as written.
+ */
+bool fov_grid_verify(const fov_grid_type *grid);
+
+/**
+ * The bitmap of a grid, pointing into the mapped file, to pass to any
+ * calculation taking a bitmap. It is valid until the grid is closed.
+ *
+ * \param grid Grid returned by fov_grid_open().
+ */
+const fov_bitmap_type *fov_grid_bitmap(const fov_grid_type *grid);
+
+/** How a light dims with distance d from its source, for a radius r. */
+typedef enum {
+    /** Full brightness out to the radius. */
+    FOV_FALLOFF_NONE,
+    /** 1 - d/(r+1). */
+    FOV_FALLOFF_LINEAR,
+    /** (1 - d/(r+1))^2. */
+    FOV_FALLOFF_QUADRATIC
+} fov_falloff_type;
+
+/** A coloured light for fov_light_batch(). */
+typedef struct {
+    /** x-axis coordinate of the light. */
+    int x;
+
+    /** y-axis coordinate of the light. */
+    int y;
+
+    /** Euclidean distance from (x,y) after which the light stops. */
+    unsigned radius;
+
+    /** Red, green and blue brightness at the source. */
+    float colour[3];
+
+    /** How the light dims with distance. */
+    fov_falloff_type falloff;
+} fov_light_type;
+
+/**
+ * Add the light from a batch of lights to a buffer of colours. Each
+ * light lights the tiles fov_circle_visibility() would mark for its
+ * position and radius, and its own tile, adding its colour scaled by
+ * its falloff to each of them. Tiles off the buffer are skipped.
+ *
+ * With a pool, the fields of view are first shared out between the
+ * threads, then each thread adds every light to its own band of rows of
+ * the buffer, so that no two threads write to the same tile. Lights are
+ * added to each tile in the order given either way, so the result does
+ * not depend on the pool.
+ *
+ * \param settings Pointer to data structure containing settings. The
+ * apply callbacks are not used.
+ * \param bitmap Packed opacity bitmap of the map, or NULL to use the
+ * opacity test function.
+ * \param map Pointer to map data structure to be passed to the opacity
+ * test.
+ * \param lights Lights to add.
+ * \param n Number of lights.
+ * \param buffer Three floats for each tile, red, green and blue, in
+ * increasing x and then y, added to.
+ * \param width Width of the buffer in tiles.
+ * \param height Height of the buffer in tiles.
+ * \param pool Pool created by fov_pool_create(), or NULL to use the
+ * calling thread only.
+ * \return false if there was not enough memory, in which case no
+ * light has been added to the buffer.
+ */
+bool fov_light_batch(fov_settings_type *settings,
+                     const fov_bitmap_type *bitmap, void *map,
+                     const fov_light_type *lights, size_t n,
+                     float *buffer, unsigned width, unsigned height,
+                     /*@null@*/ fov_pool_type *pool);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
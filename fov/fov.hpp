@@ -0,0 +1,418 @@
+/*
+ * Copyright (C) 2006-2007, Greg McIntyre. All rights reserved. See the file
+ * named COPYING in the distribution for more details.
+ */
+
+/**
+ * \file fov.hpp
+ * C++ front end to the field-of-view algorithm. The functions here are
+ * templates over the map and callback types, so that the compiler can
+ * inline the opacity test and lighting callbacks into the scanner.
+ * They light exactly the same tiles, in the same order, as the C
+ * functions in fov.h.
+ */
+#ifndef LIBFOV_CXX_HEADER
+#define LIBFOV_CXX_HEADER
+
+#include <cmath>
+#include <vector>
+#include "fov.h"
+#include "fov_octant.h"
+
+namespace fov {
+
+/** Settings for the C++ front end. */
+struct settings {
+    /** Set all the default options, as fov_settings_init() does. */
+    settings(): shape(FOV_SHAPE_CIRCLE_PRECALCULATE), opaque_apply(FOV_OPAQUE_APPLY) { }
+
+    /**
+     * Shape setting. FOV_SHAPE_CIRCLE_PRECALCULATE gives the same
+     * result as FOV_SHAPE_CIRCLE.
+     */
+    fov_shape_type shape;
+
+    /** Whether to call apply on opaque tiles. */
+    fov_opaque_apply_type opaque_apply;
+};
+
+/** \cond INTERNAL */
+namespace detail {
+
+/* A slope dy/dx held as an exact fraction n/d, d > 0. */
+struct slope {
+    slope(int n, int d): n(n), d(d) { }
+    int n;
+    int d;
+};
+
+/* Offset of the tile whose centre row the line at the given slope
+ * crosses at distance dx, i.e. (int)(0.5 + dx*slope). */
+inline int slope_row(int dx, slope s) {
+    return (int)(((int64_t)2*dx*s.n + s.d)/((int64_t)2*s.d));
+}
+
+/* floor(sqrt(n)), exactly. */
+inline unsigned isqrt(uint64_t n) {
+    uint64_t r = (uint64_t)std::sqrt((double)n);
+    while (r*r > n)
+        --r;
+    while ((r + 1)*(r + 1) <= n)
+        ++r;
+    return (unsigned)r;
+}
+
+/* A column of an octant waiting to be scanned. */
+struct frame {
+    frame(int dx, int dy, int run, slope start_slope, slope end_slope):
+        dx(dx), dy(dy), run(run), start_slope(start_slope), end_slope(end_slope) { }
+    int dx;
+    /* Row to resume scanning at, just after a blocked tile, or 0 to
+     * scan the column from the start. */
+    int dy;
+    /* Always -1: tiles are lit one at a time, never in runs. */
+    int run;
+    slope start_slope;
+    slope end_slope;
+};
+
+/* Octants, named as in fov.c. */
+enum octant { ppn, ppy, pmn, pmy, mpn, mpy, mmn, mmy };
+
+/* Beam angles are measured in fixed point, with fixed_one units per 45
+ * degrees. */
+const int fixed_one = 65536;
+
+inline slope fixed_slope(int x) {
+    return slope(x < 0 ? 0 : (x > fixed_one ? fixed_one : x), fixed_one);
+}
+
+const double pi = 3.14159265358979323846;
+
+/* See fov_cone(): cone edges this close to an octant's edge are on it. */
+const double cone_epsilon = 1e-6;
+
+/* The heading of an octant's edge, and whether headings grow (+1) or
+ * shrink (-1) with the slope across the octant. */
+struct cone_octant {
+    double base;
+    int sign;
+};
+
+template <class Map, class Opaque, class Apply>
+class scanner {
+public:
+    scanner(const fov::settings& settings, Map& map, Opaque& opaque, Apply& apply,
+            int source_x, int source_y, unsigned radius):
+        settings(settings), map(map), opaque(opaque), apply(apply),
+        source_x(source_x), source_y(source_y), radius(radius) {
+        stack.reserve((size_t)radius + 2);
+    }
+
+    void circle() {
+        const slope zero(0, 1), one(1, 1);
+        for (int o = ppn; o <= mmy; ++o)
+            scan_octant((octant)o, zero, one);
+    }
+
+    void beam(fov_direction_type direction, float angle) {
+        // Octants in the order fov_beam() lights them.
+        static const octant order[8][8] = {
+            { ppn, pmn, ppy, mpy, pmy, mmy, mpn, mmn }, // FOV_EAST
+            { pmn, mpy, mmy, ppn, mmn, ppy, mpn, pmy }, // FOV_NORTHEAST
+            { mpy, mmy, mmn, pmn, mpn, ppn, pmy, ppy }, // FOV_NORTH
+            { mmn, mmy, mpn, mpy, pmy, pmn, ppy, ppn }, // FOV_NORTHWEST
+            { mpn, mmn, pmy, mmy, ppy, mpy, ppn, pmn }, // FOV_WEST
+            { pmy, mpn, ppy, mmn, ppn, mmy, pmn, mpy }, // FOV_SOUTHWEST
+            { pmy, ppy, mpn, ppn, mmn, pmn, mmy, mpy }, // FOV_SOUTH
+            { ppn, ppy, pmy, pmn, mpn, mpy, mmn, mmy }  // FOV_SOUTHEAST
+        };
+        const slope zero(0, 1), one(1, 1);
+        const octant *p;
+        bool diag = (direction & 1) != 0;
+        int a, i;
+
+        if (angle <= 0.0f) {
+            return;
+        } else if (angle >= 360.0f) {
+            circle();
+            return;
+        }
+        if ((unsigned)direction > FOV_SOUTHEAST)
+            return;
+        p = order[direction];
+
+        // See fov_beam(): the angle as a fraction of 45 degrees, halved.
+        a = (int)((double)angle*fixed_one/90.0 + 0.5);
+
+        // Orthogonal beams start from the octants' edges, diagonal
+        // beams from their diagonals, then alternate outwards one pair
+        // of octants per 45 degrees of half-angle.
+        for (i = 0; i < 4; ++i) {
+            if (i > 0 && a <= i*fixed_one)
+                break;
+            if ((i % 2 == 0) != diag) {
+                slope end = fixed_slope(a - i*fixed_one);
+                scan_octant(p[2*i], zero, end);
+                scan_octant(p[2*i + 1], zero, end);
+            } else {
+                slope start = fixed_slope((i + 1)*fixed_one - a);
+                scan_octant(p[2*i], start, one);
+                scan_octant(p[2*i + 1], start, one);
+            }
+        }
+    }
+
+    void cone(float direction, float half_angle) {
+        static const cone_octant octants[8] = {
+            { 0.0, -1 },        // ppn
+            { -pi/2, 1 },       // ppy
+            { 0.0, 1 },         // pmn
+            { -pi/2, -1 },      // pmy
+            { pi, 1 },          // mpn
+            { pi/2, -1 },       // mpy
+            { pi, -1 },         // mmn
+            { pi/2, 1 }         // mmy
+        };
+        double h = half_angle, c, lo, hi;
+        int i, k;
+
+        if (h < 0.0) {
+            return;
+        } else if (h >= pi) {
+            circle();
+            return;
+        }
+
+        for (i = 0; i < 8; ++i) {
+            // See fov_cone(): the heading across the octant from its
+            // edge, then the pieces of the octant the cone covers.
+            c = std::fmod(octants[i].sign*((double)direction - octants[i].base), 2*pi);
+            if (c > pi)
+                c -= 2*pi;
+            else if (c <= -pi)
+                c += 2*pi;
+            for (k = -1; k <= 1; ++k) {
+                lo = c + 2*pi*k - h;
+                hi = c + 2*pi*k + h;
+                if (lo < 0.0)
+                    lo = 0.0;
+                if (hi > pi/4)
+                    hi = pi/4;
+                if (lo <= hi + cone_epsilon)
+                    scan_octant((octant)i,
+                                fixed_slope((int)(std::tan(lo)*fixed_one + 0.5)),
+                                fixed_slope((int)(std::tan(hi)*fixed_one + 0.5)));
+            }
+        }
+    }
+
+private:
+    void scan_octant(octant o, slope start_slope, slope end_slope) {
+        switch (o) {
+        case ppn: scan_ppn(start_slope, end_slope); break;
+        case ppy: scan_ppy(start_slope, end_slope); break;
+        case pmn: scan_pmn(start_slope, end_slope); break;
+        case pmy: scan_pmy(start_slope, end_slope); break;
+        case mpn: scan_mpn(start_slope, end_slope); break;
+        case mpy: scan_mpy(start_slope, end_slope); break;
+        case mmn: scan_mmn(start_slope, end_slope); break;
+        case mmy: scan_mmy(start_slope, end_slope); break;
+        }
+    }
+
+    unsigned height(int dx) const {
+        switch (settings.shape) {
+        case FOV_SHAPE_CIRCLE_PRECALCULATE:
+        case FOV_SHAPE_CIRCLE:
+            return isqrt((uint64_t)radius*radius - (uint64_t)dx*dx);
+        case FOV_SHAPE_OCTAGON:
+            return (radius - dx) << 1;
+        default:
+            return radius;
+        }
+    }
+
+    /* Hooks for FOV_OCTANT_SCAN, see fov_octant.h. The octant scanner
+     * is the one fov.c uses, without its bitmap, span and visibility
+     * paths. */
+#define FOV_OCTANT_EMPTY() stack.empty()
+#define FOV_OCTANT_POP()                                            \
+    do {                                                            \
+        const frame& f = stack.back();                              \
+        dx = f.dx;                                                  \
+        dy = f.dy;                                                  \
+        run = f.run;                                                \
+        start_slope = f.start_slope;                                \
+        end_slope = f.end_slope;                                    \
+        stack.pop_back();                                           \
+    } while (0)
+#define FOV_OCTANT_PUSH(dx, dy, run, s, e) stack.push_back(frame(dx, dy, run, s, e))
+#define FOV_OCTANT_SLOPE(n, d) slope(n, d)
+#define FOV_OCTANT_ROW(dx, s) slope_row(dx, s)
+#define FOV_OCTANT_SOURCE(c) source_##c
+#define FOV_OCTANT_RADIUS radius
+#define FOV_OCTANT_HEIGHT(dx) height(dx)
+#define FOV_OCTANT_COLUMN(ry, signy) (void)0
+#define FOV_OCTANT_TEST(ry, signy) (blocked = opaque(map, x, y))
+#define FOV_OCTANT_PROBE(ry, signy, first, last) (void)0
+#define FOV_OCTANT_APPLY(ry, signy) apply(map, x, y, x - source_x, y - source_y)
+#define FOV_OCTANT_SPAN(ry, signy, first, last) (void)0
+#define FOV_OCTANT_SKIP(ry, signy, apply_edge) (void)0
+
+#define FOV_OCTANT(signx, signy, rx, ry, name, apply_edge, apply_diag)          \
+    void scan_##name(slope start_slope, slope end_slope) {                      \
+        const bool opaque_apply = settings.opaque_apply == FOV_OPAQUE_APPLY;    \
+        int x, y, dx, dy, dy0, dy1, prev_blocked, run;                          \
+        unsigned h;                                                             \
+        bool blocked;                                                           \
+                                                                                \
+        stack.clear();                                                          \
+        stack.push_back(frame(1, 0, -1, start_slope, end_slope));               \
+        FOV_OCTANT_SCAN(signx, signy, rx, ry, apply_edge, apply_diag)           \
+    }
+
+    FOV_OCTANT(+,+,x,y,ppn,true,true)
+    FOV_OCTANT(+,+,y,x,ppy,true,false)
+    FOV_OCTANT(+,-,x,y,pmn,false,true)
+    FOV_OCTANT(+,-,y,x,pmy,false,false)
+    FOV_OCTANT(-,+,x,y,mpn,true,true)
+    FOV_OCTANT(-,+,y,x,mpy,true,false)
+    FOV_OCTANT(-,-,x,y,mmn,false,true)
+    FOV_OCTANT(-,-,y,x,mmy,false,false)
+
+#undef FOV_OCTANT
+#undef FOV_OCTANT_EMPTY
+#undef FOV_OCTANT_POP
+#undef FOV_OCTANT_PUSH
+#undef FOV_OCTANT_SLOPE
+#undef FOV_OCTANT_ROW
+#undef FOV_OCTANT_SOURCE
+#undef FOV_OCTANT_RADIUS
+#undef FOV_OCTANT_HEIGHT
+#undef FOV_OCTANT_COLUMN
+#undef FOV_OCTANT_TEST
+#undef FOV_OCTANT_PROBE
+#undef FOV_OCTANT_APPLY
+#undef FOV_OCTANT_SPAN
+#undef FOV_OCTANT_SKIP
+
+    const fov::settings& settings;
+    Map& map;
+    Opaque& opaque;
+    Apply& apply;
+    int source_x;
+    int source_y;
+    unsigned radius;
+    std::vector<frame> stack;
+};
+
+} // namespace detail
+/** \endcond */
+
+/**
+ * Calculate a full circle field of view from a source at (x,y), as
+ * fov_circle() does.
+ *
+ * \param settings Shape and opaque apply settings.
+ * \param map Map passed to the callbacks.
+ * \param opaque Callable as opaque(map, x, y), returning whether the
+ * tile at (x,y) is opaque.
+ * \param apply Callable as apply(map, x, y, dx, dy), called for each lit
+ * tile at (x,y), offset (dx,dy) from the source.
+ * \param source_x x-axis coordinate from which to start.
+ * \param source_y y-axis coordinate from which to start.
+ * \param radius Euclidean distance from (x,y) after which to stop.
+ */
+template <class Map, class Opaque, class Apply>
+void circle(const settings& settings, Map& map, Opaque opaque, Apply apply,
+            int source_x, int source_y, unsigned radius) {
+    detail::scanner<Map, Opaque, Apply> scanner(settings, map, opaque, apply,
+                                                source_x, source_y, radius);
+    scanner.circle();
+}
+
+/**
+ * Calculate a full circle field of view with the default settings.
+ */
+template <class Map, class Opaque, class Apply>
+void circle(Map& map, Opaque opaque, Apply apply,
+            int source_x, int source_y, unsigned radius) {
+    circle(settings(), map, opaque, apply, source_x, source_y, radius);
+}
+
+/**
+ * Calculate a beam field of view from a source at (x,y), as fov_beam()
+ * does.
+ *
+ * \param settings Shape and opaque apply settings.
+ * \param map Map passed to the callbacks.
+ * \param opaque Callable as opaque(map, x, y), returning whether the
+ * tile at (x,y) is opaque.
+ * \param apply Callable as apply(map, x, y, dx, dy), called for each lit
+ * tile at (x,y), offset (dx,dy) from the source.
+ * \param source_x x-axis coordinate from which to start.
+ * \param source_y y-axis coordinate from which to start.
+ * \param radius Euclidean distance from (x,y) after which to stop.
+ * \param direction One of eight directions the beam of light can point.
+ * \param angle The angle at the base of the beam of light, in degrees.
+ */
+template <class Map, class Opaque, class Apply>
+void beam(const settings& settings, Map& map, Opaque opaque, Apply apply,
+          int source_x, int source_y, unsigned radius,
+          fov_direction_type direction, float angle) {
+    detail::scanner<Map, Opaque, Apply> scanner(settings, map, opaque, apply,
+                                                source_x, source_y, radius);
+    scanner.beam(direction, angle);
+}
+
+/**
+ * Calculate a beam field of view with the default settings.
+ */
+template <class Map, class Opaque, class Apply>
+void beam(Map& map, Opaque opaque, Apply apply,
+          int source_x, int source_y, unsigned radius,
+          fov_direction_type direction, float angle) {
+    beam(settings(), map, opaque, apply, source_x, source_y, radius, direction, angle);
+}
+
+/**
+ * Calculate a field of view in a cone pointing in any direction from a
+ * source at (x,y), as fov_cone() does.
+ *
+ * \param settings Shape and opaque apply settings.
+ * \param map Map passed to the callbacks.
+ * \param opaque Callable as opaque(map, x, y), returning whether the
+ * tile at (x,y) is opaque.
+ * \param apply Callable as apply(map, x, y, dx, dy), called for each lit
+ * tile at (x,y), offset (dx,dy) from the source.
+ * \param source_x x-axis coordinate from which to start.
+ * \param source_y y-axis coordinate from which to start.
+ * \param radius Euclidean distance from (x,y) after which to stop.
+ * \param direction Direction of the middle of the cone in radians,
+ * anticlockwise from east (+x), so that north (-y) is pi/2.
+ * \param half_angle Angle between the middle and each edge of the
+ * cone in radians.
+ */
+template <class Map, class Opaque, class Apply>
+void cone(const settings& settings, Map& map, Opaque opaque, Apply apply,
+          int source_x, int source_y, unsigned radius,
+          float direction, float half_angle) {
+    detail::scanner<Map, Opaque, Apply> scanner(settings, map, opaque, apply,
+                                                source_x, source_y, radius);
+    scanner.cone(direction, half_angle);
+}
+
+/**
+ * Calculate a cone field of view with the default settings.
+ */
+template <class Map, class Opaque, class Apply>
+void cone(Map& map, Opaque opaque, Apply apply,
+          int source_x, int source_y, unsigned radius,
+          float direction, float half_angle) {
+    cone(settings(), map, opaque, apply, source_x, source_y, radius, direction, half_angle);
+}
+
+} // namespace fov
+
+#endif
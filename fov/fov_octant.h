@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2006-2007, Greg McIntyre. All rights reserved. See the file
+ * named COPYING in the distribution for more details.
+ */
+
+/**
+ * \file fov_octant.h
+ * The octant scanner shared by fov.c and fov.hpp. Not meant to be
+ * included on its own.
+ */
+#ifndef LIBFOV_OCTANT_HEADER
+#define LIBFOV_OCTANT_HEADER
+
+/** \cond INTERNAL */
+
+/*
+ * FOV_OCTANT_SCAN scans the columns of one octant from a stack of
+ * frames. signx and signy are + or -, the directions of the octant
+ * along and across its columns. rx and ry are x or y, the map
+ * coordinates that change along and across them. apply_edge and
+ * apply_diag say whether the octant lights the tiles on its edge and
+ * its diagonal.
+ *
+ * It expands to a statement using these locals, with the first frame
+ * already pushed:
+ *
+ *     int x, y, dx, dy, dy0, dy1, prev_blocked, run;
+ *     unsigned h;
+ *     bool blocked, opaque_apply;
+ *     start_slope, end_slope, of the front end's slope type.
+ *
+ * and these hooks, which the front end defines before expanding it:
+ *
+ * FOV_OCTANT_EMPTY()                 Whether the stack is empty.
+ * FOV_OCTANT_POP()                   Pop dx, dy, run and the slopes.
+ * FOV_OCTANT_PUSH(dx, dy, run, s, e) Push a frame.
+ * FOV_OCTANT_SLOPE(n, d)             The slope n/d.
+ * FOV_OCTANT_ROW(dx, s)              Row the slope s crosses at dx.
+ * FOV_OCTANT_SOURCE(c)               Source's coordinate c, x or y.
+ * FOV_OCTANT_RADIUS                  Radius of the calculation.
+ * FOV_OCTANT_HEIGHT(dx)              Height of column dx for the shape.
+ * FOV_OCTANT_COLUMN(ry, signy)       About to scan rows dy to dy1.
+ * FOV_OCTANT_TEST(ry, signy)         Set blocked for the tile at (x,y).
+ * FOV_OCTANT_PROBE(ry, signy, first, last)
+ *                                    Rows first to last were tested.
+ * FOV_OCTANT_APPLY(ry, signy)        Light (x,y), or start a run at dy.
+ * FOV_OCTANT_SPAN(ry, signy, first, last)
+ *                                    Light the run from first to last.
+ * FOV_OCTANT_SKIP(ry, signy, apply_edge)
+ *                                    Jump over tiles known to match.
+ *
+ * A front end that lights tiles one at a time leaves run at -1, so
+ * FOV_OCTANT_SPAN is never reached.
+ */
+#define FOV_OCTANT_SCAN(signx, signy, rx, ry, apply_edge, apply_diag)                               \
+    while (!FOV_OCTANT_EMPTY()) {                                                                   \
+        FOV_OCTANT_POP();                                                                           \
+                                                                                                    \
+        if ((unsigned)dx > FOV_OCTANT_RADIUS) {                                                     \
+            continue;                                                                               \
+        }                                                                                           \
+                                                                                                    \
+        dy0 = FOV_OCTANT_ROW(dx, start_slope);                                                      \
+        dy1 = FOV_OCTANT_ROW(dx, end_slope);                                                        \
+                                                                                                    \
+        rx = FOV_OCTANT_SOURCE(rx) signx dx;                                                        \
+        ry = FOV_OCTANT_SOURCE(ry) signy dy0;                                                       \
+                                                                                                    \
+        if (!apply_diag && dy1 == dx) {                                                             \
+            /* We do diagonal lines on every second octant, so they don't get done twice. */        \
+            --dy1;                                                                                  \
+            if (dy0 > dy1 && start_slope.n < start_slope.d) {                                       \
+                /* Only the diagonal tile was left, but the slopes go on past it. */                \
+                FOV_OCTANT_PUSH(dx+1, 0, -1, start_slope, end_slope);                               \
+                continue;                                                                           \
+            }                                                                                       \
+        }                                                                                           \
+                                                                                                    \
+        h = FOV_OCTANT_HEIGHT(dx);                                                                  \
+        if ((unsigned)dy1 > h) {                                                                    \
+            if (h == 0) {                                                                           \
+                continue;                                                                           \
+            }                                                                                       \
+            dy1 = (int)h;                                                                           \
+        }                                                                                           \
+                                                                                                    \
+        if (dy == 0) {                                                                              \
+            /* A new column. */                                                                     \
+            dy = dy0;                                                                               \
+            prev_blocked = -1;                                                                      \
+        } else {                                                                                    \
+            /* Resuming a column after the blocked tile at dy-1. */                                 \
+            prev_blocked = 1;                                                                       \
+        }                                                                                           \
+                                                                                                    \
+        FOV_OCTANT_COLUMN(ry, signy);                                                               \
+                                                                                                    \
+        for (; dy <= dy1; ++dy) {                                                                   \
+            ry = FOV_OCTANT_SOURCE(ry) signy dy;                                                    \
+                                                                                                    \
+            FOV_OCTANT_TEST(ry, signy);                                                             \
+            FOV_OCTANT_PROBE(ry, signy, dy, dy);                                                    \
+            if ((apply_edge || dy > 0) && (!blocked || opaque_apply)) {                             \
+                FOV_OCTANT_APPLY(ry, signy);                                                        \
+            } else if (run >= 0) {                                                                  \
+                FOV_OCTANT_SPAN(ry, signy, run, dy - 1);                                            \
+                run = -1;                                                                           \
+            }                                                                                       \
+                                                                                                    \
+            if (blocked) {                                                                          \
+                if (prev_blocked == 0) {                                                            \
+                    /* Scan the next column up to this tile before                                  \
+                     * finishing this one, as recursion would. */                                   \
+                    if (dy < dy1) {                                                                 \
+                        FOV_OCTANT_PUSH(dx, dy+1, run, start_slope, end_slope);                     \
+                    } else if (run >= 0) {                                                          \
+                        FOV_OCTANT_SPAN(ry, signy, run, dy);                                        \
+                    }                                                                               \
+                    FOV_OCTANT_PUSH(dx+1, 0, -1, start_slope,                                       \
+                                    FOV_OCTANT_SLOPE(2*dy - 1, 2*dx + 1));                          \
+                    break;                                                                          \
+                }                                                                                   \
+                prev_blocked = 1;                                                                   \
+            } else {                                                                                \
+                if (prev_blocked == 1) {                                                            \
+                    start_slope = FOV_OCTANT_SLOPE(2*dy - 1, 2*dx - 1);                             \
+                }                                                                                   \
+                prev_blocked = 0;                                                                   \
+            }                                                                                       \
+                                                                                                    \
+            FOV_OCTANT_SKIP(ry, signy, apply_edge);                                                 \
+        }                                                                                           \
+                                                                                                    \
+        if (dy > dy1) {                                                                             \
+            if (run >= 0) {                                                                         \
+                FOV_OCTANT_SPAN(ry, signy, run, dy1);                                               \
+            }                                                                                       \
+            if (prev_blocked == 0) {                                                                \
+                FOV_OCTANT_PUSH(dx+1, 0, -1, start_slope, end_slope);                               \
+            }                                                                                       \
+        }                                                                                           \
+    }
+
+/** \endcond */
+
+#endif
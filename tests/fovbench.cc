@@ -0,0 +1,565 @@
+/*
+ * Copyright (C) 2006, Greg McIntyre
+ * All rights reserved. See the file named COPYING in the distribution
+ * for more details.
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+#include <fov/fov.h>
+#include <fov/fov.hpp>
+
+using namespace std;
+
+// -------------------------------------------------
+
+struct Map {
+    Map(unsigned w, unsigned h, unsigned seed, unsigned sparsity);
+
+    unsigned w;
+    unsigned h;
+    vector<bool> walls;
+    vector<uint64_t> words;
+    fov_bitmap_type bitmap;
+    unsigned long lit;
+};
+
+// Deterministic pseudo-random map with roughly one wall in every
+// 'sparsity' tiles.
+Map::Map(unsigned w, unsigned h, unsigned seed, unsigned sparsity):
+    w(w), h(h), walls(w*h, false), words(((w + 63)/64)*h, 0), lit(0)
+{
+    bitmap.width = w;
+    bitmap.height = h;
+    bitmap.stride = (w + 63)/64;
+    for (unsigned i = 0; i < w*h; ++i) {
+        seed = seed*1103515245u + 12345u;
+        walls[i] = (seed >> 16) % sparsity == 0;
+        if (walls[i])
+            words[(i/w)*bitmap.stride + (i%w)/64] |= (uint64_t)1 << (i%w%64);
+    }
+    bitmap.bits = &words[0];
+}
+
+static bool opaque(void *map, int x, int y) {
+    Map *m = static_cast<Map *>(map);
+    if ((unsigned)x >= m->w || (unsigned)y >= m->h)
+        return true;
+    return m->walls[y*m->w + x];
+}
+
+static void apply(void *map, int x, int y, int dx, int dy, void *src) {
+    ++static_cast<Map *>(map)->lit;
+}
+
+// For batches, which may light several sources at once.
+static void apply_source(void *map, int x, int y, int dx, int dy, void *src) {
+    ++*static_cast<unsigned long *>(src);
+}
+
+// The same callbacks as functors for fov.hpp.
+struct Opaque {
+    bool operator()(Map& m, int x, int y) const {
+        if ((unsigned)x >= m.w || (unsigned)y >= m.h)
+            return true;
+        return m.walls[y*m.w + x];
+    }
+};
+
+struct Apply {
+    void operator()(Map& m, int x, int y, int dx, int dy) const { ++m.lit; }
+};
+
+// -------------------------------------------------
+
+struct Shape {
+    fov_shape_type shape;
+    const char *name;
+};
+
+static const Shape shapes[] = {
+    { FOV_SHAPE_CIRCLE_PRECALCULATE, "circle_precalculate" },
+    { FOV_SHAPE_SQUARE, "square" },
+    { FOV_SHAPE_CIRCLE, "circle" },
+    { FOV_SHAPE_OCTAGON, "octagon" }
+};
+
+static const unsigned repeats = 5;
+
+// Time 'calls' fov_circle calls spread over the map and return the
+// best mean time per call in microseconds over a few runs. With a
+// visibility bitset, the bitmap and bitset versions are timed instead.
+static double bench_circle(fov_settings_type *settings, Map& map, unsigned radius,
+        unsigned calls, uint64_t *visible) {
+    double best = 0.0;
+    for (unsigned r = 0; r < repeats; ++r) {
+        clock_t start = clock();
+        for (unsigned i = 0; i < calls; ++i) {
+            int x = (int)(radius + (i*7919u) % (map.w - 2*radius));
+            int y = (int)(radius + (i*104729u) % (map.h - 2*radius));
+            if (visible)
+                fov_circle_visibility(settings, &map.bitmap, NULL, x, y, radius, visible);
+            else
+                fov_circle(settings, &map, NULL, x, y, radius);
+        }
+        double t = 1e6*(double)(clock() - start)/CLOCKS_PER_SEC/calls;
+        if (r == 0 || t < best)
+            best = t;
+    }
+    return best;
+}
+
+// As bench_circle, for the templated front end.
+static double bench_template(fov_shape_type shape, Map& map, unsigned radius, unsigned calls) {
+    fov::settings settings;
+    settings.shape = shape;
+    double best = 0.0;
+    for (unsigned r = 0; r < repeats; ++r) {
+        clock_t start = clock();
+        for (unsigned i = 0; i < calls; ++i) {
+            int x = (int)(radius + (i*7919u) % (map.w - 2*radius));
+            int y = (int)(radius + (i*104729u) % (map.h - 2*radius));
+            fov::circle(settings, map, Opaque(), Apply(), x, y, radius);
+        }
+        double t = 1e6*(double)(clock() - start)/CLOCKS_PER_SEC/calls;
+        if (r == 0 || t < best)
+            best = t;
+    }
+    return best;
+}
+
+// Time fov_circle_batch over 'calls' sources spread over the map, in
+// microseconds per source, on one thread or on a pool of one thread per
+// processor.
+static double bench_batch(Map& map, unsigned radius, unsigned calls, fov_pool_type *pool) {
+    vector<fov_source_type> sources(calls);
+    vector<unsigned long> lit(calls);
+    for (unsigned i = 0; i < calls; ++i) {
+        sources[i].x = (int)(radius + (i*7919u) % (map.w - 2*radius));
+        sources[i].y = (int)(radius + (i*104729u) % (map.h - 2*radius));
+        sources[i].radius = radius;
+        sources[i].source = &lit[i];
+    }
+    fov_settings_type settings;
+    fov_settings_init(&settings);
+    fov_settings_set_opacity_test_function(&settings, opaque);
+    fov_settings_set_apply_lighting_function(&settings, apply_source);
+    double best = 0.0;
+    for (unsigned r = 0; r < repeats; ++r) {
+        // clock() counts the CPU time of every thread; this wants wall time.
+        timeval start, end;
+        gettimeofday(&start, NULL);
+        fov_circle_batch(&settings, &map.bitmap, NULL, &sources[0], calls, pool);
+        gettimeofday(&end, NULL);
+        double t = (1e6*(end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec))/calls;
+        if (r == 0 || t < best)
+            best = t;
+    }
+    fov_settings_free(&settings);
+    return best;
+}
+
+// Time a single large circle on one thread and split between the
+// threads of a pool, in microseconds.
+static double bench_parallel(Map& map, unsigned radius, fov_pool_type *pool) {
+    vector<uint64_t> visible(fov_visibility_size(radius));
+    fov_settings_type settings;
+    fov_settings_init(&settings);
+    double best = 0.0;
+    for (unsigned r = 0; r < repeats; ++r) {
+        timeval start, end;
+        gettimeofday(&start, NULL);
+        fov_circle_parallel(&settings, &map.bitmap, NULL, NULL, map.w/2, map.h/2, radius, &visible[0], pool);
+        gettimeofday(&end, NULL);
+        double t = 1e6*(end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec);
+        if (r == 0 || t < best)
+            best = t;
+    }
+    fov_settings_free(&settings);
+    return best;
+}
+
+// Time fov_memo_circle answering the same calls as bench_circle from a
+// warm cache.
+static double bench_memo(Map& map, unsigned radius, unsigned calls) {
+    fov_settings_type settings;
+    fov_settings_init(&settings);
+    fov_settings_set_opacity_test_function(&settings, opaque);
+    fov_settings_set_apply_lighting_function(&settings, apply);
+    fov_memo_type *memo = fov_memo_create(64 << 20);
+    double best = 0.0;
+    for (unsigned r = 0; r < repeats + 1; ++r) {
+        clock_t start = clock();
+        for (unsigned i = 0; i < calls; ++i) {
+            int x = (int)(radius + (i*7919u) % (map.w - 2*radius));
+            int y = (int)(radius + (i*104729u) % (map.h - 2*radius));
+            fov_memo_circle(memo, &settings, NULL, &map, NULL, x, y, radius, 0, NULL);
+        }
+        double t = 1e6*(double)(clock() - start)/CLOCKS_PER_SEC/calls;
+        if (r == 1 || (r > 1 && t < best))
+            best = t;
+    }
+    fov_memo_free(memo);
+    fov_settings_free(&settings);
+    return best;
+}
+
+// Time 'calls' line of sight queries from sources spread over the map
+// to a tile at each offset in turn, answered by fov_los or by testing a
+// whole field of view, in microseconds per query.
+static double bench_los(Map& map, unsigned radius, unsigned calls, bool full) {
+    vector<uint64_t> visible(fov_visibility_size(radius));
+    fov_settings_type settings;
+    fov_settings_init(&settings);
+    unsigned long seen = 0;
+    double best = 0.0;
+    for (unsigned r = 0; r < repeats; ++r) {
+        clock_t start = clock();
+        for (unsigned i = 0; i < calls; ++i) {
+            int x = (int)(radius + (i*7919u) % (map.w - 2*radius));
+            int y = (int)(radius + (i*104729u) % (map.h - 2*radius));
+            int dx = (int)(i*31u % (2*radius + 1)) - (int)radius;
+            int dy = (int)(i*17u % (2*radius + 1)) - (int)radius;
+            if (full) {
+                fov_circle_visibility(&settings, &map.bitmap, NULL, x, y, radius, &visible[0]);
+                seen += fov_visibility_test(&visible[0], radius, dx, dy);
+            } else {
+                bool lit = false;
+                (void)fov_los(&settings, &map.bitmap, NULL, x, y, x + dx, y + dy, radius, &lit);
+                seen += lit;
+            }
+        }
+        double t = 1e6*(double)(clock() - start)/CLOCKS_PER_SEC/calls;
+        if (r == 0 || t < best)
+            best = t;
+    }
+    map.lit += seen;
+    fov_settings_free(&settings);
+    return best;
+}
+
+// Time 'calls' counts of the tiles in view from sources spread over the
+// map, by fov_circle_stats or by counting calls to apply, in
+// microseconds per call.
+static double bench_stats(Map& map, unsigned radius, unsigned calls, bool full) {
+    fov_settings_type settings;
+    fov_settings_init(&settings);
+    fov_settings_set_apply_lighting_function(&settings, apply);
+    fov_stats_type stats;
+    double best = 0.0;
+    for (unsigned r = 0; r < repeats; ++r) {
+        clock_t start = clock();
+        for (unsigned i = 0; i < calls; ++i) {
+            int x = (int)(radius + (i*7919u) % (map.w - 2*radius));
+            int y = (int)(radius + (i*104729u) % (map.h - 2*radius));
+            if (full) {
+                fov_circle_bitmap(&settings, &map.bitmap, &map, NULL, x, y, radius);
+            } else {
+                fov_circle_stats(&settings, &map.bitmap, NULL, x, y, radius, &stats, NULL);
+                map.lit += stats.cells;
+            }
+        }
+        double t = 1e6*(double)(clock() - start)/CLOCKS_PER_SEC/calls;
+        if (r == 0 || t < best)
+            best = t;
+    }
+    fov_settings_free(&settings);
+    return best;
+}
+
+// A target on roughly one tile in every 'sparsity'.
+static bool is_enemy(int x, int y, unsigned sparsity) {
+    return (unsigned)(x*7919 + y*104729) % sparsity == 0;
+}
+
+static bool search_enemy(void *map, int x, int y, int dx, int dy, void *src) {
+    return is_enemy(x, y, *static_cast<unsigned *>(src));
+}
+
+static void apply_enemy(void *map, int x, int y, int dx, int dy, void *src) {
+    if (is_enemy(x, y, *static_cast<unsigned *>(src)))
+        ++static_cast<Map *>(map)->lit;
+}
+
+// Time 'calls' searches for a target from sources spread over the map,
+// by fov_circle_search or by a whole field of view, in microseconds per
+// call.
+static double bench_search(Map& map, unsigned radius, unsigned calls, unsigned sparsity, bool full) {
+    fov_settings_type settings;
+    fov_settings_init(&settings);
+    fov_settings_set_opacity_test_function(&settings, opaque);
+    fov_settings_set_apply_lighting_function(&settings, apply_enemy);
+    double best = 0.0;
+    for (unsigned r = 0; r < repeats; ++r) {
+        clock_t start = clock();
+        for (unsigned i = 0; i < calls; ++i) {
+            int x = (int)(radius + (i*7919u) % (map.w - 2*radius));
+            int y = (int)(radius + (i*104729u) % (map.h - 2*radius));
+            if (full)
+                fov_circle_bitmap(&settings, &map.bitmap, &map, &sparsity, x, y, radius);
+            else
+                map.lit += fov_circle_search(&settings, &map.bitmap, &map, &sparsity, x, y, radius,
+                                             search_enemy, NULL, NULL);
+        }
+        double t = 1e6*(double)(clock() - start)/CLOCKS_PER_SEC/calls;
+        if (r == 0 || t < best)
+            best = t;
+    }
+    fov_settings_free(&settings);
+    return best;
+}
+
+// Time 'calls' cones of the given half angle turning steadily about
+// sources spread over the map, or the full circles they would otherwise
+// be cut from, in microseconds per call.
+static double bench_cone(Map& map, unsigned radius, unsigned calls, float half_angle) {
+    vector<uint64_t> visible(fov_visibility_size(radius));
+    fov_settings_type settings;
+    fov_settings_init(&settings);
+    double best = 0.0;
+    for (unsigned r = 0; r < repeats; ++r) {
+        clock_t start = clock();
+        for (unsigned i = 0; i < calls; ++i) {
+            int x = (int)(radius + (i*7919u) % (map.w - 2*radius));
+            int y = (int)(radius + (i*104729u) % (map.h - 2*radius));
+            fov_cone_visibility(&settings, &map.bitmap, NULL, x, y, radius,
+                                0.01f*(float)i, half_angle, &visible[0]);
+        }
+        double t = 1e6*(double)(clock() - start)/CLOCKS_PER_SEC/calls;
+        if (r == 0 || t < best)
+            best = t;
+    }
+    map.lit += visible[0];
+    fov_settings_free(&settings);
+    return best;
+}
+
+// Answer 'calls' line of sight queries with fov_los_batch, on one
+// thread or on a pool, in millions of queries per second.
+static double bench_los_batch(Map& map, unsigned radius, unsigned calls, fov_pool_type *pool) {
+    vector<fov_los_query_type> queries(calls);
+    vector<uint64_t> results((calls + 63)/64);
+    for (unsigned i = 0; i < calls; ++i) {
+        queries[i].source_x = (int)(radius + (i*7919u) % (map.w - 2*radius));
+        queries[i].source_y = (int)(radius + (i*104729u) % (map.h - 2*radius));
+        queries[i].x = queries[i].source_x + (int)(i*31u % (2*radius + 1)) - (int)radius;
+        queries[i].y = queries[i].source_y + (int)(i*17u % (2*radius + 1)) - (int)radius;
+        queries[i].radius = radius;
+    }
+    fov_settings_type settings;
+    fov_settings_init(&settings);
+    double best = 0.0;
+    for (unsigned r = 0; r < repeats; ++r) {
+        timeval start, end;
+        gettimeofday(&start, NULL);
+        fov_los_batch(&settings, &map.bitmap, NULL, &queries[0], calls, &results[0], pool);
+        gettimeofday(&end, NULL);
+        double t = calls/(1e6*(end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec));
+        if (r == 0 || t > best)
+            best = t;
+    }
+    fov_settings_free(&settings);
+    return best;
+}
+
+// Lights for bench_lights, one for each source of bench_batch.
+struct Light {
+    vector<float> *buffer;
+    unsigned w;
+    float colour[3];
+};
+
+// Add a light's colour to a lit tile, as a per-tile callback would.
+static void apply_light(void *map, int x, int y, int dx, int dy, void *src) {
+    Light *light = static_cast<Light *>(src);
+    if ((unsigned)x >= light->w || (unsigned)y >= light->buffer->size()/3/light->w)
+        return;
+    float *p = &(*light->buffer)[3*((size_t)y*light->w + x)];
+    float w = 1.0f - (float)sqrt((double)(dx*dx + dy*dy))/(float)(light->colour[0] + 1.0f);
+    p[0] += w;
+    p[1] += w*0.5f;
+    p[2] += w*0.25f;
+}
+
+// Time 'calls' lights of a radius added to a colour buffer through the
+// apply callback, then with fov_light_batch on one thread and on a
+// pool, in microseconds per light.
+static void bench_lights(Map& map, unsigned radius, unsigned calls, fov_pool_type *pool,
+        double *callback, double *batch, double *pooled) {
+    vector<float> buffer(map.w*map.h*3);
+    vector<fov_light_type> lights(calls);
+    vector<Light> sources(calls);
+    vector<fov_source_type> batch_sources(calls);
+    for (unsigned i = 0; i < calls; ++i) {
+        lights[i].x = (int)((i*7919u) % map.w);
+        lights[i].y = (int)((i*104729u) % map.h);
+        lights[i].radius = radius;
+        lights[i].colour[0] = 1.0f;
+        lights[i].colour[1] = 0.5f;
+        lights[i].colour[2] = 0.25f;
+        lights[i].falloff = FOV_FALLOFF_LINEAR;
+        sources[i].buffer = &buffer;
+        sources[i].w = map.w;
+        sources[i].colour[0] = (float)radius;
+        batch_sources[i].x = lights[i].x;
+        batch_sources[i].y = lights[i].y;
+        batch_sources[i].radius = radius;
+        batch_sources[i].source = &sources[i];
+    }
+    fov_settings_type settings;
+    fov_settings_init(&settings);
+    fov_settings_set_apply_lighting_function(&settings, apply_light);
+    *callback = *batch = *pooled = 0.0;
+    for (unsigned r = 0; r < repeats; ++r) {
+        double *results[] = { callback, batch, pooled };
+        for (unsigned k = 0; k < 3; ++k) {
+            timeval start, end;
+            gettimeofday(&start, NULL);
+            if (k == 0)
+                fov_circle_batch(&settings, &map.bitmap, NULL, &batch_sources[0], calls, NULL);
+            else
+                fov_light_batch(&settings, &map.bitmap, NULL, &lights[0], calls, &buffer[0],
+                                map.w, map.h, k == 2 ? pool : NULL);
+            gettimeofday(&end, NULL);
+            double t = (1e6*(end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec))/calls;
+            if (r == 0 || t < *results[k])
+                *results[k] = t;
+        }
+    }
+    fov_settings_free(&settings);
+}
+
+int main(int argc, char *argv[]) {
+    const unsigned radii[] = { 8, 30, 100 };
+    Map open(512, 512, 1, 1000);
+    Map noisy(512, 512, 1, 12);
+
+    printf("%-20s %6s %12s %12s %12s %12s %12s %12s\n", "shape", "radius",
+           "open (us)", "noisy (us)", "open bits", "noisy bits", "open tmpl", "noisy tmpl");
+    for (unsigned s = 0; s < sizeof(shapes)/sizeof(shapes[0]); ++s) {
+        for (unsigned r = 0; r < sizeof(radii)/sizeof(radii[0]); ++r) {
+            unsigned calls = 2000000/(radii[r]*radii[r]);
+            vector<uint64_t> visible(fov_visibility_size(radii[r]));
+            fov_settings_type settings;
+            fov_settings_init(&settings);
+            fov_settings_set_opacity_test_function(&settings, opaque);
+            fov_settings_set_apply_lighting_function(&settings, apply);
+            fov_settings_set_shape(&settings, shapes[s].shape);
+            printf("%-20s %6u %12.2f %12.2f %12.2f %12.2f %12.2f %12.2f\n", shapes[s].name, radii[r],
+                   bench_circle(&settings, open, radii[r], calls, NULL),
+                   bench_circle(&settings, noisy, radii[r], calls, NULL),
+                   bench_circle(&settings, open, radii[r], calls, &visible[0]),
+                   bench_circle(&settings, noisy, radii[r], calls, &visible[0]),
+                   bench_template(shapes[s].shape, open, radii[r], calls),
+                   bench_template(shapes[s].shape, noisy, radii[r], calls));
+            fov_settings_free(&settings);
+        }
+    }
+
+    printf("\n%-20s %6s %12s %12s\n", "memo hits", "radius", "open (us)", "noisy (us)");
+    for (unsigned r = 0; r < sizeof(radii)/sizeof(radii[0]); ++r) {
+        unsigned calls = 2000000/(radii[r]*radii[r]);
+        printf("%-20s %6u %12.2f %12.2f\n", "circle", radii[r],
+               bench_memo(open, radii[r], calls), bench_memo(noisy, radii[r], calls));
+    }
+
+    printf("\n%-20s %6s %12s %12s %12s %12s\n", "line of sight", "radius",
+           "open (us)", "noisy (us)", "open fov", "noisy fov");
+    for (unsigned r = 0; r < sizeof(radii)/sizeof(radii[0]); ++r) {
+        unsigned calls = 2000000/(radii[r]*radii[r]);
+        printf("%-20s %6u %12.2f %12.2f %12.2f %12.2f\n", "fov_los", radii[r],
+               bench_los(open, radii[r], calls, false), bench_los(noisy, radii[r], calls, false),
+               bench_los(open, radii[r], calls, true), bench_los(noisy, radii[r], calls, true));
+    }
+
+    printf("\n%-20s %6s %12s %12s %12s %12s\n", "counting (us)", "radius",
+           "open stats", "open apply", "noisy stats", "noisy apply");
+    for (unsigned r = 0; r < sizeof(radii)/sizeof(radii[0]); ++r) {
+        unsigned calls = 2000000/(radii[r]*radii[r]);
+        printf("%-20s %6u %12.2f %12.2f %12.2f %12.2f\n", "circle", radii[r],
+               bench_stats(open, radii[r], calls, false), bench_stats(open, radii[r], calls, true),
+               bench_stats(noisy, radii[r], calls, false), bench_stats(noisy, radii[r], calls, true));
+    }
+
+    printf("\n%-20s %6s %12s %12s %12s %12s\n", "target search (us)", "radius",
+           "open search", "open circle", "noisy search", "noisy circle");
+    for (unsigned r = 0; r < sizeof(radii)/sizeof(radii[0]); ++r) {
+        unsigned calls = 2000000/(radii[r]*radii[r]);
+        printf("%-20s %6u %12.2f %12.2f %12.2f %12.2f\n", "1 in 200 tiles", radii[r],
+               bench_search(open, radii[r], calls, 200, false), bench_search(open, radii[r], calls, 200, true),
+               bench_search(noisy, radii[r], calls, 200, false), bench_search(noisy, radii[r], calls, 200, true));
+    }
+
+    printf("\n%-20s %6s %12s %12s %12s %12s\n", "cones (us)", "radius",
+           "open 30deg", "open circle", "noisy 30deg", "noisy circle");
+    for (unsigned r = 0; r < sizeof(radii)/sizeof(radii[0]); ++r) {
+        unsigned calls = 2000000/(radii[r]*radii[r]);
+        printf("%-20s %6u %12.2f %12.2f %12.2f %12.2f\n", "fov_cone", radii[r],
+               bench_cone(open, radii[r], calls, 0.2618f), bench_cone(open, radii[r], calls, 4.0f),
+               bench_cone(noisy, radii[r], calls, 0.2618f), bench_cone(noisy, radii[r], calls, 4.0f));
+    }
+
+    fov_pool_type *pool = fov_pool_create(0);
+    printf("\n%-20s %6s %12s %12s\n", "batch of 4000", "radius", "1 thread", "pool");
+    for (unsigned r = 0; r < sizeof(radii)/sizeof(radii[0]); ++r) {
+        printf("%-20s %6u %12.2f %12.2f\n", "noisy bitmap", radii[r],
+               bench_batch(noisy, radii[r], 4000, NULL),
+               bench_batch(noisy, radii[r], 4000, pool));
+    }
+
+    printf("\n%-20s %6s %12s %12s %12s %12s\n", "los batch (Mq/s)", "radius",
+           "open", "open pool", "noisy", "noisy pool");
+    for (unsigned r = 0; r < sizeof(radii)/sizeof(radii[0]); ++r) {
+        printf("%-20s %6u %12.2f %12.2f %12.2f %12.2f\n", "100000 queries", radii[r],
+               bench_los_batch(open, radii[r], 100000, NULL), bench_los_batch(open, radii[r], 100000, pool),
+               bench_los_batch(noisy, radii[r], 100000, NULL), bench_los_batch(noisy, radii[r], 100000, pool));
+    }
+
+    printf("\n%-20s %6s %12s %12s %12s\n", "1000 lights", "radius", "callback", "batch", "pool");
+    for (unsigned m = 0; m < 2; ++m) {
+        for (unsigned r = 0; r < sizeof(radii)/sizeof(radii[0]); ++r) {
+            double callback, batch, pooled;
+            bench_lights(m ? noisy : open, radii[r], 1000, pool, &callback, &batch, &pooled);
+            printf("%-20s %6u %12.2f %12.2f %12.2f\n", m ? "noisy bitmap" : "open bitmap",
+                   radii[r], callback, batch, pooled);
+        }
+    }
+
+    printf("\n%-20s %6s %12s %12s\n", "single circle", "radius", "1 thread", "pool");
+    const unsigned large[] = { 100, 200, 250 };
+    for (unsigned r = 0; r < sizeof(large)/sizeof(large[0]); ++r) {
+        printf("%-20s %6u %12.2f %12.2f\n", "open bitmap", large[r],
+               bench_parallel(open, large[r], NULL),
+               bench_parallel(open, large[r], pool));
+    }
+    fov_pool_free(pool);
+
+    // A level with 10000 viewers, where doors open and close.
+    fov_settings_type settings;
+    fov_settings_init(&settings);
+    fov_settings_set_shape(&settings, FOV_SHAPE_CIRCLE);
+    fov_cache_type *cache = fov_cache_create(&settings, &noisy.bitmap, NULL, noisy.w, noisy.h);
+    vector<int> viewers;
+    for (unsigned i = 0; i < 10000; ++i) {
+        viewers.push_back(fov_cache_add(cache, (i*7919u) % noisy.w, (i*104729u) % noisy.h, 12));
+        fov_cache_visibility(cache, viewers.back());
+    }
+    unsigned long scans = fov_cache_scans(cache);
+    const unsigned toggles = 100;
+    for (unsigned i = 0; i < toggles; ++i) {
+        unsigned x = (i*31u) % noisy.w, y = (i*131u) % noisy.h;
+        noisy.words[y*noisy.bitmap.stride + x/64] ^= (uint64_t)1 << (x%64);
+        fov_cache_invalidate(cache, x, y);
+        for (unsigned j = 0; j < viewers.size(); ++j)
+            fov_cache_visibility(cache, viewers[j]);
+    }
+    printf("\n%u viewers of radius 12: %.1f recalculated per tile toggled\n",
+           (unsigned)viewers.size(), (double)(fov_cache_scans(cache) - scans)/toggles);
+    fov_cache_free(cache);
+    fov_settings_free(&settings);
+    return 0;
+}
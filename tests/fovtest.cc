@@ -5,15 +5,20 @@
  */
 
 #include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include <iterator>
 #include <list>
 #include <map>
 #include <ostream>
+#include <set>
 #include <sstream>
 #include <vector>
 #include <fov/fov.h>
+#include <fov/fov.hpp>
 #define BOOST_TEST_MODULE fovtest
 #include <boost/assign/list_of.hpp>
 #include <boost/assign/std/vector.hpp>
@@ -189,8 +194,234 @@ static bool opaque_increment(void *map, int x, int y) {
 
 // -------------------------------------------------
 
+struct Bitmap {
+    Bitmap(Map& map);
+
+    fov_bitmap_type bitmap;
+    vector<uint64_t> words;
+};
+
+Bitmap::Bitmap(Map& map):
+    words(((map.w + 63)/64)*map.h, 0)
+{
+    bitmap.width = map.w;
+    bitmap.height = map.h;
+    bitmap.stride = (map.w + 63)/64;
+    for (unsigned j = 0; j < map.h; ++j) {
+        for (unsigned i = 0; i < map.w; ++i) {
+            if (map.is_opaque(i, j))
+                words[j*bitmap.stride + i/64] |= (uint64_t)1 << (i%64);
+        }
+    }
+    bitmap.bits = &words[0];
+}
+
+// Deterministic pseudo-random raster with roughly one wall in every
+// 'sparsity' tiles.
+vector<string> noisy_raster(unsigned w, unsigned h, unsigned seed, unsigned sparsity) {
+    vector<string> raster(h, string(w, '.'));
+    for (unsigned j = 0; j < h; ++j) {
+        for (unsigned i = 0; i < w; ++i) {
+            seed = seed*1103515245u + 12345u;
+            if ((seed >> 16) % sparsity == 0)
+                raster[j][i] = '#';
+        }
+    }
+    return raster;
+}
+
+// Check that exactly the tiles lit in 'applied' are marked in 'visible'.
+void check_visibility(const Map& applied, const vector<uint64_t>& visible,
+        int px, int py, unsigned radius) {
+    for (int dy = -(int)radius; dy <= (int)radius; ++dy) {
+        for (int dx = -(int)radius; dx <= (int)radius; ++dx) {
+            unsigned x = px + dx, y = py + dy;
+            if (x >= applied.w || y >= applied.h)
+                continue;
+            bool lit = applied.apply_count_map.value(x, applied.h - 1 - y) != '0';
+            BOOST_CHECK_EQUAL(fov_visibility_test(&visible[0], radius, dx, dy), lit);
+        }
+    }
+}
+
+// -------------------------------------------------
+
+// Records a hash of the exact sequence of callbacks made by a scan.
+struct Trace {
+    Trace(const vector<string>& raster, int sx = 100, int sy = 100):
+        map(raster), hash(2166136261u), calls(0), sx(sx), sy(sy) { }
+    void mix(int v) { hash = (hash ^ (uint32_t)v)*16777619u; ++calls; }
+
+    Map map;
+    uint32_t hash;
+    unsigned calls;
+    // The source, which the C++ front end's offsets are checked against.
+    int sx;
+    int sy;
+};
+
+static bool opaque_trace(void *map, int x, int y) {
+    Trace *t = static_cast<Trace *>(map);
+    t->mix(0); t->mix(x); t->mix(y);
+    return !t->map.is_on_map(x, y) || t->map.is_opaque(x, y);
+}
+
+static void apply_trace(void *map, int x, int y, int dx, int dy, void *src) {
+    Trace *t = static_cast<Trace *>(map);
+    t->mix(1); t->mix(x); t->mix(y);
+}
+
+// The same callbacks as functors, for the C++ front end.
+struct TraceOpaque {
+    bool operator()(Trace& t, int x, int y) const { return opaque_trace(&t, x, y); }
+};
+
+struct TraceApply {
+    void operator()(Trace& t, int x, int y, int dx, int dy) const {
+        BOOST_CHECK(dx == x - t.sx && dy == y - t.sy);
+        apply_trace(&t, x, y, dx, dy, NULL);
+    }
+};
+
+struct SpanMap {
+    SpanMap(const vector<string>& raster): map(raster), spans(0) { }
+
+    Map map;
+    unsigned spans;
+};
+
+static void apply_span_increment(void *map, int x0, int y0, int x1, int y1, void *src) {
+    SpanMap *m = static_cast<SpanMap *>(map);
+    BOOST_CHECK(x0 <= x1 && y0 <= y1 && (x0 == x1 || y0 == y1));
+    ++m->spans;
+    for (int y = y0; y <= y1; ++y) {
+        for (int x = x0; x <= x1; ++x) {
+            apply_increment(&m->map, x, y, 0, 0, src);
+        }
+    }
+}
+
+static bool opaque_span_map(void *map, int x, int y) {
+    return opaque_increment(&static_cast<SpanMap *>(map)->map, x, y);
+}
+
+static void opaque_span_increment(void *map, int x0, int y0, int x1, int y1, bool *opaque) {
+    BOOST_CHECK(x0 <= x1 && y0 <= y1 && (x0 == x1 || y0 == y1));
+    for (int y = y0; y <= y1; ++y) {
+        for (int x = x0; x <= x1; ++x) {
+            *opaque++ = opaque_increment(map, x, y);
+        }
+    }
+}
+
+static bool opaque_never(void *map, int x, int y) {
+    return false;
+}
+
+// For batches: the map is only read and each source lights its own copy.
+static bool opaque_read(void *map, int x, int y) {
+    Map *m = static_cast<Map *>(map);
+    return !m->is_on_map(x, y) || m->is_opaque(x, y);
+}
+
+static void apply_source_increment(void *map, int x, int y, int dx, int dy, void *src) {
+    apply_increment(src, x, y, dx, dy, NULL);
+}
+
+// -------------------------------------------------
+
 typedef boost::tuple<Map, CountMap, CountMap> BasicCase;
 
+static void apply_count_calls(void *map, int x, int y, int dx, int dy, void *src) {
+    ++*static_cast<unsigned long *>(src);
+}
+
+typedef set<pair<int, int> > OffsetSet;
+
+static void apply_record_set(void *map, int x, int y, int dx, int dy, void *src) {
+    static_cast<OffsetSet *>(src)->insert(make_pair(dx, dy));
+}
+
+// Every apply call in the order made, as the source and the tile.
+typedef vector<pair<void *, pair<int, int> > > CallLog;
+
+static void apply_log(void *map, int x, int y, int dx, int dy, void *src) {
+    static_cast<CallLog *>(map)->push_back(make_pair(src, make_pair(x, y)));
+}
+
+// Records the tiles fov_circle_search tests, finding those in targets.
+struct Search {
+    Search(int px, int py, unsigned radius):
+        px(px), py(py), radius(radius), tested(fov_visibility_size(radius), 0),
+        calls(0), distance(0), errors(0) { }
+
+    int px;
+    int py;
+    unsigned radius;
+    set<pair<int, int> > targets;
+    vector<uint64_t> tested;
+    unsigned calls;
+    int distance;
+    unsigned errors;
+};
+
+static bool search_target(void *map, int x, int y, int dx, int dy, void *src) {
+    Search *s = static_cast<Search *>(src);
+    int d = max(abs(dx), abs(dy));
+    size_t i = (size_t)(dy + (int)s->radius)*fov_visibility_stride(s->radius) + (unsigned)(dx + (int)s->radius)/64;
+    uint64_t bit = (uint64_t)1 << ((unsigned)(dx + (int)s->radius)%64);
+    // Each tile once, nearest first.
+    if (dx != x - s->px || dy != y - s->py || d < s->distance || (s->tested[i] & bit))
+        ++s->errors;
+    s->tested[i] |= bit;
+    s->distance = d;
+    ++s->calls;
+    return s->targets.count(make_pair(x, y)) > 0;
+}
+
+// Counts the library's allocations, failing them when told to or
+// once the budget of allocations which may succeed runs out.
+static unsigned long allocations = 0;
+static bool allocations_fail = false;
+static unsigned long allocations_budget = ~0ul;
+
+static bool allocation_fails() {
+    ++allocations;
+    if (allocations_budget == 0) {
+        return true;
+    }
+    --allocations_budget;
+    return allocations_fail;
+}
+
+static void *counted_alloc(size_t size) {
+    return allocation_fails() ? NULL : malloc(size);
+}
+
+static void *counted_resize(void *p, size_t size) {
+    return allocation_fails() ? NULL : realloc(p, size);
+}
+
+static void counted_release(void *p) {
+    free(p);
+}
+
+// fov_los, which must have had the memory to answer.
+static bool los_lit(fov_settings_type *settings, const fov_bitmap_type *bitmap, void *map,
+                    int source_x, int source_y, int x, int y, unsigned radius) {
+    bool lit = false;
+    BOOST_CHECK(fov_los(settings, bitmap, map, source_x, source_y, x, y, radius, &lit));
+    return lit;
+}
+
+// A little endian number of n bytes at the given offset of a file.
+static uint64_t pvs_number(const string& bytes, size_t at, unsigned n) {
+    uint64_t value = 0;
+    for (unsigned i = n; i > 0; --i)
+        value = (value << 8) | (unsigned char)bytes[at + i - 1];
+    return value;
+}
+
 fov_settings_type *new_settings(fov_shape_type shape) {
     fov_settings_type *settings = new fov_settings_type;
     fov_settings_init(settings);
@@ -206,6 +437,39 @@ void delete_settings(fov_settings_type *settings) {
 }
 
 
+// The results of every kind of calculation from one source, packed
+// together for comparison.
+vector<uint64_t> calculate_all(fov_settings_type *settings, const vector<string>& raster,
+        Bitmap& bitmap, int px, int py, unsigned radius) {
+    vector<uint64_t> result, visible(fov_visibility_size(radius));
+    fov_circle_visibility(settings, &bitmap.bitmap, NULL, px, py, radius, &visible[0]);
+    result.insert(result.end(), visible.begin(), visible.end());
+    fov_beam_visibility(settings, &bitmap.bitmap, NULL, px, py, radius, FOV_NORTHEAST, 100.0f, &visible[0]);
+    result.insert(result.end(), visible.begin(), visible.end());
+    fov_cone_visibility(settings, &bitmap.bitmap, NULL, px, py, radius, 2.0f, 0.6f, &visible[0]);
+    result.insert(result.end(), visible.begin(), visible.end());
+
+    fov_stats_type stats;
+    fov_circle_stats(settings, &bitmap.bitmap, NULL, px, py, radius, &stats, NULL);
+    result.push_back(stats.cells);
+    result.push_back(stats.distance2);
+    result.push_back(los_lit(settings, &bitmap.bitmap, NULL, px, py,
+                             px + (int)radius/2, py - (int)radius/3, radius));
+    Search search(px, py, radius);
+    search.targets.insert(make_pair(px + 2, py + (int)radius/2));
+    int x = 0, y = 0;
+    result.push_back(fov_circle_search(settings, &bitmap.bitmap, NULL, &search, px, py, radius,
+                                       search_target, &x, &y));
+    result.push_back(search.calls);
+
+    Map lit(raster);
+    fov_circle(settings, &lit, NULL, px, py, radius);
+    for (unsigned j = 0; j < lit.h; ++j)
+        for (unsigned i = 0; i < lit.w; ++i)
+            result.push_back(lit.apply_count_map.value(i, j));
+    return result;
+}
+
 void test_count_maps(Map map, 
         CountMap expected_opaque, 
         CountMap expected_apply, 
@@ -727,4 +991,1592 @@ BOOST_AUTO_TEST_SUITE(test_suite1)
         BOOST_CHECK(map.offset_map == expected_offset_map);
     }
 
+    BOOST_AUTO_TEST_CASE(bitmap) {
+        const fov_shape_type shapes[] = {
+            FOV_SHAPE_CIRCLE_PRECALCULATE, FOV_SHAPE_SQUARE,
+            FOV_SHAPE_CIRCLE, FOV_SHAPE_OCTAGON
+        };
+        const unsigned radius = 30;
+        const int px = 40, py = 30;
+        vector<string> raster = noisy_raster(70, 61, 1, 5);
+        BOOST_FOREACH(fov_shape_type shape, shapes) {
+            for (int d = FOV_EAST; d <= FOV_SOUTHEAST; ++d) {
+                Map expected(raster), actual(raster);
+                Bitmap bitmap(actual);
+                fov_settings_type *settings = new_settings(shape);
+                fov_beam(settings, &expected, NULL, px, py, radius, (fov_direction_type)d, 100.0f);
+                fov_beam_bitmap(settings, &bitmap.bitmap, &actual, NULL, px, py, radius, (fov_direction_type)d, 100.0f);
+                BOOST_CHECK(actual.apply_count_map == expected.apply_count_map);
+                delete_settings(settings);
+            }
+
+            Map expected(raster), actual(raster);
+            Bitmap bitmap(actual);
+            fov_settings_type *settings = new_settings(shape);
+            fov_circle(settings, &expected, NULL, px, py, radius);
+            fov_circle_bitmap(settings, &bitmap.bitmap, &actual, NULL, px, py, radius);
+            BOOST_CHECK(actual.apply_count_map == expected.apply_count_map);
+            // The bitmap is read directly: no opacity callbacks.
+            BOOST_CHECK(actual.opaque_count_map == CountMap(actual.w, actual.h));
+            delete_settings(settings);
+        }
+    }
+
+    BOOST_AUTO_TEST_CASE(bitmap_out_of_bounds) {
+        vector<string> raster = list_of
+            (".....")
+            (".....")
+            ("..@..")
+            (".....")
+            (".....");
+        vector<string> expected_apply = list_of
+            ("11111")
+            ("11111")
+            ("11011")
+            ("11111")
+            ("11111");
+        Map map(raster);
+        Bitmap bitmap(map);
+        fov_settings_type *settings = new_settings(FOV_SHAPE_SQUARE);
+        // Tiles beyond the edges of the bitmap are opaque.
+        fov_circle_bitmap(settings, &bitmap.bitmap, &map, NULL, 2, 2, 10);
+        delete_settings(settings);
+        BOOST_CHECK(map.apply_count_map == CountMap(expected_apply));
+    }
+
+    BOOST_AUTO_TEST_CASE(visibility) {
+        const unsigned radius = 25;
+        const int px = 30, py = 28;
+        vector<string> raster = noisy_raster(64, 64, 7, 6);
+        vector<uint64_t> visible(fov_visibility_size(radius), ~(uint64_t)0);
+        fov_settings_type *settings = new_settings(FOV_SHAPE_CIRCLE);
+
+        Map expected(raster);
+        fov_circle(settings, &expected, NULL, px, py, radius);
+
+        Map actual(raster);
+        fov_circle_visibility(settings, NULL, &actual, px, py, radius, &visible[0]);
+        BOOST_CHECK(actual.apply_count_map == CountMap(actual.w, actual.h));
+        check_visibility(expected, visible, px, py, radius);
+
+        Bitmap bitmap(actual);
+        fov_circle_visibility(settings, &bitmap.bitmap, NULL, px, py, radius, &visible[0]);
+        check_visibility(expected, visible, px, py, radius);
+
+        for (int d = FOV_EAST; d <= FOV_SOUTHEAST; ++d) {
+            Map expected_beam(raster);
+            fov_beam(settings, &expected_beam, NULL, px, py, radius, (fov_direction_type)d, 60.0f);
+            fov_beam_visibility(settings, &bitmap.bitmap, NULL, px, py, radius, (fov_direction_type)d, 60.0f, &visible[0]);
+            check_visibility(expected_beam, visible, px, py, radius);
+        }
+        delete_settings(settings);
+    }
+
+    BOOST_AUTO_TEST_CASE(bitmap_runs) {
+        // The bitmap scanner skips whole runs of tiles at once. Compare
+        // it with the tile-by-tile callback scanner on open, cluttered
+        // and dense maps, with rows that span several words and end
+        // part-way through one, and with circles running off the edges.
+        const unsigned sparsities[] = { 1000, 40, 3 };
+        const int sources[][3] = { { 75, 70, 100 }, { 2, 3, 60 }, { 148, 137, 60 } };
+        const fov_shape_type shapes[] = { FOV_SHAPE_SQUARE, FOV_SHAPE_CIRCLE };
+        BOOST_FOREACH(unsigned sparsity, sparsities) {
+            vector<string> raster = noisy_raster(150, 140, sparsity, sparsity);
+            for (unsigned i = 0; i < sizeof(sources)/sizeof(sources[0]); ++i) {
+                const int px = sources[i][0], py = sources[i][1];
+                const unsigned radius = sources[i][2];
+                vector<uint64_t> visible(fov_visibility_size(radius));
+                BOOST_FOREACH(fov_shape_type shape, shapes) {
+                    fov_settings_type *settings = new_settings(shape);
+                    Map expected(raster), actual(raster);
+                    Bitmap bitmap(actual);
+                    fov_circle(settings, &expected, NULL, px, py, radius);
+                    fov_circle_bitmap(settings, &bitmap.bitmap, &actual, NULL, px, py, radius);
+                    BOOST_CHECK(actual.apply_count_map == expected.apply_count_map);
+                    fov_circle_visibility(settings, &bitmap.bitmap, NULL, px, py, radius, &visible[0]);
+                    check_visibility(expected, visible, px, py, radius);
+
+                    for (int d = FOV_EAST; d <= FOV_SOUTHEAST; ++d) {
+                        Map expected_beam(raster);
+                        fov_beam(settings, &expected_beam, NULL, px, py, radius, (fov_direction_type)d, 250.0f);
+                        fov_beam_visibility(settings, &bitmap.bitmap, NULL, px, py, radius,
+                                            (fov_direction_type)d, 250.0f, &visible[0]);
+                        check_visibility(expected_beam, visible, px, py, radius);
+                    }
+                    delete_settings(settings);
+                }
+            }
+        }
+    }
+
+    BOOST_AUTO_TEST_CASE(shared_heights) {
+        const unsigned radii[] = { 1, 7, 40, 41 };
+        vector<string> raster = noisy_raster(101, 101, 13, 9);
+        fov_heights_type *heights = fov_heights_create(40);
+        BOOST_REQUIRE(heights != NULL);
+        BOOST_FOREACH(unsigned radius, radii) {
+            Map expected(raster), actual(raster);
+            fov_settings_type *settings = new_settings(FOV_SHAPE_CIRCLE);
+            fov_circle(settings, &expected, NULL, 50, 50, radius);
+            delete_settings(settings);
+
+            settings = new_settings(FOV_SHAPE_CIRCLE_PRECALCULATE);
+            fov_settings_set_heights(settings, heights);
+            fov_circle(settings, &actual, NULL, 50, 50, radius);
+            BOOST_CHECK(actual.apply_count_map == expected.apply_count_map);
+            // Radii in the shared table leave the settings untouched.
+            BOOST_CHECK_EQUAL(settings->numheights == 0, radius <= 40);
+            delete_settings(settings);
+        }
+        fov_heights_free(heights);
+    }
+
+    BOOST_AUTO_TEST_CASE(batch) {
+        const fov_shape_type shapes[] = { FOV_SHAPE_CIRCLE_PRECALCULATE, FOV_SHAPE_OCTAGON };
+        const unsigned pool_sizes[] = { 1, 3 };
+        vector<string> raster = noisy_raster(80, 70, 17, 6);
+        Map map(raster);
+        Bitmap bitmap(map);
+        BOOST_FOREACH(fov_shape_type shape, shapes) {
+            fov_settings_type *settings = new_settings(shape);
+            vector<Map> expected(25, Map(raster));
+            vector<fov_source_type> sources(expected.size());
+            for (unsigned i = 0; i < sources.size(); ++i) {
+                sources[i].x = (int)(i*37 % 80);
+                sources[i].y = (int)(i*23 % 70);
+                sources[i].radius = 5 + i;
+                fov_circle(settings, &expected[i], NULL, sources[i].x, sources[i].y, sources[i].radius);
+            }
+            fov_settings_set_opacity_test_function(settings, opaque_read);
+            fov_settings_set_apply_lighting_function(settings, apply_source_increment);
+
+            // No pool: everything on the calling thread.
+            vector<Map> actual(sources.size(), Map(raster));
+            for (unsigned i = 0; i < sources.size(); ++i)
+                sources[i].source = &actual[i];
+            fov_circle_batch(settings, NULL, &map, &sources[0], sources.size(), NULL);
+            for (unsigned i = 0; i < sources.size(); ++i)
+                BOOST_CHECK(actual[i].apply_count_map == expected[i].apply_count_map);
+
+            BOOST_FOREACH(unsigned threads, pool_sizes) {
+                fov_pool_type *pool = fov_pool_create(threads);
+                BOOST_REQUIRE(pool != NULL);
+                // Twice, so the workers reuse their scratch space.
+                for (unsigned pass = 0; pass < 2; ++pass) {
+                    vector<Map> actual(sources.size(), Map(raster));
+                    for (unsigned i = 0; i < sources.size(); ++i)
+                        sources[i].source = &actual[i];
+                    fov_circle_batch(settings, pass ? &bitmap.bitmap : NULL, &map,
+                                     &sources[0], sources.size(), pool);
+                    for (unsigned i = 0; i < sources.size(); ++i)
+                        BOOST_CHECK(actual[i].apply_count_map == expected[i].apply_count_map);
+                }
+                fov_pool_free(pool);
+            }
+
+            // Without the memory for the threads' stacks, every source
+            // is lit on the calling thread.
+            for (unsigned long budget = 0; budget < 4; ++budget) {
+                fov_pool_type *pool = fov_pool_create(3);
+                BOOST_REQUIRE(pool != NULL);
+                vector<Map> actual(sources.size(), Map(raster));
+                for (unsigned i = 0; i < sources.size(); ++i)
+                    sources[i].source = &actual[i];
+                fov_set_allocator(counted_alloc, counted_resize, counted_release);
+                allocations_budget = budget;
+                fov_circle_batch(settings, &bitmap.bitmap, &map, &sources[0], sources.size(), pool);
+                allocations_budget = ~0ul;
+                fov_set_allocator(NULL, NULL, NULL);
+                for (unsigned i = 0; i < sources.size(); ++i)
+                    BOOST_CHECK(actual[i].apply_count_map == expected[i].apply_count_map);
+                fov_pool_free(pool);
+            }
+            delete_settings(settings);
+        }
+    }
+
+    BOOST_AUTO_TEST_CASE(batch_ordered) {
+        const unsigned pool_sizes[] = { 2, 3, 4 };
+        vector<string> raster = noisy_raster(80, 70, 29, 6);
+        Map map(raster);
+        Bitmap bitmap(map);
+        fov_settings_type *settings = new_settings(FOV_SHAPE_CIRCLE_PRECALCULATE);
+        fov_settings_set_apply_lighting_function(settings, apply_log);
+        vector<fov_source_type> sources(23);
+        for (unsigned i = 0; i < sources.size(); ++i) {
+            sources[i].x = (int)(i*37 % 80);
+            sources[i].y = (int)(i*23 % 70);
+            sources[i].radius = 3 + i % 9;
+            sources[i].source = &sources[i];
+        }
+
+        // The tiles each source lights on the calling thread.
+        CallLog serial;
+        fov_circle_batch(settings, &bitmap.bitmap, &serial, &sources[0], sources.size(), NULL);
+        vector<set<pair<int, int> > > expected(sources.size());
+        BOOST_FOREACH(const CallLog::value_type& call, serial)
+            expected[static_cast<fov_source_type *>(call.first) - &sources[0]].insert(call.second);
+
+        CallLog first;
+        BOOST_FOREACH(unsigned threads, pool_sizes) {
+            fov_pool_type *pool = fov_pool_create(threads);
+            BOOST_REQUIRE(pool != NULL);
+            for (unsigned pass = 0; pass < 2; ++pass) {
+                CallLog log;
+                fov_circle_batch_ordered(settings, &bitmap.bitmap, &log,
+                                         &sources[0], sources.size(), pool);
+                // One source after another in the order given, each
+                // lighting what it lights alone.
+                vector<set<pair<int, int> > > actual(sources.size());
+                size_t last = 0;
+                BOOST_FOREACH(const CallLog::value_type& call, log) {
+                    size_t i = static_cast<fov_source_type *>(call.first) - &sources[0];
+                    BOOST_REQUIRE(i >= last);
+                    last = i;
+                    actual[i].insert(call.second);
+                }
+                BOOST_CHECK(actual == expected);
+                // The same calls whatever the number of threads.
+                if (first.empty())
+                    first = log;
+                BOOST_CHECK(log == first);
+            }
+            fov_pool_free(pool);
+        }
+
+        // Without memory for the bitsets or the threads' stacks, lit in
+        // order on the calling thread; with it, as the threads light them.
+        for (unsigned long budget = 0; budget < 8; ++budget) {
+            fov_pool_type *pool = fov_pool_create(3);
+            BOOST_REQUIRE(pool != NULL);
+            CallLog log;
+            fov_set_allocator(counted_alloc, counted_resize, counted_release);
+            allocations_budget = budget;
+            fov_circle_batch_ordered(settings, &bitmap.bitmap, &log, &sources[0], sources.size(), pool);
+            allocations_budget = ~0ul;
+            fov_set_allocator(NULL, NULL, NULL);
+            BOOST_CHECK(log == serial || log == first);
+            fov_pool_free(pool);
+        }
+        delete_settings(settings);
+    }
+
+    BOOST_AUTO_TEST_CASE(parallel_octants) {
+        const unsigned pool_sizes[] = { 3, 10 };
+        const unsigned radius = 45;
+        const int px = 50, py = 47;
+        vector<string> raster = noisy_raster(100, 96, 21, 8);
+        vector<uint64_t> visible(fov_visibility_size(radius), ~(uint64_t)0);
+        BOOST_FOREACH(unsigned threads, pool_sizes) {
+            fov_pool_type *pool = fov_pool_create(threads);
+            BOOST_REQUIRE(pool != NULL);
+            fov_pool_set_threshold(pool, 20);
+            fov_settings_type *settings = new_settings(FOV_SHAPE_CIRCLE_PRECALCULATE);
+
+            Map expected(raster);
+            fov_circle(settings, &expected, NULL, px, py, radius);
+
+            Map map(raster);
+            Bitmap bitmap(map);
+            fov_circle_parallel(settings, &bitmap.bitmap, NULL, NULL, px, py, radius, &visible[0], pool);
+            check_visibility(expected, visible, px, py, radius);
+
+            // Each tile is reported once, from the calling thread.
+            Map actual(raster);
+            fov_circle_parallel(settings, &bitmap.bitmap, &actual, NULL, px, py, radius, NULL, pool);
+            BOOST_CHECK(actual.apply_count_map == expected.apply_count_map);
+
+            SpanMap spans(raster);
+            fov_settings_set_apply_span_function(settings, apply_span_increment);
+            fov_circle_parallel(settings, &bitmap.bitmap, &spans, NULL, px, py, radius, NULL, pool);
+            BOOST_CHECK(spans.map.apply_count_map == expected.apply_count_map);
+
+            // Without the memory for the threads' bitsets, the calling
+            // thread scans the whole circle.
+            fov_pool_type *fresh = fov_pool_create(threads);
+            BOOST_REQUIRE(fresh != NULL);
+            fov_pool_set_threshold(fresh, 20);
+            fov_settings_set_apply_span_function(settings, NULL);
+            Map fallback(raster);
+            fov_set_allocator(counted_alloc, counted_resize, counted_release);
+            allocations_fail = true;
+            fov_circle_parallel(settings, &bitmap.bitmap, &fallback, NULL, px, py, radius, NULL, fresh);
+            allocations_fail = false;
+            fov_set_allocator(NULL, NULL, NULL);
+            BOOST_CHECK(fallback.apply_count_map == expected.apply_count_map);
+            fov_pool_free(fresh);
+
+            // Nor when the bitsets fit but a thread's scan stack does
+            // not, whichever allocation it is that fails.
+            for (unsigned long budget = 1; budget < 3*threads; ++budget) {
+                fresh = fov_pool_create(threads);
+                BOOST_REQUIRE(fresh != NULL);
+                fov_pool_set_threshold(fresh, 20);
+                Map partial(raster);
+                fov_set_allocator(counted_alloc, counted_resize, counted_release);
+                allocations_budget = budget;
+                fov_circle_parallel(settings, &bitmap.bitmap, &partial, NULL, px, py, radius, NULL, fresh);
+                allocations_budget = ~0ul;
+                fov_set_allocator(NULL, NULL, NULL);
+                BOOST_CHECK(partial.apply_count_map == expected.apply_count_map);
+                fov_pool_free(fresh);
+            }
+
+            delete_settings(settings);
+            fov_pool_free(pool);
+        }
+    }
+
+    BOOST_AUTO_TEST_CASE(cache_invalidate) {
+        const unsigned w = 200, h = 180, count = 400;
+        const fov_shape_type shapes[] = { FOV_SHAPE_CIRCLE, FOV_SHAPE_SQUARE };
+        BOOST_FOREACH(fov_shape_type shape, shapes) {
+            Map map(noisy_raster(w, h, 31, 5));
+            Bitmap bitmap(map);
+            fov_settings_type *settings = new_settings(shape);
+            fov_settings_set_opaque_apply(settings, FOV_OPAQUE_NOAPPLY);
+            fov_cache_type *cache = fov_cache_create(settings, &bitmap.bitmap, NULL, w, h);
+            BOOST_REQUIRE(cache != NULL);
+            vector<int> viewers, xs, ys;
+            vector<unsigned> radii;
+            unsigned seed = 3;
+            for (unsigned i = 0; i < count; ++i) {
+                seed = seed*1103515245u + 12345u;
+                xs.push_back((seed >> 8) % w);
+                ys.push_back((seed >> 20) % h);
+                radii.push_back(6 + i % 10);
+                viewers.push_back(fov_cache_add(cache, xs[i], ys[i], radii[i]));
+                BOOST_REQUIRE(viewers[i] >= 0);
+                BOOST_CHECK(fov_cache_visibility(cache, viewers[i]) != NULL);
+            }
+            BOOST_CHECK_EQUAL(fov_cache_scans(cache), (unsigned long)count);
+
+            // Toggle tiles and invalidate them. Only a few viewers may
+            // go stale, yet every viewer must match a fresh calculation.
+            for (unsigned change = 0; change < 30; ++change) {
+                seed = seed*1103515245u + 12345u;
+                int x = (seed >> 8) % w, y = (seed >> 20) % h;
+                if (change % 10 == 9) {
+                    for (int j = y; j < y + 3 && j < (int)h; ++j)
+                        for (int i = x; i < x + 4 && i < (int)w; ++i)
+                            bitmap.words[j*bitmap.bitmap.stride + i/64] ^= (uint64_t)1 << (i%64);
+                    fov_cache_invalidate_rect(cache, x + 3, y + 2, x, y);
+                } else if (change == 25) {
+                    // A wall across viewer 8's window and more besides,
+                    // crossing words of its rows.
+                    for (int i = 0; i < 90; ++i)
+                        bitmap.words[12*bitmap.bitmap.stride + i/64] ^= (uint64_t)1 << (i%64);
+                    fov_cache_invalidate_rect(cache, 0, 12, 89, 12);
+                } else {
+                    bitmap.words[y*bitmap.bitmap.stride + x/64] ^= (uint64_t)1 << (x%64);
+                    fov_cache_invalidate(cache, x, y);
+                }
+                if (change == 15) {
+                    xs[7] = 100;
+                    ys[7] = 90;
+                    fov_cache_move(cache, viewers[7], xs[7], ys[7]);
+                    BOOST_CHECK(fov_cache_stale(cache, viewers[7]));
+                    // The freed entry is reused, with a window of rows
+                    // two words long.
+                    fov_cache_remove(cache, viewers[8]);
+                    xs[8] = ys[8] = 5;
+                    radii[8] = 40;
+                    BOOST_CHECK_EQUAL(fov_cache_add(cache, xs[8], ys[8], radii[8]), viewers[8]);
+                }
+
+                unsigned long before = fov_cache_scans(cache);
+                unsigned stale = 0;
+                for (unsigned i = 0; i < count; ++i)
+                    stale += fov_cache_stale(cache, viewers[i]);
+                BOOST_CHECK(stale < count/20);
+                for (unsigned i = 0; i < count; ++i) {
+                    const uint64_t *cached = fov_cache_visibility(cache, viewers[i]);
+                    BOOST_REQUIRE(cached != NULL);
+                    vector<uint64_t> fresh(fov_visibility_size(radii[i]));
+                    fov_circle_visibility(settings, &bitmap.bitmap, NULL, xs[i], ys[i], radii[i], &fresh[0]);
+                    BOOST_CHECK(equal(fresh.begin(), fresh.end(), cached));
+                }
+                BOOST_CHECK_EQUAL(fov_cache_scans(cache) - before, (unsigned long)stale);
+            }
+            fov_cache_free(cache);
+            delete_settings(settings);
+        }
+    }
+
+    BOOST_AUTO_TEST_CASE(memo) {
+        const unsigned radius = 15;
+        const int px = 20, py = 18;
+        vector<string> raster = noisy_raster(40, 36, 37, 6);
+        fov_settings_type *settings = new_settings(FOV_SHAPE_CIRCLE);
+        fov_memo_type *memo = fov_memo_create(1 << 20);
+        BOOST_REQUIRE(memo != NULL);
+        fov_memo_stats_type stats;
+
+        Map expected(raster);
+        fov_circle(settings, &expected, NULL, px, py, radius);
+        for (unsigned generation = 1; generation <= 2; ++generation) {
+            for (unsigned i = 0; i < 2; ++i) {
+                Map actual(raster);
+                fov_memo_circle(memo, settings, NULL, &actual, NULL, px, py, radius, generation, NULL);
+                BOOST_CHECK(actual.apply_count_map == expected.apply_count_map);
+                // A replay doesn't test opacity at all.
+                BOOST_CHECK_EQUAL(actual.opaque_count_map == CountMap(actual.w, actual.h), i == 1);
+            }
+        }
+        fov_memo_stats(memo, &stats);
+        BOOST_CHECK_EQUAL(stats.hits, 2u);
+        BOOST_CHECK_EQUAL(stats.misses, 2u);
+        BOOST_CHECK_EQUAL(stats.entries, 2u);
+
+        // Without memory for its bitset, a cache still answers, by
+        // calculating without storing.
+        fov_memo_type *empty = fov_memo_create(1 << 20);
+        BOOST_REQUIRE(empty != NULL);
+        vector<uint64_t> direct(fov_visibility_size(radius)), answer(direct.size());
+        Map uncached(raster);
+        fov_circle_visibility(settings, NULL, &uncached, px, py, radius, &direct[0]);
+        fov_set_allocator(counted_alloc, counted_resize, counted_release);
+        allocations_fail = true;
+        fov_memo_circle(empty, settings, NULL, &uncached, NULL, px, py, radius, 1, NULL);
+        fov_memo_circle(empty, settings, NULL, &uncached, NULL, px, py, radius, 1, &answer[0]);
+        allocations_fail = false;
+        fov_set_allocator(NULL, NULL, NULL);
+        BOOST_CHECK(uncached.apply_count_map == expected.apply_count_map);
+        BOOST_CHECK(answer == direct);
+        fov_memo_stats(empty, &stats);
+        BOOST_CHECK_EQUAL(stats.misses, 2u);
+        BOOST_CHECK_EQUAL(stats.entries, 0u);
+        fov_memo_free(empty);
+
+        // Beams are keyed by direction and angle too.
+        vector<uint64_t> visible(fov_visibility_size(radius)), fresh(visible.size());
+        Map map(raster);
+        for (unsigned pass = 0; pass < 2; ++pass) {
+            for (int d = FOV_EAST; d <= FOV_SOUTHEAST; ++d) {
+                fov_beam_visibility(settings, NULL, &map, px, py, radius, (fov_direction_type)d, 100.0f, &fresh[0]);
+                fov_memo_beam(memo, settings, NULL, &map, NULL, px, py, radius, (fov_direction_type)d, 100.0f, 1, &visible[0]);
+                BOOST_CHECK(visible == fresh);
+                fov_beam_visibility(settings, NULL, &map, px, py, radius, (fov_direction_type)d, 50.0f, &fresh[0]);
+                fov_memo_beam(memo, settings, NULL, &map, NULL, px, py, radius, (fov_direction_type)d, 50.0f, 1, &visible[0]);
+                BOOST_CHECK(visible == fresh);
+            }
+        }
+        fov_memo_stats(memo, &stats);
+        BOOST_CHECK_EQUAL(stats.hits, 2u + 16u);
+        BOOST_CHECK_EQUAL(stats.misses, 2u + 16u);
+        BOOST_CHECK_EQUAL(stats.evictions, 0u);
+        fov_memo_free(memo);
+
+        // A small cache drops the least recently used.
+        memo = fov_memo_create(2000);
+        for (int x = 10; x < 30; ++x) {
+            fov_memo_circle(memo, settings, NULL, &map, NULL, x, py, radius, 1, &visible[0]);
+            fov_circle_visibility(settings, NULL, &map, x, py, radius, &fresh[0]);
+            BOOST_CHECK(visible == fresh);
+            fov_memo_stats(memo, &stats);
+            BOOST_CHECK(stats.bytes <= 2000);
+        }
+        BOOST_CHECK(stats.evictions > 0);
+        BOOST_CHECK_EQUAL(stats.entries, 20 - stats.evictions);
+        fov_memo_circle(memo, settings, NULL, &map, NULL, 29, py, radius, 1, &visible[0]);
+        fov_memo_circle(memo, settings, NULL, &map, NULL, 10, py, radius, 1, &visible[0]);
+        fov_memo_stats(memo, &stats);
+        BOOST_CHECK_EQUAL(stats.hits, 1u);
+        BOOST_CHECK_EQUAL(stats.misses, 21u);
+        fov_memo_free(memo);
+        delete_settings(settings);
+    }
+
+    BOOST_AUTO_TEST_CASE(pvs) {
+        const unsigned radius = 9;
+        const char *path = "fovtest.pvs";
+        vector<string> raster = noisy_raster(70, 40, 29, 5);
+        Map map(raster);
+        Bitmap bitmap(map);
+        fov_settings_type *settings = new_settings(FOV_SHAPE_CIRCLE_PRECALCULATE);
+
+        // Build on one thread and on a pool; the files must be the same.
+        vector<string> files;
+        fov_pool_type *pool = fov_pool_create(3);
+        BOOST_REQUIRE(pool != NULL);
+        for (unsigned pass = 0; pass < 2; ++pass) {
+            FILE *out = fopen(path, "wb");
+            BOOST_REQUIRE(out != NULL);
+            BOOST_CHECK(fov_pvs_build(settings, &bitmap.bitmap, radius, out, pass ? pool : NULL));
+            fclose(out);
+            FILE *in = fopen(path, "rb");
+            BOOST_REQUIRE(in != NULL);
+            string bytes;
+            int c;
+            while ((c = fgetc(in)) != EOF)
+                bytes += (char)c;
+            fclose(in);
+            files.push_back(bytes);
+        }
+        fov_pool_free(pool);
+        BOOST_CHECK(files[0] == files[1]);
+
+        fov_pvs_type *pvs = fov_pvs_open(path);
+        BOOST_REQUIRE(pvs != NULL);
+        BOOST_CHECK_EQUAL(fov_pvs_radius(pvs), radius);
+        vector<uint64_t> expected(fov_visibility_size(radius));
+        vector<uint64_t> actual(fov_visibility_size(radius), ~(uint64_t)0);
+        for (int y = 0; y < (int)map.h; ++y) {
+            for (int x = 0; x < (int)map.w; ++x) {
+                fov_pvs_visibility(pvs, x, y, &actual[0]);
+                if (map.is_opaque(x, y)) {
+                    BOOST_CHECK(actual == vector<uint64_t>(actual.size(), 0));
+                    BOOST_CHECK(!fov_pvs_query(pvs, x, y, x + 1, y));
+                    continue;
+                }
+                fov_circle_visibility(settings, &bitmap.bitmap, NULL, x, y, radius, &expected[0]);
+                BOOST_CHECK(actual == expected);
+                for (int dy = -(int)radius - 1; dy <= (int)radius + 1; ++dy) {
+                    for (int dx = -(int)radius - 1; dx <= (int)radius + 1; ++dx) {
+                        bool lit = (unsigned)abs(dx) <= radius && (unsigned)abs(dy) <= radius
+                            && fov_visibility_test(&expected[0], radius, dx, dy);
+                        BOOST_CHECK_EQUAL(fov_pvs_query(pvs, x, y, x + dx, y + dy), lit);
+                    }
+                }
+            }
+        }
+        BOOST_CHECK(!fov_pvs_query(pvs, -1, 0, 0, 0));
+        fov_pvs_close(pvs);
+
+        // A truncated file is refused.
+        FILE *out = fopen(path, "wb");
+        BOOST_REQUIRE(out != NULL);
+        fwrite(files[0].data(), 1, files[0].size() - 1, out);
+        fclose(out);
+        BOOST_CHECK(fov_pvs_open(path) == NULL);
+
+        // Garbled records are read without straying outside the file
+        // or the bitset.
+        string garbled = files[0];
+        size_t index = pvs_number(garbled, garbled.size() - 16, 8);
+        unsigned seed = 1;
+        for (size_t i = 32; i < index; ++i) {
+            seed = seed*1103515245u + 12345u;
+            if ((seed >> 16) % 5 == 0)
+                garbled[i] = (char)(seed >> 24);
+        }
+        out = fopen(path, "wb");
+        BOOST_REQUIRE(out != NULL);
+        fwrite(garbled.data(), 1, garbled.size(), out);
+        fclose(out);
+        pvs = fov_pvs_open(path);
+        BOOST_REQUIRE(pvs != NULL);
+        for (int y = 0; y < (int)map.h; ++y) {
+            for (int x = 0; x < (int)map.w; ++x) {
+                fov_pvs_visibility(pvs, x, y, &actual[0]);
+                (void)fov_pvs_query(pvs, x, y, x + 1, y + 1);
+            }
+        }
+        fov_pvs_close(pvs);
+        remove(path);
+        delete_settings(settings);
+    }
+
+    BOOST_AUTO_TEST_CASE(pvs_runs) {
+        // Open ground is stored as runs, far smaller than its bits. A
+        // field of pillars, which hide every other tile of every other
+        // row, is stored as bits. Both read back as they were built.
+        const unsigned radius = 12;
+        const char *path = "fovtest.pvs";
+        vector<string> ground(30, string(30, '.'));
+        vector<string> pillars(30, string(30, '.'));
+        for (unsigned y = 1; y < 30; y += 2)
+            for (unsigned x = 1; x < 30; x += 2)
+                pillars[y][x] = '#';
+        fov_settings_type *settings = new_settings(FOV_SHAPE_SQUARE);
+        fov_settings_set_opaque_apply(settings, FOV_OPAQUE_NOAPPLY);
+        for (unsigned pass = 0; pass < 2; ++pass) {
+            Map map(pass ? pillars : ground);
+            Bitmap bitmap(map);
+            FILE *out = fopen(path, "wb");
+            BOOST_REQUIRE(out != NULL);
+            BOOST_CHECK(fov_pvs_build(settings, &bitmap.bitmap, radius, out, NULL));
+            fclose(out);
+            FILE *in = fopen(path, "rb");
+            BOOST_REQUIRE(in != NULL);
+            string bytes;
+            int c;
+            while ((c = fgetc(in)) != EOF)
+                bytes += (char)c;
+            fclose(in);
+
+            // Each lit tile's record, by how its tiles are stored, and
+            // the bytes the records take against those of their bits.
+            size_t index = pvs_number(bytes, bytes.size() - 16, 8);
+            size_t counts[2] = { 0, 0 }, stored = 0, bits = 0;
+            for (size_t i = 0; i < map.w*map.h; ++i) {
+                size_t at = pvs_number(bytes, index + i*8, 8);
+                int x0 = (int16_t)pvs_number(bytes, at, 2), y0 = (int16_t)pvs_number(bytes, at + 2, 2);
+                int x1 = (int16_t)pvs_number(bytes, at + 4, 2), y1 = (int16_t)pvs_number(bytes, at + 6, 2);
+                if (x1 < x0)
+                    continue;
+                BOOST_REQUIRE((unsigned char)bytes[at + 8] < 2);
+                ++counts[(unsigned char)bytes[at + 8]];
+                stored += (i + 1 < map.w*map.h ? pvs_number(bytes, index + i*8 + 8, 8) : index) - at;
+                bits += 9 + ((x1 - x0 + 1)*(y1 - y0 + 1) + 7)/8;
+            }
+            BOOST_CHECK(counts[0] + counts[1] > 0);
+            BOOST_CHECK_EQUAL(counts[pass ? 1 : 0], 0u);
+            if (!pass)
+                BOOST_CHECK(4*stored < bits);
+
+            fov_pvs_type *pvs = fov_pvs_open(path);
+            BOOST_REQUIRE(pvs != NULL);
+            vector<uint64_t> expected(fov_visibility_size(radius));
+            vector<uint64_t> actual(fov_visibility_size(radius));
+            for (int y = 0; y < (int)map.h; ++y) {
+                for (int x = 0; x < (int)map.w; ++x) {
+                    if (map.is_opaque(x, y))
+                        continue;
+                    fov_pvs_visibility(pvs, x, y, &actual[0]);
+                    fov_circle_visibility(settings, &bitmap.bitmap, NULL, x, y, radius, &expected[0]);
+                    BOOST_CHECK(actual == expected);
+                    BOOST_CHECK_EQUAL(fov_pvs_query(pvs, x, y, x + 3, y - 2),
+                                      fov_visibility_test(&expected[0], radius, 3, -2));
+                }
+            }
+            fov_pvs_close(pvs);
+        }
+        remove(path);
+        delete_settings(settings);
+    }
+
+    BOOST_AUTO_TEST_CASE(lights) {
+        const unsigned w = 60, h = 50;
+        vector<string> raster = noisy_raster(w, h, 31, 7);
+        Map map(raster);
+        Bitmap bitmap(map);
+        fov_settings_type *settings = new_settings(FOV_SHAPE_CIRCLE);
+
+        vector<fov_light_type> lights(40);
+        for (unsigned i = 0; i < lights.size(); ++i) {
+            // Some lights hang off the edges of the buffer.
+            lights[i].x = (int)(i*37 % (w + 10)) - 5;
+            lights[i].y = (int)(i*23 % (h + 10)) - 5;
+            lights[i].radius = 1 + i % 13;
+            lights[i].colour[0] = 1.0f;
+            lights[i].colour[1] = 0.5f*(i % 3);
+            lights[i].colour[2] = 0.25f*(i % 5);
+            lights[i].falloff = (fov_falloff_type)(i % 3);
+        }
+
+        vector<float> expected(w*h*3, 0.0f);
+        for (unsigned i = 0; i < lights.size(); ++i) {
+            const fov_light_type& l = lights[i];
+            vector<uint64_t> visible(fov_visibility_size(l.radius));
+            fov_circle_visibility(settings, &bitmap.bitmap, NULL, l.x, l.y, l.radius, &visible[0]);
+            for (int dy = -(int)l.radius; dy <= (int)l.radius; ++dy) {
+                for (int dx = -(int)l.radius; dx <= (int)l.radius; ++dx) {
+                    unsigned x = l.x + dx, y = l.y + dy;
+                    if (x >= w || y >= h)
+                        continue;
+                    if ((dx || dy) && !fov_visibility_test(&visible[0], l.radius, dx, dy))
+                        continue;
+                    double t = max(0.0, 1.0 - sqrt((double)(dx*dx + dy*dy))/(l.radius + 1.0));
+                    double f = l.falloff == FOV_FALLOFF_NONE ? 1.0 : l.falloff == FOV_FALLOFF_LINEAR ? t : t*t;
+                    for (unsigned c = 0; c < 3; ++c)
+                        expected[(y*w + x)*3 + c] += (float)(l.colour[c]*f);
+                }
+            }
+        }
+
+        vector<float> actual(w*h*3, 0.0f);
+        BOOST_CHECK(fov_light_batch(settings, &bitmap.bitmap, NULL, &lights[0], lights.size(),
+                                    &actual[0], w, h, NULL));
+        for (unsigned i = 0; i < actual.size(); ++i)
+            BOOST_CHECK_SMALL(actual[i] - expected[i], 1e-4f);
+
+        // The pool gives exactly the same sums, however the rows split.
+        const unsigned pool_sizes[] = { 2, 7 };
+        fov_settings_set_opacity_test_function(settings, opaque_read);
+        BOOST_FOREACH(unsigned threads, pool_sizes) {
+            fov_pool_type *pool = fov_pool_create(threads);
+            BOOST_REQUIRE(pool != NULL);
+            vector<float> pooled(w*h*3, 0.0f);
+            BOOST_CHECK(fov_light_batch(settings, NULL, &map, &lights[0], lights.size(),
+                                        &pooled[0], w, h, pool));
+            BOOST_CHECK(pooled == actual);
+            fov_pool_free(pool);
+        }
+
+        // Short of memory, on a pool or not, the batch fails before it
+        // adds any light, or else gives the same sums.
+        for (unsigned long budget = 0; budget < 16; ++budget) {
+            fov_pool_type *pool = budget % 2 ? fov_pool_create(3) : NULL;
+            fov_settings_type *fresh = new_settings(FOV_SHAPE_CIRCLE);
+            fov_settings_set_opacity_test_function(fresh, opaque_read);
+            vector<float> pooled(w*h*3, 0.0f);
+            fov_set_allocator(counted_alloc, counted_resize, counted_release);
+            allocations_budget = budget/2;
+            bool lit = fov_light_batch(fresh, NULL, &map, &lights[0], lights.size(),
+                                       &pooled[0], w, h, pool);
+            allocations_budget = ~0ul;
+            fov_set_allocator(NULL, NULL, NULL);
+            BOOST_CHECK(pooled == (lit ? actual : vector<float>(w*h*3, 0.0f)));
+            delete_settings(fresh);
+            fov_pool_free(pool);
+        }
+        delete_settings(settings);
+    }
+
+    BOOST_AUTO_TEST_CASE(los) {
+        const fov_shape_type shapes[] = {
+            FOV_SHAPE_CIRCLE_PRECALCULATE, FOV_SHAPE_SQUARE, FOV_SHAPE_CIRCLE, FOV_SHAPE_OCTAGON
+        };
+        const fov_opaque_apply_type applies[] = { FOV_OPAQUE_APPLY, FOV_OPAQUE_NOAPPLY };
+        const unsigned sparsities[] = { 3, 6, 40 };
+        const unsigned radius = 14;
+        BOOST_FOREACH(unsigned sparsity, sparsities) {
+            vector<string> raster = noisy_raster(50, 45, 37 + sparsity, sparsity);
+            Map map(raster);
+            Bitmap bitmap(map);
+            BOOST_FOREACH(fov_shape_type shape, shapes) {
+                BOOST_FOREACH(fov_opaque_apply_type apply, applies) {
+                    fov_settings_type *settings = new_settings(shape);
+                    fov_settings_set_opaque_apply(settings, apply);
+                    fov_settings_set_opacity_test_function(settings, opaque_read);
+                    vector<uint64_t> visible(fov_visibility_size(radius));
+                    for (unsigned i = 0; i < 12; ++i) {
+                        // Sources near the edges and corners too.
+                        int px = (int)(i*17 % 50), py = (int)(i*29 % 45);
+                        fov_circle_visibility(settings, &bitmap.bitmap, NULL, px, py, radius, &visible[0]);
+                        for (int dy = -(int)radius - 1; dy <= (int)radius + 1; ++dy) {
+                            for (int dx = -(int)radius - 1; dx <= (int)radius + 1; ++dx) {
+                                bool lit = fov_visibility_test(&visible[0], radius, dx, dy);
+                                BOOST_CHECK_EQUAL(los_lit(settings, &bitmap.bitmap, NULL,
+                                                          px, py, px + dx, py + dy, radius), lit);
+                                BOOST_CHECK_EQUAL(los_lit(settings, NULL, &map,
+                                                          px, py, px + dx, py + dy, radius), lit);
+                            }
+                        }
+                    }
+                    delete_settings(settings);
+                }
+            }
+        }
+
+        // Without the memory for its stack, fov_los says so rather than
+        // answering false.
+        fov_settings_type *settings = new_settings(FOV_SHAPE_CIRCLE);
+        fov_settings_set_opacity_test_function(settings, opaque_never);
+        bool lit = false;
+        fov_set_allocator(counted_alloc, counted_resize, counted_release);
+        allocations_fail = true;
+        BOOST_CHECK(!fov_los(settings, NULL, NULL, 0, 0, 3, 1, radius, &lit));
+        allocations_fail = false;
+        fov_set_allocator(NULL, NULL, NULL);
+        BOOST_CHECK(!lit);
+        BOOST_CHECK(fov_los(settings, NULL, NULL, 0, 0, 3, 1, radius, &lit));
+        BOOST_CHECK(lit);
+        delete_settings(settings);
+    }
+
+    BOOST_AUTO_TEST_CASE(los_worst_case) {
+        // Rows of wall broken by gaps, alternating with open rows, split
+        // every column into as many runs as it can hold, at a large
+        // radius. fov_los() fails a query rather than overrun its stack,
+        // so every query must still be answered, and agree with the
+        // full field of view.
+        const unsigned radius = 200, size = 2*radius + 1;
+        const unsigned gaps[] = { 2, 3, 5 };
+        fov_settings_type *settings = new_settings(FOV_SHAPE_SQUARE);
+        vector<uint64_t> visible(fov_visibility_size(radius));
+        BOOST_FOREACH(unsigned gap, gaps) {
+            vector<string> raster(size, string(size, '.'));
+            for (unsigned j = 0; j < size; ++j)
+                for (unsigned i = 0; i < size; ++i)
+                    if (j % 2 == 1 && (i + j/2) % gap != 0)
+                        raster[j][i] = '#';
+            for (unsigned k = 0; k < 2; ++k) {
+                // Then the same map on its side.
+                if (k == 1) {
+                    vector<string> turned(size, string(size, '.'));
+                    for (unsigned j = 0; j < size; ++j)
+                        for (unsigned i = 0; i < size; ++i)
+                            turned[i][j] = raster[j][i];
+                    raster = turned;
+                }
+                Map map(raster);
+                Bitmap bitmap(map);
+                fov_circle_visibility(settings, &bitmap.bitmap, NULL, radius, radius, radius, &visible[0]);
+                for (int dy = -(int)radius; dy <= (int)radius; dy += 3) {
+                    for (int dx = -(int)radius; dx <= (int)radius; dx += 5) {
+                        bool lit = false;
+                        BOOST_REQUIRE(fov_los(settings, &bitmap.bitmap, NULL, radius, radius,
+                                              radius + dx, radius + dy, radius, &lit));
+                        BOOST_CHECK_EQUAL(lit, fov_visibility_test(&visible[0], radius, dx, dy));
+                    }
+                }
+            }
+        }
+        delete_settings(settings);
+    }
+
+    BOOST_AUTO_TEST_CASE(los_batch) {
+        vector<string> raster = noisy_raster(90, 70, 41, 6);
+        Map map(raster);
+        Bitmap bitmap(map);
+        fov_settings_type *settings = new_settings(FOV_SHAPE_CIRCLE_PRECALCULATE);
+        fov_settings_set_opacity_test_function(settings, opaque_read);
+
+        // Not a whole number of result words.
+        vector<fov_los_query_type> queries(1000);
+        vector<uint64_t> expected((queries.size() + 63)/64, 0);
+        for (unsigned i = 0; i < queries.size(); ++i) {
+            fov_los_query_type& q = queries[i];
+            q.source_x = (int)(i*37 % 90);
+            q.source_y = (int)(i*23 % 70);
+            q.x = q.source_x + (int)(i*7 % 25) - 12;
+            q.y = q.source_y + (int)(i*11 % 25) - 12;
+            q.radius = 4 + i % 9;
+            if (los_lit(settings, &bitmap.bitmap, NULL, q.source_x, q.source_y, q.x, q.y, q.radius))
+                expected[i/64] |= (uint64_t)1 << (i%64);
+        }
+
+        vector<uint64_t> results(expected.size(), ~(uint64_t)0);
+        BOOST_CHECK(fov_los_batch(settings, &bitmap.bitmap, NULL, &queries[0], queries.size(),
+                                  &results[0], NULL));
+        BOOST_CHECK(results == expected);
+
+        const unsigned pool_sizes[] = { 2, 5, 40 };
+        BOOST_FOREACH(unsigned threads, pool_sizes) {
+            fov_pool_type *pool = fov_pool_create(threads);
+            BOOST_REQUIRE(pool != NULL);
+            fill(results.begin(), results.end(), ~(uint64_t)0);
+            BOOST_CHECK(fov_los_batch(settings, threads % 2 ? NULL : &bitmap.bitmap, &map,
+                                      &queries[0], queries.size(), &results[0], pool));
+            BOOST_CHECK(results == expected);
+            fov_pool_free(pool);
+        }
+        delete_settings(settings);
+    }
+
+    BOOST_AUTO_TEST_CASE(cone) {
+        const float pi = 3.14159265358979f;
+        const unsigned radius = 12;
+        const int px = 25, py = 20;
+        vector<string> raster = noisy_raster(50, 40, 43, 7);
+        Map map(raster);
+        Bitmap bitmap(map);
+        fov_settings_type *settings = new_settings(FOV_SHAPE_CIRCLE_PRECALCULATE);
+        vector<uint64_t> circle(fov_visibility_size(radius)), cone(circle.size()), beam(circle.size());
+        fov_circle_visibility(settings, &bitmap.bitmap, NULL, px, py, radius, &circle[0]);
+
+        // Along the eight directions, quarter turns light what fov_beam
+        // does, plus tiles on the rays along the cone's edges.
+        for (int d = 0; d < 8; ++d) {
+            for (int q = 1; q <= 4; ++q) {
+                fov_beam_visibility(settings, &bitmap.bitmap, NULL, px, py, radius,
+                                    (fov_direction_type)d, 90.0f*q, &beam[0]);
+                fov_cone_visibility(settings, &bitmap.bitmap, NULL, px, py, radius,
+                                    d*pi/4, q*pi/4, &cone[0]);
+                for (int dy = -(int)radius; dy <= (int)radius; ++dy) {
+                    for (int dx = -(int)radius; dx <= (int)radius; ++dx) {
+                        if (fov_visibility_test(&beam[0], radius, dx, dy))
+                            BOOST_CHECK(fov_visibility_test(&cone[0], radius, dx, dy));
+                        else if (fov_visibility_test(&cone[0], radius, dx, dy))
+                            BOOST_CHECK(dx == 0 || dy == 0 || abs(dx) == abs(dy));
+                    }
+                }
+            }
+        }
+
+        // Any heading: nothing lit outside the cone, and every tile of the
+        // circle well inside the cone lit.
+        for (int i = 0; i < 40; ++i) {
+            float direction = -7.0f + 0.37f*i, half = 0.05f + 0.09f*(i % 13);
+            fov_cone_visibility(settings, &bitmap.bitmap, NULL, px, py, radius,
+                                direction, half, &cone[0]);
+            for (int dy = -(int)radius; dy <= (int)radius; ++dy) {
+                for (int dx = -(int)radius; dx <= (int)radius; ++dx) {
+                    bool lit = fov_visibility_test(&cone[0], radius, dx, dy);
+                    if (dx == 0 && dy == 0)
+                        continue;
+                    double off = fmod(fabs(atan2((double)-dy, (double)dx) - direction), 2*pi);
+                    off = min(off, 2*pi - off);
+                    double margin = 1.5/sqrt((double)(dx*dx + dy*dy));
+                    BOOST_CHECK(!lit || off < half + margin);
+                    if (off + margin < half && fov_visibility_test(&circle[0], radius, dx, dy))
+                        BOOST_CHECK(lit);
+                }
+            }
+        }
+
+        // Half angles of pi or more give the full circle, negative ones
+        // nothing.
+        fov_cone_visibility(settings, &bitmap.bitmap, NULL, px, py, radius, 1.0f, pi, &cone[0]);
+        BOOST_CHECK(cone == circle);
+        fov_cone_visibility(settings, &bitmap.bitmap, NULL, px, py, radius, 1.0f, -0.5f, &cone[0]);
+        BOOST_CHECK(cone == vector<uint64_t>(cone.size(), 0));
+
+        // The callback versions light the same tiles.
+        Map applied(raster);
+        fov_cone(settings, &applied, NULL, px, py, radius, 2.0f, 0.6f);
+        fov_cone_visibility(settings, NULL, &map, px, py, radius, 2.0f, 0.6f, &cone[0]);
+        check_visibility(applied, cone, px, py, radius);
+        delete_settings(settings);
+    }
+
+    BOOST_AUTO_TEST_CASE(circle_search) {
+        const fov_shape_type shapes[] = {
+            FOV_SHAPE_CIRCLE_PRECALCULATE, FOV_SHAPE_SQUARE,
+            FOV_SHAPE_CIRCLE, FOV_SHAPE_OCTAGON
+        };
+        const unsigned radius = 14;
+        const int px = 30, py = 22;
+        vector<string> raster = noisy_raster(60, 45, 17, 6);
+        Map map(raster);
+        Bitmap bitmap(map);
+        vector<uint64_t> visible(fov_visibility_size(radius));
+        for (unsigned s = 0; s < 4; ++s) {
+            for (unsigned apply = 0; apply < 2; ++apply) {
+                fov_settings_type *settings = new_settings(shapes[s]);
+                fov_settings_set_opacity_test_function(settings, opaque_read);
+                fov_settings_set_opaque_apply(settings, apply ? FOV_OPAQUE_APPLY : FOV_OPAQUE_NOAPPLY);
+                fov_circle_visibility(settings, &bitmap.bitmap, NULL, px, py, radius, &visible[0]);
+
+                // With nothing to find, every tile in view is tested.
+                Search all(px, py, radius);
+                BOOST_CHECK(!fov_circle_search(settings, NULL, &map, &all, px, py, radius,
+                                               search_target, NULL, NULL));
+                BOOST_CHECK_EQUAL(all.errors, 0u);
+                BOOST_CHECK(all.tested == visible);
+
+                // The nearest of some targets is found, in or out of view.
+                for (unsigned k = 0; k < 20; ++k) {
+                    Search some(px, py, radius);
+                    for (unsigned t = 0; t < 3; ++t)
+                        some.targets.insert(make_pair(px + (int)((k*7 + t*13)%29) - 14,
+                                                      py + (int)((k*11 + t*5)%29) - 14));
+                    int best = -1;
+                    set<pair<int, int> >::const_iterator it;
+                    for (it = some.targets.begin(); it != some.targets.end(); ++it) {
+                        int dx = it->first - px, dy = it->second - py;
+                        if (fov_visibility_test(&visible[0], radius, dx, dy)
+                            && (best < 0 || max(abs(dx), abs(dy)) < best))
+                            best = max(abs(dx), abs(dy));
+                    }
+                    int x = -1, y = -1;
+                    BOOST_CHECK_EQUAL(fov_circle_search(settings, k % 2 ? NULL : &bitmap.bitmap, &map,
+                                                        &some, px, py, radius,
+                                                        search_target, &x, &y), best >= 0);
+                    BOOST_CHECK_EQUAL(some.errors, 0u);
+                    if (best >= 0) {
+                        BOOST_CHECK(some.targets.count(make_pair(x, y)) > 0);
+                        BOOST_CHECK_EQUAL(max(abs(x - px), abs(y - py)), best);
+                    }
+                }
+                delete_settings(settings);
+            }
+        }
+
+        // A target next to the source is found straight away.
+        fov_settings_type *settings = new_settings(FOV_SHAPE_CIRCLE);
+        fov_settings_set_opacity_test_function(settings, opaque_never);
+        Search adjacent(0, 0, 100);
+        adjacent.targets.insert(make_pair(-1, 1));
+        BOOST_CHECK(fov_circle_search(settings, NULL, NULL, &adjacent, 0, 0, 100, search_target, NULL, NULL));
+        BOOST_CHECK(adjacent.calls <= 8);
+        delete_settings(settings);
+    }
+
+    BOOST_AUTO_TEST_CASE(circle_stats) {
+        const fov_shape_type shapes[] = {
+            FOV_SHAPE_CIRCLE_PRECALCULATE, FOV_SHAPE_SQUARE,
+            FOV_SHAPE_CIRCLE, FOV_SHAPE_OCTAGON
+        };
+        const unsigned radius = 13;
+        vector<string> raster = noisy_raster(50, 40, 29, 5);
+        Map map(raster);
+        Bitmap bitmap(map);
+        vector<uint64_t> visible(fov_visibility_size(radius));
+        vector<unsigned long> bands(radius + 1);
+        for (unsigned s = 0; s < 4; ++s) {
+            for (unsigned apply = 0; apply < 2; ++apply) {
+                fov_settings_type *settings = new_settings(shapes[s]);
+                fov_settings_set_opacity_test_function(settings, opaque_read);
+                fov_settings_set_opaque_apply(settings, apply ? FOV_OPAQUE_APPLY : FOV_OPAQUE_NOAPPLY);
+                for (unsigned i = 0; i < 6; ++i) {
+                    // Sources by the edges too, where the map runs out.
+                    int px = (int)(i*19 % 50), py = (int)(i*13 % 40);
+                    fov_circle_visibility(settings, &bitmap.bitmap, NULL, px, py, radius, &visible[0]);
+                    fov_stats_type expected;
+                    memset(&expected, 0, sizeof(expected));
+                    vector<unsigned long> expected_bands(radius + 1, 0);
+                    for (int dy = -(int)radius; dy <= (int)radius; ++dy) {
+                        for (int dx = -(int)radius; dx <= (int)radius; ++dx) {
+                            if (!fov_visibility_test(&visible[0], radius, dx, dy))
+                                continue;
+                            unsigned o = dx > 0 && abs(dy) <= dx ? (dy >= 0 ? 0 : 2)
+                                : dx < 0 && abs(dy) <= -dx ? (dy >= 0 ? 4 : 6)
+                                : dy > 0 ? (dx >= 0 ? 1 : 3) : (dx >= 0 ? 5 : 7);
+                            ++expected.cells;
+                            ++expected.octants[o];
+                            expected.distance2 += dx*dx + dy*dy;
+                            ++expected_bands[max(abs(dx), abs(dy))];
+                        }
+                    }
+
+                    fov_stats_type stats;
+                    fov_circle_stats(settings, i % 2 ? NULL : &bitmap.bitmap, &map,
+                                     px, py, radius, &stats, &bands[0]);
+                    BOOST_CHECK_EQUAL(stats.cells, expected.cells);
+                    BOOST_CHECK(equal(stats.octants, stats.octants + 8, expected.octants));
+                    BOOST_CHECK_EQUAL(stats.distance2, expected.distance2);
+                    BOOST_CHECK(bands == expected_bands);
+
+                    // The same as counting the calls to apply.
+                    unsigned long calls = 0;
+                    fov_settings_set_apply_lighting_function(settings, apply_count_calls);
+                    fov_circle(settings, &map, &calls, px, py, radius);
+                    BOOST_CHECK_EQUAL(stats.cells, calls);
+                    fov_circle_stats(settings, &bitmap.bitmap, NULL, px, py, radius, &stats, NULL);
+                    BOOST_CHECK_EQUAL(stats.cells, expected.cells);
+                }
+                delete_settings(settings);
+            }
+        }
+    }
+
+    BOOST_AUTO_TEST_CASE(chunks) {
+        fov_chunks_type *chunks = fov_chunks_create();
+        BOOST_REQUIRE(chunks != NULL);
+
+        // Everything starts clear, as far out as coordinates go.
+        BOOST_CHECK(!fov_chunks_opaque(chunks, 0, 0));
+        BOOST_CHECK(!fov_chunks_opaque(chunks, -2000000000, 2000000000));
+        BOOST_CHECK(fov_chunks_set(chunks, -1, -1, true));
+        BOOST_CHECK(fov_chunks_set(chunks, 2147483647, -2147483647 - 1, true));
+        BOOST_CHECK(fov_chunks_opaque(chunks, -1, -1));
+        BOOST_CHECK(!fov_chunks_opaque(chunks, -1, -2));
+        BOOST_CHECK(!fov_chunks_opaque(chunks, 63, 63));
+        BOOST_CHECK(fov_chunks_opaque(chunks, 2147483647, -2147483647 - 1));
+        BOOST_CHECK_EQUAL(fov_chunks_stored(chunks), 2u);
+
+        // Whole chunks of a fill share the opaque chunk, and only those
+        // cut by its edges have tiles of their own, so the one holding
+        // (-1,-1) gives its up.
+        BOOST_CHECK(fov_chunks_fill(chunks, -1000, -1000, 999, 999, true));
+        BOOST_CHECK_EQUAL(fov_chunks_stored(chunks), 1u + 4*31u);
+        BOOST_CHECK(fov_chunks_opaque(chunks, -1000, 999));
+        BOOST_CHECK(!fov_chunks_opaque(chunks, -1001, 0));
+        BOOST_CHECK(!fov_chunks_opaque(chunks, 0, 1000));
+        BOOST_CHECK(fov_chunks_set(chunks, 5, 5, false));
+        BOOST_CHECK(!fov_chunks_opaque(chunks, 5, 5));
+        BOOST_CHECK(fov_chunks_opaque(chunks, 5, 6));
+        BOOST_CHECK(fov_chunks_fill(chunks, -1000000, -1000000, 1000000, 1000000, false));
+        BOOST_CHECK_EQUAL(fov_chunks_stored(chunks), 1u);
+        BOOST_CHECK(!fov_chunks_opaque(chunks, -1, -1));
+        BOOST_CHECK(!fov_chunks_opaque(chunks, 500, -500));
+
+        // A map far from the origin, walled in, lights the same tiles
+        // read from the store as from its bitmap.
+        const int ox = 1000000000, oy = -1000000000;
+        vector<string> raster = noisy_raster(150, 100, 37, 7);
+        Map map(raster);
+        Bitmap bitmap(map);
+        BOOST_CHECK(fov_chunks_fill(chunks, ox - 500, oy - 500, ox + 649, oy + 599, true));
+        BOOST_CHECK(fov_chunks_fill(chunks, ox, oy, ox + 149, oy + 99, false));
+        for (unsigned j = 0; j < map.h; ++j)
+            for (unsigned i = 0; i < map.w; ++i)
+                if (map.is_opaque(i, j))
+                    BOOST_CHECK(fov_chunks_set(chunks, ox + (int)i, oy + (int)j, true));
+
+        const unsigned radius = 40;
+        vector<uint64_t> expected(fov_visibility_size(radius)), visible(expected.size());
+        fov_settings_type *settings = new_settings(FOV_SHAPE_CIRCLE_PRECALCULATE);
+        fov_settings_type *stored = new_settings(FOV_SHAPE_CIRCLE_PRECALCULATE);
+        fov_settings_set_opacity_chunks(stored, chunks);
+        for (unsigned k = 0; k < 8; ++k) {
+            int px = (int)(k*41 % 150), py = (int)(k*23 % 100);
+            fov_circle_visibility(settings, &bitmap.bitmap, NULL, px, py, radius, &expected[0]);
+            fov_circle_visibility(stored, NULL, NULL, ox + px, oy + py, radius, &visible[0]);
+            BOOST_CHECK(visible == expected);
+            fov_beam_visibility(settings, &bitmap.bitmap, NULL, px, py, radius, FOV_WEST, 100.0f, &expected[0]);
+            fov_beam_visibility(stored, NULL, NULL, ox + px, oy + py, radius, FOV_WEST, 100.0f, &visible[0]);
+            BOOST_CHECK(visible == expected);
+            for (int d = -(int)radius; d <= (int)radius; d += 7)
+                BOOST_CHECK_EQUAL(los_lit(stored, NULL, NULL, ox + px, oy + py, ox + px + d, oy + py + d/2, radius),
+                                  los_lit(settings, &bitmap.bitmap, NULL, px, py, px + d, py + d/2, radius));
+        }
+
+        // Worker threads read it too.
+        vector<fov_los_query_type> queries(200), moved(200);
+        for (unsigned k = 0; k < queries.size(); ++k) {
+            fov_los_query_type& q = queries[k];
+            q.source_x = (int)(k*37 % 150);
+            q.source_y = (int)(k*23 % 100);
+            q.x = q.source_x + (int)(k*7 % 31) - 15;
+            q.y = q.source_y + (int)(k*11 % 31) - 15;
+            q.radius = 16;
+            moved[k] = q;
+            moved[k].source_x += ox;
+            moved[k].x += ox;
+            moved[k].source_y += oy;
+            moved[k].y += oy;
+        }
+        vector<uint64_t> los((queries.size() + 63)/64), stored_los(los.size());
+        fov_pool_type *pool = fov_pool_create(3);
+        BOOST_REQUIRE(pool != NULL);
+        BOOST_CHECK(fov_los_batch(settings, &bitmap.bitmap, NULL, &queries[0], queries.size(), &los[0], NULL));
+        BOOST_CHECK(fov_los_batch(stored, NULL, NULL, &moved[0], moved.size(), &stored_los[0], pool));
+        BOOST_CHECK(stored_los == los);
+        fov_pool_free(pool);
+        delete_settings(settings);
+        delete_settings(stored);
+        fov_chunks_free(chunks);
+    }
+
+    BOOST_AUTO_TEST_CASE(grid) {
+        const char *path = "fovtest.grid";
+        vector<string> raster = noisy_raster(150, 45, 31, 6);
+        Map map(raster);
+        Bitmap bitmap(map);
+
+        // Rows wider than needed, with junk past the width, which is
+        // not written.
+        vector<uint64_t> words(4*map.h, ~(uint64_t)0);
+        for (unsigned j = 0; j < map.h; ++j)
+            copy(bitmap.words.begin() + j*bitmap.bitmap.stride,
+                 bitmap.words.begin() + (j + 1)*bitmap.bitmap.stride, words.begin() + j*4);
+        for (unsigned j = 0; j < map.h; ++j)
+            words[j*4 + 2] |= ~(uint64_t)0 << (150 - 128);
+        fov_bitmap_type wide = bitmap.bitmap;
+        wide.stride = 4;
+        wide.bits = &words[0];
+
+        FILE *out = fopen(path, "wb");
+        BOOST_REQUIRE(out != NULL);
+        BOOST_CHECK(fov_grid_write(&wide, out));
+        fclose(out);
+        string file;
+        FILE *in = fopen(path, "rb");
+        BOOST_REQUIRE(in != NULL);
+        int c;
+        while ((c = fgetc(in)) != EOF)
+            file += (char)c;
+        fclose(in);
+        BOOST_CHECK_EQUAL(file.size(), 64u + 45*3*8u);
+        BOOST_CHECK(file.compare(0, 8, "LIBFOVGR") == 0);
+        // Tiles of one whole row: 3 words by 1 row.
+        BOOST_CHECK(file.compare(48, 8, string("\3\0\0\0\1\0\0\0", 8)) == 0);
+
+        fov_grid_type *grid = fov_grid_open(path);
+        BOOST_REQUIRE(grid != NULL);
+        BOOST_CHECK(fov_grid_verify(grid));
+        const fov_bitmap_type *mapped = fov_grid_bitmap(grid);
+        BOOST_CHECK_EQUAL(mapped->width, 150u);
+        BOOST_CHECK_EQUAL(mapped->height, 45u);
+        BOOST_CHECK(equal(mapped->bits, mapped->bits + 45*3, bitmap.words.begin()));
+
+        // Scanned in place, it lights what the map does.
+        const unsigned radius = 20;
+        vector<uint64_t> expected(fov_visibility_size(radius)), visible(expected.size());
+        fov_settings_type *settings = new_settings(FOV_SHAPE_CIRCLE);
+        for (unsigned k = 0; k < 6; ++k) {
+            int px = (int)(k*53 % 150), py = (int)(k*17 % 45);
+            fov_circle_visibility(settings, &bitmap.bitmap, NULL, px, py, radius, &expected[0]);
+            fov_circle_visibility(settings, mapped, NULL, px, py, radius, &visible[0]);
+            BOOST_CHECK(visible == expected);
+        }
+        delete_settings(settings);
+        fov_grid_close(grid);
+
+        // A damaged row fails the check; a damaged header or length,
+        // a tiling other than whole rows, or an offset which wraps the
+        // length around, fails to open.
+        for (unsigned damage = 0; damage < 6; ++damage) {
+            string bad = file;
+            if (damage == 0)
+                bad[64 + 100] ^= 4;
+            else if (damage == 1)
+                bad[17] ^= 1;
+            else if (damage == 2)
+                bad.resize(bad.size() - 8);
+            else if (damage == 3)
+                bad[8] = 2;
+            else {
+                if (damage == 4) {
+                    // Tiles two rows high.
+                    bad[52] = 2;
+                } else {
+                    // A thousand rows more, and the offset of the rows
+                    // moved back by their length, below zero, so that
+                    // offset plus rows wraps around to the file's length.
+                    uint64_t stride = 0, height = 0, offset;
+                    for (unsigned i = 0; i < 8; ++i)
+                        stride |= (uint64_t)(unsigned char)bad[24 + i] << (8*i);
+                    for (unsigned i = 0; i < 4; ++i)
+                        height |= (uint64_t)(unsigned char)bad[20 + i] << (8*i);
+                    height += 1000;
+                    offset = 64 - stride*8*1000;
+                    for (unsigned i = 0; i < 4; ++i)
+                        bad[20 + i] = (char)(height >> (8*i));
+                    for (unsigned i = 0; i < 8; ++i)
+                        bad[32 + i] = (char)(offset >> (8*i));
+                }
+                // With the header checksum made good.
+                uint64_t h = (((uint64_t)0xcbf29ce4u << 32) | 0x84222325u);
+                for (unsigned i = 0; i < 56; ++i)
+                    h = (h ^ (unsigned char)bad[i])*(((uint64_t)0x100u << 32) | 0x000001b3u);
+                for (unsigned i = 0; i < 8; ++i)
+                    bad[56 + i] = (char)(h >> (8*i));
+            }
+            out = fopen(path, "wb");
+            BOOST_REQUIRE(out != NULL);
+            fwrite(bad.data(), 1, bad.size(), out);
+            fclose(out);
+            grid = fov_grid_open(path);
+            if (damage == 0) {
+                BOOST_REQUIRE(grid != NULL);
+                BOOST_CHECK(!fov_grid_verify(grid));
+            } else {
+                BOOST_CHECK(grid == NULL);
+            }
+            fov_grid_close(grid);
+        }
+        BOOST_CHECK(fov_grid_open("no such file") == NULL);
+        remove(path);
+    }
+
+    BOOST_AUTO_TEST_CASE(arena) {
+        const unsigned radius = 24, radii[] = { 1, 9, radius };
+        const int sources[][2] = { { 35, 30 }, { 2, 58 } };
+        vector<string> raster = noisy_raster(70, 60, 37, 7);
+        Map map(raster);
+        Bitmap bitmap(map);
+        vector<vector<uint64_t> > expected;
+        fov_settings_type *settings = new_settings(FOV_SHAPE_CIRCLE_PRECALCULATE);
+        for (unsigned s = 0; s < 2; ++s)
+            BOOST_FOREACH(unsigned r, radii)
+                expected.push_back(calculate_all(settings, raster, bitmap,
+                                                 sources[s][0], sources[s][1], r));
+        delete_settings(settings);
+
+        vector<unsigned char> buffer(fov_arena_size(radius));
+        fov_arena_type arena;
+        fov_arena_init(&arena, &buffer[0], buffer.size());
+        fov_settings_type *heap = new_settings(FOV_SHAPE_CIRCLE_PRECALCULATE);
+        fov_settings_type *pooled = new_settings(FOV_SHAPE_CIRCLE_PRECALCULATE);
+        fov_settings_set_arena(pooled, &arena);
+
+        // Reserving takes memory from the allocator, or the arena.
+        fov_set_allocator(counted_alloc, counted_resize, counted_release);
+        allocations = 0;
+        BOOST_CHECK(fov_settings_reserve(heap, radius));
+        BOOST_CHECK(allocations > 0);
+        allocations = 0;
+        BOOST_CHECK(fov_settings_reserve(pooled, radius));
+        BOOST_CHECK_EQUAL(allocations, 0u);
+        BOOST_CHECK(arena.used > 0 && arena.used <= arena.size);
+
+        // After that, no calculation up to the radius allocates, and
+        // each gives the same results as before.
+        allocations_fail = true;
+        fov_settings_type *both[] = { heap, pooled };
+        BOOST_FOREACH(fov_settings_type *reserved, both) {
+            unsigned k = 0;
+            for (unsigned s = 0; s < 2; ++s)
+                BOOST_FOREACH(unsigned r, radii)
+                    BOOST_CHECK(calculate_all(reserved, raster, bitmap,
+                                              sources[s][0], sources[s][1], r) == expected[k++]);
+        }
+        BOOST_CHECK_EQUAL(allocations, 0u);
+
+        // Past the radius, the arena runs out rather than falling back
+        // on the allocator.
+        BOOST_CHECK(!fov_settings_reserve(pooled, radius + 1));
+        BOOST_CHECK_EQUAL(allocations, 0u);
+        BOOST_CHECK(!fov_settings_reserve(heap, radius + 1));
+        BOOST_CHECK(allocations > 0);
+
+        // Everything else goes through the allocator too.
+        BOOST_CHECK(fov_heights_create(10) == NULL);
+        BOOST_CHECK(fov_chunks_create() == NULL);
+        allocations_fail = false;
+        fov_set_allocator(NULL, NULL, NULL);
+        delete_settings(heap);
+
+        // Once its settings are freed, the arena can be set up again.
+        fov_settings_set_arena(pooled, NULL);
+        fov_arena_init(&arena, &buffer[0], 16);
+        fov_settings_set_arena(pooled, &arena);
+        BOOST_CHECK(!fov_settings_reserve(pooled, radius));
+        fov_settings_free(pooled);
+        fov_arena_init(&arena, &buffer[0], buffer.size());
+        BOOST_CHECK(fov_settings_reserve(pooled, radius));
+        BOOST_CHECK(calculate_all(pooled, raster, bitmap, 35, 30, radius) == expected[2]);
+        delete_settings(pooled);
+    }
+
+    BOOST_AUTO_TEST_CASE(beam_diagonal) {
+        fov_settings_type *settings = new_settings(FOV_SHAPE_SQUARE);
+        fov_settings_set_opacity_test_function(settings, opaque_never);
+        fov_settings_set_apply_lighting_function(settings, apply_record_set);
+
+        // The scanner used to drop a column holding only its diagonal
+        // tile, along with every column past it, in the octants which
+        // do not light their diagonals. This narrow beam then lit
+        // (9,-8) but not (8,-9).
+        const int before[][2] = {
+            { 1, -1 }, { 2, -2 }, { 3, -3 }, { 4, -4 }, { 5, -5 }, { 6, -6 },
+            { 7, -7 }, { 8, -8 }, { 9, -8 }, { 9, -9 }
+        };
+        OffsetSet lit, expected;
+        for (unsigned i = 0; i < sizeof(before)/sizeof(before[0]); ++i)
+            expected.insert(make_pair(before[i][0], before[i][1]));
+        expected.insert(make_pair(8, -9));
+        fov_beam(settings, NULL, &lit, 0, 0, 9, FOV_NORTHEAST, 5.0f);
+        BOOST_CHECK(lit == expected);
+
+        // On an open map, every narrow diagonal beam is symmetric about
+        // its diagonal.
+        const fov_shape_type shapes[] = {
+            FOV_SHAPE_CIRCLE_PRECALCULATE, FOV_SHAPE_SQUARE,
+            FOV_SHAPE_CIRCLE, FOV_SHAPE_OCTAGON
+        };
+        const fov_direction_type directions[] = {
+            FOV_NORTHEAST, FOV_NORTHWEST, FOV_SOUTHWEST, FOV_SOUTHEAST
+        };
+        unsigned asymmetric = 0;
+        BOOST_FOREACH(fov_shape_type shape, shapes) {
+            fov_settings_set_shape(settings, shape);
+            BOOST_FOREACH(fov_direction_type direction, directions) {
+                int flip = direction == FOV_NORTHEAST || direction == FOV_SOUTHWEST ? -1 : 1;
+                for (unsigned angle = 1; angle < 46; ++angle) {
+                    for (unsigned radius = 1; radius < 12; ++radius) {
+                        lit.clear();
+                        fov_beam(settings, NULL, &lit, 0, 0, radius, direction, (float)angle);
+                        OffsetSet::const_iterator it;
+                        for (it = lit.begin(); it != lit.end(); ++it)
+                            if (!lit.count(make_pair(flip*it->second, flip*it->first)))
+                                ++asymmetric;
+                    }
+                }
+            }
+        }
+        BOOST_CHECK_EQUAL(asymmetric, 0u);
+        delete_settings(settings);
+    }
+
+    BOOST_AUTO_TEST_CASE(scan_order) {
+        // Hashes of the callback sequences made by the scanner. The
+        // circle hashes were taken from the original recursive scanner,
+        // which the iterative scanner must match call for call. The beam
+        // hashes were taken again once the scanner stopped dropping
+        // columns holding only their diagonal tile (see beam_diagonal),
+        // which changes what wide beams light too.
+        const fov_shape_type shapes[] = {
+            FOV_SHAPE_CIRCLE_PRECALCULATE, FOV_SHAPE_SQUARE,
+            FOV_SHAPE_CIRCLE, FOV_SHAPE_OCTAGON
+        };
+        const uint32_t expected_circle[] = { 3119187519u, 1864382291u, 3119187519u, 4250975777u };
+        const uint32_t expected_beam[] = { 831099037u, 1009869425u, 831099037u, 781338067u };
+        vector<string> raster = noisy_raster(201, 201, 3, 40);
+        for (unsigned i = 0; i < 4; ++i) {
+            fov_settings_type settings;
+            fov_settings_init(&settings);
+            fov_settings_set_opacity_test_function(&settings, opaque_trace);
+            fov_settings_set_apply_lighting_function(&settings, apply_trace);
+            fov_settings_set_shape(&settings, shapes[i]);
+
+            Trace circle(raster);
+            fov_circle(&settings, &circle, NULL, 100, 100, 90);
+            BOOST_CHECK_EQUAL(circle.hash, expected_circle[i]);
+
+            Trace beam(raster);
+            fov_beam(&settings, &beam, NULL, 100, 100, 90, FOV_NORTHWEST, 200.0f);
+            BOOST_CHECK_EQUAL(beam.hash, expected_beam[i]);
+
+            fov_settings_free(&settings);
+        }
+    }
+
+    BOOST_AUTO_TEST_CASE(exact_circle_edge) {
+        // The edge of a circle falls exactly on
+        // floor(sqrt(radius*radius - dx*dx)), even for radii whose
+        // square is too big for a single precision float.
+        const unsigned radius = 4500;
+        vector<uint64_t> visible(fov_visibility_size(radius));
+        fov_settings_type settings;
+        fov_settings_init(&settings);
+        fov_settings_set_opacity_test_function(&settings, opaque_never);
+        fov_settings_set_shape(&settings, FOV_SHAPE_CIRCLE);
+        fov_circle_visibility(&settings, NULL, NULL, 0, 0, radius, &visible[0]);
+        fov_settings_free(&settings);
+        // Columns where the circle has no height are skipped entirely.
+        for (int dx = 1; dx < (int)radius; ++dx) {
+            uint64_t rem = (uint64_t)radius*radius - (uint64_t)dx*dx;
+            int h = 0;
+            while ((uint64_t)(h + 1)*(h + 1) <= rem)
+                ++h;
+            h = min(h, dx);
+            BOOST_CHECK(fov_visibility_test(&visible[0], radius, dx, h));
+            BOOST_CHECK(!fov_visibility_test(&visible[0], radius, dx, h + 1) || h == dx);
+        }
+    }
+
+    BOOST_AUTO_TEST_CASE(apply_span) {
+        const unsigned radius = 20;
+        const int px = 25, py = 22;
+        vector<string> raster = noisy_raster(50, 45, 11, 8);
+        const fov_opaque_apply_type modes[] = { FOV_OPAQUE_APPLY, FOV_OPAQUE_NOAPPLY };
+        BOOST_FOREACH(fov_opaque_apply_type mode, modes) {
+            fov_settings_type *settings = new_settings(FOV_SHAPE_CIRCLE);
+            fov_settings_set_opaque_apply(settings, mode);
+
+            Map expected(raster);
+            fov_circle(settings, &expected, NULL, px, py, radius);
+
+            SpanMap actual(raster);
+            settings->opaque = opaque_span_map;
+            fov_settings_set_apply_span_function(settings, apply_span_increment);
+            fov_circle(settings, &actual, NULL, px, py, radius);
+            BOOST_CHECK(actual.map.apply_count_map == expected.apply_count_map);
+            BOOST_CHECK(actual.map.opaque_count_map == expected.opaque_count_map);
+            delete_settings(settings);
+        }
+    }
+
+    BOOST_AUTO_TEST_CASE(apply_span_open) {
+        // With nothing in the way, every column of every octant is a
+        // single run, except the first column of the two octants which
+        // leave both their edge and their diagonal to their neighbours.
+        const unsigned radius = 10;
+        SpanMap map(vector<string>(21, string(21, '.')));
+        fov_settings_type *settings = new_settings(FOV_SHAPE_SQUARE);
+        settings->opaque = opaque_span_map;
+        fov_settings_set_apply_span_function(settings, apply_span_increment);
+        fov_circle(settings, &map, NULL, 10, 10, radius);
+        delete_settings(settings);
+        BOOST_CHECK_EQUAL(map.spans, 8*radius - 2);
+        vector<string> expected(21, string(21, '1'));
+        expected[10][10] = '0';
+        BOOST_CHECK(map.map.apply_count_map == CountMap(expected));
+    }
+
+    BOOST_AUTO_TEST_CASE(opaque_span) {
+        const fov_shape_type shapes[] = { FOV_SHAPE_CIRCLE, FOV_SHAPE_SQUARE };
+        const unsigned radius = 20;
+        const int px = 25, py = 22;
+        vector<string> raster = noisy_raster(50, 45, 5, 7);
+        BOOST_FOREACH(fov_shape_type shape, shapes) {
+            fov_settings_type *settings = new_settings(shape);
+
+            Map expected(raster);
+            fov_circle(settings, &expected, NULL, px, py, radius);
+
+            // The same tiles are queried as by the opacity test function,
+            // though tiles past a split in a column may be queried again.
+            Map actual(raster);
+            fov_settings_set_opacity_span_function(settings, opaque_span_increment);
+            fov_circle(settings, &actual, NULL, px, py, radius);
+            BOOST_CHECK(actual.apply_count_map == expected.apply_count_map);
+            for (unsigned j = 0; j < actual.h; ++j) {
+                for (unsigned i = 0; i < actual.w; ++i) {
+                    char a = actual.opaque_count_map.value(i, j);
+                    char e = expected.opaque_count_map.value(i, j);
+                    BOOST_CHECK((a == '0') == (e == '0') && a >= e);
+                }
+            }
+
+            for (int d = FOV_EAST; d <= FOV_SOUTHEAST; ++d) {
+                Map expected_beam(raster), actual_beam(raster);
+                fov_settings_set_opacity_span_function(settings, NULL);
+                fov_beam(settings, &expected_beam, NULL, px, py, radius, (fov_direction_type)d, 120.0f);
+                fov_settings_set_opacity_span_function(settings, opaque_span_increment);
+                fov_beam(settings, &actual_beam, NULL, px, py, radius, (fov_direction_type)d, 120.0f);
+                BOOST_CHECK(actual_beam.apply_count_map == expected_beam.apply_count_map);
+            }
+            delete_settings(settings);
+        }
+    }
+
+    BOOST_AUTO_TEST_CASE(template_front_end) {
+        // fov.hpp expands the same octant scanner as fov.c. It must make
+        // exactly the same calls as the C functions for every shape,
+        // beam and cone, on open, cluttered and dense maps, and with
+        // sources away from and against the edges of the map.
+        const fov_shape_type shapes[] = {
+            FOV_SHAPE_CIRCLE_PRECALCULATE, FOV_SHAPE_SQUARE,
+            FOV_SHAPE_CIRCLE, FOV_SHAPE_OCTAGON
+        };
+        const fov_opaque_apply_type modes[] = { FOV_OPAQUE_APPLY, FOV_OPAQUE_NOAPPLY };
+        const unsigned sparsities[] = { 1000, 30, 4 };
+        const int sources[][3] = { { 100, 100, 60 }, { 3, 197, 25 }, { 120, 0, 7 } };
+        const float angles[] = {
+            0.0f, 1.0f, 5.0f, 30.0f, 44.9f, 45.0f, 90.0f, 100.0f, 135.0f,
+            180.0f, 200.0f, 270.0f, 300.0f, 359.0f, 360.0f
+        };
+        const float pi = 3.14159265f;
+        const float half_angles[] = { -0.1f, 0.0f, 0.01f, pi/8, pi/4, 1.0f, pi/2, 2.5f, pi };
+        // Every 30 degrees from -180 to 360, the diagonals, and some
+        // headings off the octants' edges and past a full turn.
+        vector<float> directions;
+        for (int d = -6; d <= 12; ++d)
+            directions.push_back(d*pi/6);
+        for (int d = 1; d < 8; d += 2)
+            directions.push_back(d*pi/4);
+        directions.push_back(0.3f);
+        directions.push_back(-2.2f);
+        directions.push_back(10.0f);
+        unsigned calls = 0;
+        BOOST_FOREACH(unsigned sparsity, sparsities) {
+            vector<string> raster = noisy_raster(201, 201, 9, sparsity);
+            for (unsigned s = 0; s < sizeof(sources)/sizeof(sources[0]); ++s) {
+                const int px = sources[s][0], py = sources[s][1];
+                const unsigned radius = sources[s][2];
+                BOOST_FOREACH(fov_shape_type shape, shapes) {
+                    BOOST_FOREACH(fov_opaque_apply_type mode, modes) {
+                        fov_settings_type settings;
+                        fov_settings_init(&settings);
+                        fov_settings_set_opacity_test_function(&settings, opaque_trace);
+                        fov_settings_set_apply_lighting_function(&settings, apply_trace);
+                        fov_settings_set_shape(&settings, shape);
+                        fov_settings_set_opaque_apply(&settings, mode);
+                        fov::settings cxx_settings;
+                        cxx_settings.shape = shape;
+                        cxx_settings.opaque_apply = mode;
+
+                        Trace expected(raster, px, py), actual(raster, px, py);
+                        fov_circle(&settings, &expected, NULL, px, py, radius);
+                        fov::circle(cxx_settings, actual, TraceOpaque(), TraceApply(), px, py, radius);
+                        BOOST_CHECK_EQUAL(actual.hash, expected.hash);
+                        calls += expected.calls;
+
+                        for (int d = FOV_EAST; d <= FOV_SOUTHEAST; ++d) {
+                            BOOST_FOREACH(float angle, angles) {
+                                Trace expected_beam(raster, px, py), actual_beam(raster, px, py);
+                                fov_beam(&settings, &expected_beam, NULL, px, py, radius,
+                                         (fov_direction_type)d, angle);
+                                fov::beam(cxx_settings, actual_beam, TraceOpaque(), TraceApply(),
+                                          px, py, radius, (fov_direction_type)d, angle);
+                                BOOST_CHECK_EQUAL(actual_beam.hash, expected_beam.hash);
+                            }
+                        }
+
+                        BOOST_FOREACH(float direction, directions) {
+                            BOOST_FOREACH(float half_angle, half_angles) {
+                                Trace expected_cone(raster, px, py), actual_cone(raster, px, py);
+                                fov_cone(&settings, &expected_cone, NULL, px, py, radius,
+                                         direction, half_angle);
+                                fov::cone(cxx_settings, actual_cone, TraceOpaque(), TraceApply(),
+                                          px, py, radius, direction, half_angle);
+                                BOOST_CHECK_EQUAL(actual_cone.hash, expected_cone.hash);
+                            }
+                        }
+                        fov_settings_free(&settings);
+                    }
+                }
+            }
+        }
+        // The maps are not so dense that nothing is compared.
+        BOOST_CHECK(calls > 100000);
+    }
+
 BOOST_AUTO_TEST_SUITE_END()